@@ -0,0 +1,327 @@
+#include "Codec.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <faiss/index_io.h>
+#include <faiss/utils.h>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+
+    Codec *make_codec(const char *name, size_t d, size_t code_size)
+    {
+        if (!strcmp(name, "pq"))
+            return new PQCodec(d, code_size);
+        if (!strcmp(name, "pq4"))
+            return new PQ4Codec(d, code_size);
+        if (!strcmp(name, "sq8"))
+            return new SQ8Codec(d);
+        throw std::runtime_error(std::string("Unknown codec ") + name);
+    }
+
+    void Codec::compute_tables(size_t n, const float *queries, float *tables) const
+    {
+        for (size_t i = 0; i < n; i++)
+            compute_table(queries + i * d, tables + i * table_size);
+    }
+
+    /// Sum of M table lookups per code of M bytes, tables of 256 entries per byte
+    static void lookup_tables(size_t n, size_t M, const uint8_t *codes, const float *table, float *ips)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * M;
+            float result = 0.;
+            size_t m = 0;
+            for (; m + 4 <= M; m += 4) {
+                result += table[256 * m + code[m]];
+                result += table[256 * (m + 1) + code[m + 1]];
+                result += table[256 * (m + 2) + code[m + 2]];
+                result += table[256 * (m + 3) + code[m + 3]];
+            }
+            for (; m < M; m++)
+                result += table[256 * m + code[m]];
+            ips[i] = result;
+        }
+    }
+
+    /** lookup_tables specialized on the code size
+      *
+      * The compiler fully unrolls the loop over bytes, table offsets become constants
+      * and the lookups are split across independent accumulators.
+    */
+    template<size_t M>
+    static void lookup_tables_fixed(size_t n, size_t, const uint8_t *codes, const float *table, float *ips)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * M;
+            float result[4] = {0, 0, 0, 0};
+            for (size_t m = 0; m < M; m++)
+                result[m & 3] += table[256 * m + code[m]];
+            ips[i] = (result[0] + result[1]) + (result[2] + result[3]);
+        }
+    }
+
+    LookupKernel select_lookup_kernel(size_t M)
+    {
+        switch (M) {
+            case 8: return lookup_tables_fixed<8>;
+            case 16: return lookup_tables_fixed<16>;
+            case 32: return lookup_tables_fixed<32>;
+            case 64: return lookup_tables_fixed<64>;
+            default: return lookup_tables;
+        }
+    }
+
+    //=========
+    // PQCodec
+    //=========
+    PQCodec::PQCodec(size_t dim, size_t nsubq, size_t nbits):
+            Codec(dim, nsubq, nsubq, nsubq * 256)
+    {
+        if (nbits != 8)
+            throw std::runtime_error("PQCodec supports 8 bits per subquantizer index, use PQ4Codec for 4 bits");
+        pq = new faiss::ProductQuantizer(d, nsubq, nbits);
+        lookup = select_lookup_kernel(M);
+    }
+
+    PQCodec::PQCodec(const PQCodec &other): Codec(other), lookup(other.lookup)
+    {
+        pq = new faiss::ProductQuantizer(*other.pq);
+    }
+
+    PQCodec::~PQCodec()
+    {
+        delete pq;
+    }
+
+    void PQCodec::train(size_t n, const float *x)
+    {
+        printf("Training %zdx%zd product quantizer on %ld vectors in %zdD\n", pq->M, pq->ksub, n, d);
+        pq->verbose = verbose;
+        pq->train(n, x);
+    }
+
+    void PQCodec::encode(size_t n, const float *x, uint8_t *codes) const
+    {
+        pq->compute_codes(x, codes, n);
+    }
+
+    void PQCodec::decode(size_t n, const uint8_t *codes, float *x) const
+    {
+        pq->decode(codes, x, n);
+    }
+
+    void PQCodec::compute_table(const float *query, float *table) const
+    {
+        pq->compute_inner_prod_table(query, table);
+    }
+
+    void PQCodec::compute_tables(size_t n, const float *queries, float *tables) const
+    {
+        // faiss computes the tables of a batch with one GEMM per subquantizer
+        pq->compute_inner_prod_tables(n, queries, tables);
+    }
+
+    void PQCodec::inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const
+    {
+        lookup(n, M, codes, table, ips);
+    }
+
+    void PQCodec::write(const char *path) const
+    {
+        faiss::write_ProductQuantizer(pq, path);
+    }
+
+    void PQCodec::read(const char *path)
+    {
+        faiss::ProductQuantizer *loaded = faiss::read_ProductQuantizer(path);
+        if (loaded->d != d || loaded->M != M || loaded->ksub != 256) {
+            delete loaded;
+            throw std::runtime_error(std::string("Product quantizer in ") + path + " does not match the codec");
+        }
+        delete pq;
+        pq = loaded;
+    }
+
+    //==========
+    // PQ4Codec
+    //==========
+    PQ4Codec::PQ4Codec(size_t dim, size_t bytes_per_code):
+            Codec(dim, bytes_per_code, 2 * bytes_per_code, bytes_per_code * 256),
+            dsub(dim / (2 * bytes_per_code)), pq(dim, 2 * bytes_per_code, 4),
+            lookup(select_lookup_kernel(bytes_per_code))
+    {
+        if (d % M)
+            throw std::runtime_error("Dimension has to be a multiple of 2 * code_size for PQ4Codec");
+    }
+
+    void PQ4Codec::train(size_t n, const float *x)
+    {
+        printf("Training %zdx%zd product quantizer on %ld vectors in %zdD\n", pq.M, pq.ksub, n, d);
+        pq.verbose = verbose;
+        pq.train(n, x);
+    }
+
+    void PQ4Codec::encode(size_t n, const float *x, uint8_t *codes) const
+    {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; i++) {
+            uint8_t *code = codes + i * code_size;
+            memset(code, 0, code_size);
+            for (size_t m = 0; m < M; m++) {
+                const float *subvector = x + i * d + m * dsub;
+                float min_dist = std::numeric_limits<float>::max();
+                uint8_t min_idx = 0;
+                for (size_t c = 0; c < 16; c++) {
+                    const float dist = faiss::fvec_L2sqr(subvector, pq.get_centroids(m, c), dsub);
+                    if (dist < min_dist) {
+                        min_dist = dist;
+                        min_idx = c;
+                    }
+                }
+                code[m >> 1] |= (m & 1) ? min_idx << 4 : min_idx;
+            }
+        }
+    }
+
+    void PQ4Codec::decode(size_t n, const uint8_t *codes, float *x) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * code_size;
+            for (size_t m = 0; m < M; m++) {
+                const size_t c = (m & 1) ? code[m >> 1] >> 4 : code[m >> 1] & 15;
+                memcpy(x + i * d + m * dsub, pq.get_centroids(m, c), dsub * sizeof(float));
+            }
+        }
+    }
+
+    /// Combine the tables of subquantizers 2p (low bits) and 2p + 1 (high bits) into tables indexed by a code byte
+    static void combine_subtables(size_t code_size, const float *subtables, float *table)
+    {
+        for (size_t p = 0; p < code_size; p++) {
+            const float *low = subtables + 2 * p * 16;
+            const float *high = low + 16;
+            for (size_t c = 0; c < 256; c++)
+                table[p * 256 + c] = low[c & 15] + high[c >> 4];
+        }
+    }
+
+    void PQ4Codec::compute_table(const float *query, float *table) const
+    {
+        // Tables of 16 entries for each subquantizer
+        float subtables[M * 16];
+        pq.compute_inner_prod_table(query, subtables);
+        combine_subtables(code_size, subtables, table);
+    }
+
+    void PQ4Codec::compute_tables(size_t n, const float *queries, float *tables) const
+    {
+        std::vector<float> subtables(n * M * 16);
+        pq.compute_inner_prod_tables(n, queries, subtables.data());
+        for (size_t i = 0; i < n; i++)
+            combine_subtables(code_size, subtables.data() + i * M * 16, tables + i * table_size);
+    }
+
+    void PQ4Codec::inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const
+    {
+        lookup(n, code_size, codes, table, ips);
+    }
+
+    void PQ4Codec::write(const char *path) const
+    {
+        faiss::write_ProductQuantizer(&pq, path);
+    }
+
+    void PQ4Codec::read(const char *path)
+    {
+        faiss::ProductQuantizer *loaded = faiss::read_ProductQuantizer(path);
+        const bool matches = loaded->d == d && loaded->M == M && loaded->ksub == 16;
+        if (matches)
+            pq = *loaded;
+        delete loaded;
+        if (!matches)
+            throw std::runtime_error(std::string("Product quantizer in ") + path + " does not match the codec");
+    }
+
+    //==========
+    // SQ8Codec
+    //==========
+    SQ8Codec::SQ8Codec(size_t dim): Codec(dim, dim, 0, dim + 1), vmin(dim, 0), vdiff(dim, 0)
+    {}
+
+    void SQ8Codec::train(size_t n, const float *x)
+    {
+        printf("Training 8-bit scalar quantizer on %ld vectors in %zdD\n", n, d);
+        std::vector<float> vmax(d, -std::numeric_limits<float>::max());
+        std::fill(vmin.begin(), vmin.end(), std::numeric_limits<float>::max());
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = 0; j < d; j++) {
+                vmin[j] = std::min(vmin[j], x[i * d + j]);
+                vmax[j] = std::max(vmax[j], x[i * d + j]);
+            }
+        for (size_t j = 0; j < d; j++)
+            vdiff[j] = n ? vmax[j] - vmin[j] : 0;
+    }
+
+    void SQ8Codec::encode(size_t n, const float *x, uint8_t *codes) const
+    {
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = 0; j < d; j++) {
+                const float value = vdiff[j] > 0 ? (x[i * d + j] - vmin[j]) / vdiff[j] : 0;
+                codes[i * d + j] = std::round(std::min(std::max(value, 0.f), 1.f) * 255);
+            }
+    }
+
+    void SQ8Codec::decode(size_t n, const uint8_t *codes, float *x) const
+    {
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = 0; j < d; j++)
+                x[i * d + j] = vmin[j] + codes[i * d + j] * vdiff[j] / 255;
+    }
+
+    void SQ8Codec::compute_table(const float *query, float *table) const
+    {
+        // (x|y) = (x|vmin) + sum_j x_j * vdiff_j / 255 * code_j
+        float offset = 0;
+        for (size_t j = 0; j < d; j++) {
+            table[j] = query[j] * vdiff[j] / 255;
+            offset += query[j] * vmin[j];
+        }
+        table[d] = offset;
+    }
+
+    void SQ8Codec::inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * d;
+            float result = 0;
+            for (size_t j = 0; j < d; j++)
+                result += table[j] * code[j];
+            ips[i] = table[d] + result;
+        }
+    }
+
+    void SQ8Codec::write(const char *path) const
+    {
+        std::ofstream output(path, std::ios::binary);
+        write_variable(output, d);
+        write_vector(output, vmin);
+        write_vector(output, vdiff);
+    }
+
+    void SQ8Codec::read(const char *path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        size_t dim = 0;
+        read_variable(input, dim);
+        if (!input || dim != d)
+            throw std::runtime_error(std::string("Scalar quantizer in ") + path + " does not match the codec");
+        read_vector(input, vmin);
+        read_vector(input, vdiff);
+    }
+}
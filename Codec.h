@@ -0,0 +1,161 @@
+#ifndef IVF_HNSW_LIB_CODEC_H
+#define IVF_HNSW_LIB_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <faiss/ProductQuantizer.h>
+
+namespace ivfhnsw {
+    /** Fine quantizer of residual vectors
+      *
+      * Search computes the inner products of a query with the decoded residuals
+      * (term 3 of the distance decomposition, see IndexIVF_HNSW::search) via a query table:
+      * compute_table() fills the table once per query (compute_tables() for a batch of queries),
+      * inner_products() is the scan kernel over codes.
+      * The OPQ rotation stays in the index, as the coarse quantizer is rotated with it.
+    */
+    struct Codec
+    {
+        size_t d;            ///< Vector dimension
+        size_t code_size;    ///< Code size per vector in bytes
+        size_t M;            ///< Number of subspaces the codec splits vectors into, OPQ is trained for them (0 - no OPQ)
+        size_t table_size;   ///< Size of the query table
+        bool verbose;
+
+        Codec(size_t dim, size_t bytes_per_code, size_t nsubspaces, size_t query_table_size):
+                d(dim), code_size(bytes_per_code), M(nsubspaces), table_size(query_table_size), verbose(false)
+        {}
+        virtual ~Codec() {}
+
+        /// Train on n vectors, size n * d
+        virtual void train(size_t n, const float *x) = 0;
+
+        /// Encode n vectors, size n * d, to codes, size n * code_size
+        virtual void encode(size_t n, const float *x, uint8_t *codes) const = 0;
+
+        /// Decode n codes, size n * code_size, to vectors, size n * d
+        virtual void decode(size_t n, const uint8_t *codes, float *x) const = 0;
+
+        /// Fill the table of size table_size for the query of dimension d
+        virtual void compute_table(const float *query, float *table) const = 0;
+
+        /// Fill the tables of n queries, size n * table_size, codecs override it with a batched computation
+        virtual void compute_tables(size_t n, const float *queries, float *tables) const;
+
+        /** Scan kernel: inner products of the query with n decoded codes
+          *
+          * @param n       number of codes
+          * @param codes   codes, size n * code_size
+          * @param table   query table filled by compute_table
+          * @param ips     output inner products, size n
+        */
+        virtual void inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const = 0;
+
+        /// Deep copy, e.g. a replica for a NUMA node
+        virtual Codec *clone() const = 0;
+
+        /// Bytes of the trained parameters
+        virtual size_t memory_usage() const = 0;
+
+        /// Write the trained codec to the path
+        virtual void write(const char *path) const = 0;
+
+        /// Read the codec written by write() from the path
+        virtual void read(const char *path) = 0;
+    };
+
+    /** Codec by name
+      *
+      * - pq:  product quantizer with code_size subquantizers of 256 centroids
+      * - pq4: product quantizer with 2 * code_size subquantizers of 16 centroids
+      * - sq8: per-dimension 8-bit scalar quantizer, code_size is d
+    */
+    Codec *make_codec(const char *name, size_t d, size_t code_size);
+
+    /// Scan kernel summing M lookups per code in tables of 256 entries per code byte
+    typedef void (*LookupKernel)(size_t n, size_t M, const uint8_t *codes, const float *table, float *ips);
+
+    /// Kernel specialized for M in {8, 16, 32, 64}, the generic one otherwise
+    LookupKernel select_lookup_kernel(size_t M);
+
+    /// Product quantizer with 8-bit subquantizer indices
+    struct PQCodec: Codec
+    {
+        faiss::ProductQuantizer *pq;
+        LookupKernel lookup;    ///< Scan kernel selected for M at construction
+
+        PQCodec(size_t dim, size_t nsubq, size_t nbits = 8);
+        PQCodec(const PQCodec &other);
+        PQCodec &operator=(const PQCodec &other) = delete;
+        ~PQCodec();
+
+        void train(size_t n, const float *x) override;
+        void encode(size_t n, const float *x, uint8_t *codes) const override;
+        void decode(size_t n, const uint8_t *codes, float *x) const override;
+        void compute_table(const float *query, float *table) const override;
+        void compute_tables(size_t n, const float *queries, float *tables) const override;
+        void inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const override;
+        Codec *clone() const override { return new PQCodec(*this); }
+        size_t memory_usage() const override { return pq->centroids.capacity() * sizeof(float); }
+
+        /// Write in the faiss ProductQuantizer format
+        void write(const char *path) const override;
+        void read(const char *path) override;
+    };
+
+    /** Product quantizer with 4-bit indices, two indices per byte
+      *
+      * The per-subquantizer tables of 16 entries are combined pairwise into tables of 256 entries
+      * indexed by a code byte, so a code of code_size bytes is scanned with code_size lookups
+      * from a table of code_size * 256 floats, as 8-bit PQ codes of the same size.
+    */
+    struct PQ4Codec: Codec
+    {
+        size_t dsub;                          ///< Dimension of each subvector
+        faiss::ProductQuantizer pq;           ///< Trains and stores the centroids of 2 * code_size subquantizers
+        LookupKernel lookup;                  ///< Scan kernel selected for code_size at construction
+
+        PQ4Codec(size_t dim, size_t bytes_per_code);
+
+        void train(size_t n, const float *x) override;
+        void encode(size_t n, const float *x, uint8_t *codes) const override;
+        void decode(size_t n, const uint8_t *codes, float *x) const override;
+        void compute_table(const float *query, float *table) const override;
+        void compute_tables(size_t n, const float *queries, float *tables) const override;
+        void inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const override;
+        Codec *clone() const override { return new PQ4Codec(*this); }
+        size_t memory_usage() const override { return pq.centroids.capacity() * sizeof(float); }
+
+        /// Write in the faiss ProductQuantizer format
+        void write(const char *path) const override;
+        void read(const char *path) override;
+    };
+
+    /** Scalar quantizer with 8 bits per dimension
+      *
+      * Each dimension is uniformly quantized between the min and the max over the training vectors.
+      * The query table holds the query scaled per dimension, so the kernel is a dot product of
+      * the table with the code bytes, vectorized by the compiler.
+    */
+    struct SQ8Codec: Codec
+    {
+        std::vector<float> vmin;    ///< Min value of each dimension
+        std::vector<float> vdiff;   ///< Range of each dimension
+
+        explicit SQ8Codec(size_t dim);
+
+        void train(size_t n, const float *x) override;
+        void encode(size_t n, const float *x, uint8_t *codes) const override;
+        void decode(size_t n, const uint8_t *codes, float *x) const override;
+        void compute_table(const float *query, float *table) const override;
+        void inner_products(size_t n, const uint8_t *codes, const float *table, float *ips) const override;
+        Codec *clone() const override { return new SQ8Codec(*this); }
+        size_t memory_usage() const override { return (vmin.capacity() + vdiff.capacity()) * sizeof(float); }
+
+        void write(const char *path) const override;
+        void read(const char *path) override;
+    };
+}
+#endif //IVF_HNSW_LIB_CODEC_H
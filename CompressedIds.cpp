@@ -0,0 +1,77 @@
+#include "CompressedIds.h"
+
+#include <algorithm>
+
+namespace ivfhnsw {
+
+    const size_t CompressedIds::block_size;
+
+    /// Number of bits to represent x
+    static size_t nbits(uint64_t x)
+    {
+        size_t width = 0;
+        while (x) {
+            width++;
+            x >>= 1;
+        }
+        return width;
+    }
+
+    CompressedIds::CompressedIds(const std::vector<idx_t> &ids): size(ids.size())
+    {
+        for (size_t start = 0; start < size; start += block_size) {
+            const size_t n = std::min(block_size, size - start);
+            const idx_t *block_ids = ids.data() + start;
+            block_offsets.push_back(data.size());
+
+            const bool sorted = std::is_sorted(block_ids, block_ids + n);
+            const idx_t anchor = sorted ? block_ids[0] : *std::min_element(block_ids, block_ids + n);
+
+            // Values to pack: deltas for sorted blocks, offsets from the min otherwise
+            std::vector<uint64_t> values;
+            if (sorted)
+                for (size_t j = 1; j < n; j++)
+                    values.push_back(block_ids[j] - block_ids[j - 1]);
+            else
+                for (size_t j = 0; j < n; j++)
+                    values.push_back(block_ids[j] - anchor);
+
+            size_t width = 0;
+            for (uint64_t value : values)
+                width = std::max(width, nbits(value));
+
+            uint8_t mode = sorted ? DELTA : FOR;
+            if (width > 56)
+                mode = RAW;
+
+            data.push_back(mode);
+            data.push_back(width);
+            const size_t anchor_offset = data.size();
+            data.resize(anchor_offset + sizeof(idx_t));
+            memcpy(data.data() + anchor_offset, &anchor, sizeof(idx_t));
+
+            const size_t values_offset = data.size();
+            if (mode == RAW) {
+                data.resize(values_offset + n * sizeof(idx_t));
+                memcpy(data.data() + values_offset, block_ids, n * sizeof(idx_t));
+                continue;
+            }
+            data.resize(values_offset + (values.size() * width + 7) / 8, 0);
+            for (size_t t = 0; t < values.size(); t++)
+                for (size_t b = 0; b < width; b++)
+                    if ((values[t] >> b) & 1) {
+                        const size_t bit = t * width + b;
+                        data[values_offset + (bit >> 3)] |= 1 << (bit & 7);
+                    }
+        }
+        // Padding for 8-byte reads of the last values
+        data.resize(data.size() + sizeof(uint64_t), 0);
+    }
+
+    void CompressedIds::decode(std::vector<idx_t> &ids) const
+    {
+        ids.resize(size);
+        for (size_t i = 0; i < size; i++)
+            ids[i] = get(i);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef IVF_HNSW_LIB_COMPRESSED_IDS_H
+#define IVF_HNSW_LIB_COMPRESSED_IDS_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+    /** Compressed vector indices of an inverted list
+      *
+      * Indices are split into blocks of <block_size>. A block is stored as
+      * [mode][width][anchor][bit-packed values]:
+      * - DELTA: the block is sorted, anchor is the first index and values are
+      *   the differences between consecutive indices,
+      * - FOR: anchor is the min index of the block and values are offsets from it,
+      * - RAW: indices are stored as is (widths above 56 bits, only with 64-bit ids).
+      *
+      * Any index is decoded without touching other blocks, so search decodes
+      * indices lazily, only for the codes entering the heap.
+    */
+    struct CompressedIds
+    {
+        typedef label_t idx_t;
+
+        static const size_t block_size = 32;
+        enum BlockMode: uint8_t { DELTA, FOR, RAW };
+
+        size_t size;                          ///< Number of indices
+        std::vector<uint32_t> block_offsets;  ///< Byte offsets of the blocks in data
+        std::vector<uint8_t> data;            ///< Blocks followed by 8 padding bytes
+
+        CompressedIds(): size(0) {}
+        explicit CompressedIds(const std::vector<idx_t> &ids);
+
+        /// Decode the i-th index
+        inline idx_t get(size_t i) const
+        {
+            const uint8_t *block = data.data() + block_offsets[i / block_size];
+            const size_t r = i % block_size;
+            const uint8_t mode = block[0];
+            const uint8_t width = block[1];
+
+            idx_t anchor;
+            memcpy(&anchor, block + 2, sizeof(idx_t));
+            const uint8_t *values = block + 2 + sizeof(idx_t);
+
+            if (mode == DELTA) {
+                for (size_t t = 0; t < r; t++)
+                    anchor += extract(values, t, width);
+                return anchor;
+            }
+            if (mode == FOR)
+                return anchor + extract(values, r, width);
+
+            idx_t id;
+            memcpy(&id, values + r * sizeof(idx_t), sizeof(idx_t));
+            return id;
+        }
+
+        /// Decode all indices
+        void decode(std::vector<idx_t> &ids) const;
+
+        /// Memory consumption in bytes
+        size_t memory_usage() const { return data.size() + block_offsets.size() * sizeof(uint32_t); }
+
+    private:
+        static inline uint64_t extract(const uint8_t *values, size_t t, size_t width)
+        {
+            const size_t bit = t * width;
+            uint64_t word;
+            memcpy(&word, values + (bit >> 3), sizeof(uint64_t));
+            return (word >> (bit & 7)) & ((width == 64) ? ~0ULL : ((1ULL << width) - 1));
+        }
+    };
+}
+#endif //IVF_HNSW_LIB_COMPRESSED_IDS_H
@@ -0,0 +1,207 @@
+#ifndef IVF_HNSW_LIB_DATASET_H
+#define IVF_HNSW_LIB_DATASET_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+namespace ivfhnsw {
+    /** Memory-mapped vectors in the fvecs/ivecs/bvecs format
+      *
+      * A record is the dimension as uint32 followed by d values of type T.
+      * The file is mapped read-only: vectors are accessed by index without copying,
+      * read() copies ranges of vectors converting the values, in parallel for large ranges.
+      * Malformed files and out-of-range reads throw std::runtime_error.
+      *
+      * Header-only, so that hnswlib can load quantizer data with it as well.
+    */
+    template<typename T>
+    class XvecDataset
+    {
+    public:
+        /** Map the file
+          *
+          * @param path   path to the file
+          * @param dim    expected dimension, 0 - take it from the first record
+        */
+        explicit XvecDataset(const char *path, size_t dim = 0): path(path), d(dim), n(0), data(nullptr), file_size(0)
+        {
+            const int fd = open(path, O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error(std::string("Unable to open ") + path);
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                throw std::runtime_error(std::string("Unable to stat ") + path);
+            }
+            file_size = st.st_size;
+            if (file_size < sizeof(uint32_t)) {
+                close(fd);
+                throw std::runtime_error(std::string("No vectors in ") + path);
+            }
+            void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED)
+                throw std::runtime_error(std::string("Unable to map ") + path);
+            data = (const char *) mapped;
+
+            uint32_t header;
+            memcpy(&header, data, sizeof(uint32_t));
+            if (d == 0)
+                d = header;
+            record_size = sizeof(uint32_t) + d * sizeof(T);
+            if (header != d || file_size % record_size != 0) {
+                munmap(mapped, file_size);
+                throw std::runtime_error(std::string("Dimension of ") + path + " is not " + std::to_string(d) +
+                                         " or the file size is not a multiple of the record size");
+            }
+            n = file_size / record_size;
+        }
+
+        ~XvecDataset()
+        {
+            munmap((void *) data, file_size);
+        }
+
+        XvecDataset(const XvecDataset &) = delete;
+        XvecDataset &operator=(const XvecDataset &) = delete;
+
+        /// Vector dimension
+        size_t dim() const { return d; }
+
+        /// Number of vectors
+        size_t size() const { return n; }
+
+        /// Values of vector i, size d
+        const T *vector(size_t i) const
+        {
+            check_range(i, 1);
+            check_header(i);
+            return values(i);
+        }
+
+        /** Copy vectors [i0, i0 + count) converting the values to U
+          *
+          * @param out   output vectors, size count * d
+        */
+        template<typename U>
+        void read(size_t i0, size_t count, U *out) const
+        {
+            check_range(i0, count);
+            bool valid = true;
+#pragma omp parallel for reduction(&&: valid) if (count * d >= parallel_threshold)
+            for (size_t i = 0; i < count; i++) {
+                uint32_t header;
+                memcpy(&header, data + (i0 + i) * record_size, sizeof(uint32_t));
+                valid = valid && header == d;
+                const T *src = values(i0 + i);
+                U *dst = out + i * d;
+                for (size_t j = 0; j < d; j++)
+                    dst[j] = src[j];
+            }
+            // Find the malformed record outside of the parallel region to report it
+            if (!valid)
+                for (size_t i = i0; i < i0 + count; i++)
+                    check_header(i);
+        }
+
+        /// Ask the kernel to read vectors [i0, i0 + count) ahead
+        void prefetch(size_t i0, size_t count) const
+        {
+            if (i0 >= n)
+                return;
+            count = std::min(count, n - i0);
+            const size_t page_size = sysconf(_SC_PAGESIZE);
+            const size_t begin = i0 * record_size / page_size * page_size;
+            const size_t end = (i0 + count) * record_size;
+            madvise((void *) (data + begin), end - begin, MADV_WILLNEED);
+        }
+
+    private:
+        static const size_t parallel_threshold = 1 << 20;  ///< Values to convert to use all threads in read()
+
+        std::string path;
+        size_t d;              ///< Vector dimension
+        size_t n;              ///< Number of vectors
+        size_t record_size;    ///< Size of a record with its dimension header in bytes
+        const char *data;      ///< Mapped file
+        size_t file_size;
+
+        const T *values(size_t i) const
+        {
+            return (const T *) (data + i * record_size + sizeof(uint32_t));
+        }
+
+        void check_range(size_t i0, size_t count) const
+        {
+            if (i0 > n || count > n - i0)
+                throw std::runtime_error("Vectors [" + std::to_string(i0) + ", " + std::to_string(i0 + count) +
+                                         ") are out of " + std::to_string(n) + " vectors in " + path);
+        }
+
+        void check_header(size_t i) const
+        {
+            uint32_t header;
+            memcpy(&header, data + i * record_size, sizeof(uint32_t));
+            if (header != d)
+                throw std::runtime_error("Vector " + std::to_string(i) + " in " + path + " has dimension " +
+                                         std::to_string(header) + " instead of " + std::to_string(d));
+        }
+    };
+
+    /** Sequential reader of batches of a XvecDataset
+      *
+      * Each call of next() copies the next batch and asks the kernel to read the following one ahead,
+      * so the disk works while the caller processes the batch.
+    */
+    template<typename T>
+    class XvecBatchReader
+    {
+    public:
+        /** @param dataset      dataset to read
+          * @param batch_size   number of vectors per batch
+          * @param begin        first vector to read
+          * @param end          vector to stop at, the dataset size by default
+        */
+        XvecBatchReader(const XvecDataset<T> &dataset, size_t batch_size, size_t begin = 0, size_t end = SIZE_MAX):
+                dataset(dataset), batch_size(batch_size), pos(begin), end(std::min(end, dataset.size()))
+        {
+            dataset.prefetch(pos, batch_size);
+        }
+
+        /// First vector of the next batch
+        size_t position() const { return pos; }
+
+        /** Read the next batch converting the values to U
+          *
+          * @param batch   output vectors, size batch_size * d
+          * @return number of vectors read, 0 at the end
+        */
+        template<typename U>
+        size_t next(U *batch)
+        {
+            const size_t count = pos < end ? std::min(batch_size, end - pos) : 0;
+            if (count == 0)
+                return 0;
+            dataset.prefetch(pos + count, batch_size);
+            dataset.read(pos, count, batch);
+            pos += count;
+            return count;
+        }
+
+    private:
+        const XvecDataset<T> &dataset;
+        size_t batch_size;
+        size_t pos;       ///< First vector of the next batch
+        size_t end;
+    };
+}
+#endif //IVF_HNSW_LIB_DATASET_H
@@ -0,0 +1,96 @@
+#include "GroundTruth.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+#include <faiss/Heap.h>
+#include <faiss/utils.h>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+
+    /// Mark at the start of checkpoint files, "IVFHGTCP"
+    static const size_t checkpoint_mark = 0x5043544748465649;
+
+    GroundTruth::GroundTruth(size_t dim, size_t nqueries, size_t nneighbours, const float *x):
+            d(dim), nq(nqueries), k(nneighbours), queries(x, x + nqueries * dim),
+            distances(nqueries * nneighbours), labels(nqueries * nneighbours), ntotal(0)
+    {
+        for (size_t i = 0; i < nq; i++)
+            faiss::maxheap_heapify(k, distances.data() + i * k, labels.data() + i * k);
+    }
+
+    void GroundTruth::add(size_t n, const float *x, size_t id0)
+    {
+        // Top-k of the block, knn_L2sqr tiles the queries and the block for the GEMM
+        std::vector<float> block_distances(nq * k);
+        std::vector<long> block_labels(nq * k);
+        faiss::float_maxheap_array_t block_heaps = {nq, k, block_labels.data(), block_distances.data()};
+        faiss::knn_L2sqr(queries.data(), x, d, nq, n, &block_heaps);
+
+#pragma omp parallel for
+        for (size_t q = 0; q < nq; q++) {
+            long *ids = block_labels.data() + q * k;
+            for (size_t j = 0; j < k; j++)
+                if (ids[j] >= 0)
+                    ids[j] += id0;
+            faiss::maxheap_addn(k, distances.data() + q * k, labels.data() + q * k,
+                                block_distances.data() + q * k, ids, std::min(k, n));
+        }
+        ntotal += n;
+    }
+
+    void GroundTruth::get(float *out_distances, long *out_labels) const
+    {
+        std::copy(distances.begin(), distances.end(), out_distances);
+        std::copy(labels.begin(), labels.end(), out_labels);
+#pragma omp parallel for
+        for (size_t q = 0; q < nq; q++)
+            faiss::maxheap_reorder(k, out_distances + q * k, out_labels + q * k);
+    }
+
+    void GroundTruth::write_checkpoint(const char *path) const
+    {
+        // Write a temporary file and rename it, so that an interrupted write keeps the previous checkpoint
+        const std::string tmp_path = std::string(path) + ".tmp";
+        {
+            std::ofstream output(tmp_path, std::ios::binary);
+            write_variable(output, checkpoint_mark);
+            write_variable(output, d);
+            write_variable(output, nq);
+            write_variable(output, k);
+            write_variable(output, ntotal);
+            output.write((char *) distances.data(), distances.size() * sizeof(float));
+            output.write((char *) labels.data(), labels.size() * sizeof(long));
+            if (!output)
+                throw std::runtime_error("Unable to write checkpoint " + tmp_path);
+        }
+        if (rename(tmp_path.c_str(), path) != 0)
+            throw std::runtime_error(std::string("Unable to replace checkpoint ") + path);
+    }
+
+    void GroundTruth::read_checkpoint(const char *path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        size_t mark = 0, dim = 0, nqueries = 0, nneighbours = 0, nadded = 0;
+        read_variable(input, mark);
+        read_variable(input, dim);
+        read_variable(input, nqueries);
+        read_variable(input, nneighbours);
+        read_variable(input, nadded);
+        if (!input || mark != checkpoint_mark)
+            throw std::runtime_error(std::string("No ground truth checkpoint in ") + path);
+        if (dim != d || nqueries != nq || nneighbours != k)
+            throw std::runtime_error(std::string("Checkpoint ") + path + " is for other d, nq or k");
+
+        input.read((char *) distances.data(), distances.size() * sizeof(float));
+        input.read((char *) labels.data(), labels.size() * sizeof(long));
+        if (!input)
+            throw std::runtime_error(std::string("Checkpoint ") + path + " is truncated");
+        ntotal = nadded;
+    }
+}
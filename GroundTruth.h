@@ -0,0 +1,51 @@
+#ifndef IVF_HNSW_LIB_GROUND_TRUTH_H
+#define IVF_HNSW_LIB_GROUND_TRUTH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ivfhnsw {
+    /** Exact L2 k nearest neighbours of a query set over a streamed base set
+      *
+      * Base vectors are added in blocks. Distances between the queries and a block are computed
+      * by faiss::knn_L2sqr (BLAS GEMM plus the norms, queries and base vectors tiled), the top-k of the block
+      * is merged into the running max heaps of the queries in parallel over the queries.
+      * The running heaps and the number of added vectors can be checkpointed and resumed,
+      * so memory is bounded by the queries, the heaps and one block.
+    */
+    struct GroundTruth
+    {
+        size_t d;                      ///< Vector dimension
+        size_t nq;                     ///< Number of queries
+        size_t k;                      ///< Number of nearest neighbours per query
+        std::vector<float> queries;    ///< Query vectors, size nq * d
+        std::vector<float> distances;  ///< Max heaps of distances to the nearest neighbours, size nq * k
+        std::vector<long> labels;      ///< Max heaps of ids of the nearest neighbours, size nq * k
+        size_t ntotal;                 ///< Number of base vectors added so far
+
+        GroundTruth(size_t dim, size_t nqueries, size_t nneighbours, const float *x);
+
+        /** Add a block of base vectors with consecutive ids
+          *
+          * @param n     number of base vectors
+          * @param x     base vectors, size n * d
+          * @param id0   id of the first vector
+        */
+        void add(size_t n, const float *x, size_t id0);
+
+        /** Nearest neighbours sorted by increasing distance, the heaps are left intact
+          *
+          * @param out_distances   output distances, size nq * k
+          * @param out_labels      output ids, -1 if fewer than k vectors are added, size nq * k
+        */
+        void get(float *out_distances, long *out_labels) const;
+
+        /// Write the heaps and ntotal, the file is replaced atomically
+        void write_checkpoint(const char *path) const;
+
+        /// Read a checkpoint written by write_checkpoint for the same d, nq and k
+        void read_checkpoint(const char *path);
+    };
+}
+#endif //IVF_HNSW_LIB_GROUND_TRUTH_H
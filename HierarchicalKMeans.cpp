@@ -0,0 +1,131 @@
+#include "HierarchicalKMeans.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <faiss/Clustering.h>
+#include <faiss/IndexFlat.h>
+
+namespace ivfhnsw {
+
+    HierarchicalKMeans::HierarchicalKMeans(size_t dim, size_t ncentroids):
+            d(dim), nc(ncentroids), nc1(0), niter(10), max_points_per_centroid(256), seed(1234), verbose(true)
+    {}
+
+    /// Run faiss k-means, returns the centroids in <centroids>, size k * d
+    static void kmeans(size_t d, size_t n, size_t k, const float *x, float *centroids,
+                       size_t niter, size_t max_points_per_centroid, long seed, bool verbose)
+    {
+        faiss::ClusteringParameters cp;
+        cp.niter = niter;
+        cp.max_points_per_centroid = max_points_per_centroid;
+        cp.seed = seed;
+        cp.verbose = verbose;
+
+        faiss::Clustering clustering(d, k, cp);
+        faiss::IndexFlatL2 index(d);
+        clustering.train(n, x, index);
+        memcpy(centroids, clustering.centroids.data(), k * d * sizeof(float));
+    }
+
+    void HierarchicalKMeans::train(size_t n, const float *x, float *centroids)
+    {
+        if (n < nc)
+            throw std::runtime_error("Number of learn vectors has to be at least the number of centroids");
+
+        const size_t ntop = std::min(nc1 ? nc1 : (size_t) std::sqrt((double) nc), nc);
+
+        // Train top-level clusters
+        if (verbose)
+            std::cout << "Training " << ntop << " top-level clusters on " << n << " vectors" << std::endl;
+        std::vector<float> top_centroids(ntop * d);
+        kmeans(d, n, ntop, x, top_centroids.data(), niter, max_points_per_centroid, seed, false);
+
+        // Assign learn vectors to the top-level clusters
+        std::vector<faiss::Index::idx_t> assigned(n);
+        {
+            faiss::IndexFlatL2 index(d);
+            index.add(ntop, top_centroids.data());
+            std::vector<float> distances(n);
+            index.search(n, x, 1, distances.data(), assigned.data());
+        }
+
+        // Group learn vector indices by the top-level clusters
+        std::vector<size_t> cluster_sizes(ntop, 0);
+        for (size_t i = 0; i < n; i++)
+            cluster_sizes[assigned[i]]++;
+
+        std::vector<size_t> cluster_offsets(ntop + 1, 0);
+        for (size_t c = 0; c < ntop; c++)
+            cluster_offsets[c + 1] = cluster_offsets[c] + cluster_sizes[c];
+
+        std::vector<size_t> members(n);
+        {
+            std::vector<size_t> positions(cluster_offsets.begin(), cluster_offsets.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                members[positions[assigned[i]]++] = i;
+        }
+
+        // Split centroids proportionally to cluster sizes, at most one centroid per vector
+        std::vector<size_t> cluster_ncentroids(ntop);
+        std::vector<double> remainders(ntop);
+        size_t nassigned = 0;
+        for (size_t c = 0; c < ntop; c++) {
+            const double share = (double) nc * cluster_sizes[c] / n;
+            cluster_ncentroids[c] = std::min((size_t) share, cluster_sizes[c]);
+            remainders[c] = share - cluster_ncentroids[c];
+            nassigned += cluster_ncentroids[c];
+        }
+        // Distribute the rest by the largest remainders among clusters with spare vectors
+        std::vector<size_t> order(ntop);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return remainders[a] > remainders[b]; });
+        while (nassigned < nc)
+            for (size_t c : order) {
+                if (nassigned == nc)
+                    break;
+                if (cluster_ncentroids[c] < cluster_sizes[c]) {
+                    cluster_ncentroids[c]++;
+                    nassigned++;
+                }
+            }
+
+        std::vector<size_t> centroid_offsets(ntop + 1, 0);
+        for (size_t c = 0; c < ntop; c++)
+            centroid_offsets[c + 1] = centroid_offsets[c] + cluster_ncentroids[c];
+
+        // Train centroids of the clusters, the largest clusters first for load balancing
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return cluster_sizes[a] > cluster_sizes[b]; });
+        size_t ndone = 0;
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < ntop; i++) {
+            const size_t c = order[i];
+            const size_t k = cluster_ncentroids[c];
+            if (k == 0)
+                continue;
+
+            const size_t size = cluster_sizes[c];
+            std::vector<float> cluster(size * d);
+            for (size_t j = 0; j < size; j++)
+                memcpy(cluster.data() + j * d, x + members[cluster_offsets[c] + j] * d, d * sizeof(float));
+
+            float *cluster_centroids = centroids + centroid_offsets[c] * d;
+            if (k == size)
+                memcpy(cluster_centroids, cluster.data(), size * d * sizeof(float));
+            else
+                kmeans(d, size, k, cluster.data(), cluster_centroids, niter, max_points_per_centroid, seed + c, false);
+
+#pragma omp critical
+            {
+                ndone++;
+                if (verbose && ndone % 100 == 0)
+                    std::cout << ndone << " / " << ntop << " top-level clusters are split" << std::endl;
+            }
+        }
+    }
+}
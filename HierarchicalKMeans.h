@@ -0,0 +1,39 @@
+#ifndef IVF_HNSW_LIB_HIERARCHICAL_KMEANS_H
+#define IVF_HNSW_LIB_HIERARCHICAL_KMEANS_H
+
+#include <cstddef>
+
+namespace ivfhnsw {
+    /** Two-level k-means for training millions of coarse centroids
+      *
+      * 1. Learn vectors are clustered into <nc1> top-level clusters (sqrt(nc) by default).
+      * 2. The <nc> centroids are split across the top-level clusters proportionally
+      *    to their sizes, each top-level cluster gets at most as many centroids as it has vectors.
+      * 3. Each top-level cluster is clustered independently, clusters are processed in parallel.
+      *
+      * Both levels use faiss::Clustering: BLAS-blocked assignment, subsampling to
+      * <max_points_per_centroid> vectors per centroid and splitting of empty clusters.
+      * Memory is bounded by the learn vectors, one copy of a top-level cluster per thread and the centroids.
+    */
+    struct HierarchicalKMeans
+    {
+        size_t d;                        ///< Vector dimension
+        size_t nc;                       ///< Number of centroids to train
+        size_t nc1;                      ///< Number of top-level clusters, 0 - sqrt(nc)
+        size_t niter;                    ///< Number of k-means iterations on each level
+        size_t max_points_per_centroid;  ///< Learn vectors per centroid to sample on each level
+        long seed;                       ///< Seed for sampling
+        bool verbose;
+
+        HierarchicalKMeans(size_t dim, size_t ncentroids);
+
+        /** Train centroids
+          *
+          * @param n           number of learn vectors, at least nc
+          * @param x           learn vectors, size n * d
+          * @param centroids   output centroids, size nc * d
+        */
+        void train(size_t n, const float *x, float *centroids);
+    };
+}
+#endif //IVF_HNSW_LIB_HIERARCHICAL_KMEANS_H
@@ -1,21 +1,38 @@
 #include "IndexIVF_HNSW.h"
+#include "Dataset.h"
+
+#include <omp.h>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
 
 namespace ivfhnsw {
 
+    /// Mark at the start of index files storing 64-bit ids, "IVFHID64"
+    static const size_t ids64_mark = 0x3436444948465649;
+
+    /// Mark following the id size of index files holding spilled vectors, "IVFHSPIL"
+    static const size_t spill_mark = 0x4c49505348465649;
+
     //=========================
     // IVF_HNSW implementation 
     //=========================
     IndexIVF_HNSW::IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
                                  size_t nbits_per_idx, size_t max_group_size):
-            d(dim), nc(ncentroids), quantizer(nullptr), pq(nullptr), norm_pq(nullptr),
-            opq_matrix(nullptr)
+            d(dim), nc(ncentroids), quantizer(nullptr), codec(nullptr), norm_pq(nullptr),
+            opq_matrix(nullptr), probe_ratio(0), stop_codes(0),
+            nthreads_per_query(1), coarse_batch_size(16), query_batch_size(256),
+            spill_ratio(0), spill_lambda(1), spill_candidates(8), has_spill(false),
+            ondisk_lists(nullptr), add_stats(nullptr)
     {
-        pq = new faiss::ProductQuantizer(d, bytes_per_code, nbits_per_idx);
+        codec = new PQCodec(d, bytes_per_code, nbits_per_idx);
         norm_pq = new faiss::ProductQuantizer(1, 1, nbits_per_idx);
 
-        code_size = pq->code_size;
-        norms.resize(max_group_size); // buffer for reconstructed base point norms. It is used at search time.
-        precomputed_table.resize(pq->ksub * pq->M);
+        code_size = codec->code_size;
+        search_buffers.norms.resize(max_group_size); // buffer for reconstructed base point norms. It is used at search time.
 
         codes.resize(nc);
         norm_codes.resize(nc);
@@ -26,9 +43,17 @@ namespace ivfhnsw {
     IndexIVF_HNSW::~IndexIVF_HNSW()
     {
         if (quantizer) delete quantizer;
-        if (pq) delete pq;
+        if (codec) delete codec;
         if (norm_pq) delete norm_pq;
         if (opq_matrix) delete opq_matrix;
+        if (ondisk_lists) delete ondisk_lists;
+
+        // Replicas of the node 0 are the instances above
+        for (size_t node = 1; node < quantizers.size(); node++) {
+            delete quantizers[node];
+            delete codecs[node];
+            delete norm_pqs[node];
+        }
     }
 
     /**
@@ -47,15 +72,15 @@ namespace ivfhnsw {
         quantizer = new hnswlib::HierarchicalNSW(d, nc, M, 2 * M, efConstruction);
 
         std::cout << "Constructing quantizer\n";
-        std::ifstream input(path_data, std::ios::binary);
+        XvecDataset<float> centroids(path_data, d);
+        if (centroids.size() < nc)
+            throw std::runtime_error(std::string("Fewer than ") + std::to_string(nc) + " centroids in " + path_data);
 
         size_t report_every = 100000;
         for (size_t i = 0; i < nc; i++) {
-            float mass[d];
-            readXvec<float>(input, mass, d);
             if (i % report_every == 0)
                 std::cout << i / (0.01 * nc) << " %\n";
-            quantizer->addPoint(mass);
+            quantizer->addPoint(centroids.vector(i));
         }
         quantizer->SaveInfo(path_info);
         quantizer->SaveEdges(path_edges);
@@ -63,14 +88,28 @@ namespace ivfhnsw {
 
 
     void IndexIVF_HNSW::assign(size_t n, const float *x, idx_t *labels, size_t k) {
-#pragma omp parallel for
-        for (size_t i = 0; i < n; i++)
-            labels[i] = quantizer->searchKnn(const_cast<float *>(x + i * d), k).top().second;
+        // Each thread interleaves HNSW traversals of <coarse_batch_size> vectors
+        const size_t batch_size = std::max<size_t>(coarse_batch_size, 1);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t b = 0; b < n; b += batch_size) {
+            const size_t nb = std::min(batch_size, n - b);
+            std::vector<std::priority_queue<std::pair<float, idx_t> > > results(nb);
+            quantizer->searchKnnBatch(x + b * d, nb, k, results.data(), batch_size);
+
+            for (size_t i = 0; i < nb; i++)
+                labels[b + i] = results[i].top().second;
+        }
     }
 
 
-    void IndexIVF_HNSW::add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx)
+    void IndexIVF_HNSW::add_batch(size_t n, const float *x, const label_t *xids, const idx_t *precomputed_idx)
     {
+        // Compressed lists are immutable, get_list would hand out stale ids
+        if (!compressed_ids.empty())
+            throw std::runtime_error("Vectors cannot be added once the ids are compressed by compress_ids");
+        // get_list serves the lists from SSD only, vectors appended in memory would be lost
+        FAISS_THROW_IF_NOT_MSG(!ondisk_lists, "Vectors cannot be added to inverted lists served from SSD");
+        StageTimer timer(add_stats);
         const idx_t *idx;
         // Check whether idxs are precomputed. If not, assign x
         if (precomputed_idx)
@@ -78,25 +117,150 @@ namespace ivfhnsw {
         else {
             idx = new idx_t[n];
             assign(n, x, const_cast<idx_t *>(idx));
+            timer.stop(AddStats::assign);
+        }
+        // Encode vectors
+        std::vector<uint8_t> xcodes(n * code_size);
+        std::vector<uint8_t> xnorm_codes(n);
+        encode(n, x, idx, xcodes.data(), xnorm_codes.data());
+        timer.stop(AddStats::encode);
+
+        // Add vector indices and PQ codes for residuals and norms to Index
+        for (size_t i = 0; i < n; i++) {
+            const idx_t key = idx[i];
+            const label_t id = xids[i];
+            ids[key].push_back(id);
+            const uint8_t *code = xcodes.data() + i * code_size;
+            for (size_t j = 0; j < code_size; j++)
+                codes[key].push_back(code[j]);
+
+            norm_codes[key].push_back(xnorm_codes[i]);
+        }
+        timer.stop(AddStats::append);
+
+        // Store spilled vectors in their second lists
+        size_t nspilled = 0;
+        if (spill_ratio > 0) {
+            std::vector<idx_t> spill_idx(n);
+            const std::vector<size_t> spilled = select_spill(n, x, idx, spill_idx.data());
+            nspilled = spilled.size();
+
+            std::vector<float> spilled_x(nspilled * d);
+            std::vector<idx_t> spilled_idx(nspilled);
+            for (size_t i = 0; i < nspilled; i++) {
+                memcpy(spilled_x.data() + i * d, x + spilled[i] * d, d * sizeof(float));
+                spilled_idx[i] = spill_idx[spilled[i]];
+            }
+            xcodes.resize(nspilled * code_size);
+            xnorm_codes.resize(nspilled);
+            encode(nspilled, spilled_x.data(), spilled_idx.data(), xcodes.data(), xnorm_codes.data());
+            timer.stop(AddStats::spill);
+
+            for (size_t i = 0; i < nspilled; i++) {
+                const idx_t key = spilled_idx[i];
+                ids[key].push_back(xids[spilled[i]]);
+                const uint8_t *code = xcodes.data() + i * code_size;
+                codes[key].insert(codes[key].end(), code, code + code_size);
+                norm_codes[key].push_back(xnorm_codes[i]);
+            }
+            timer.stop(AddStats::append);
+            if (nspilled > 0)
+                has_spill = true;
+        }
+        if (add_stats) {
+            add_stats->nvectors += n;
+            add_stats->nspilled += nspilled;
+        }
+        
+        // Free memory, if it is allocated 
+        if (idx != precomputed_idx)
+            delete idx;
+    }
+
+    std::vector<size_t> IndexIVF_HNSW::select_spill(size_t n, const float *x, const idx_t *idx, idx_t *spill_idx)
+    {
+        std::vector<uint8_t> is_spilled(n, 0);
+        const size_t batch_size = std::max<size_t>(coarse_batch_size, 1);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t b = 0; b < n; b += batch_size) {
+            const size_t nb = std::min(batch_size, n - b);
+            std::vector<std::priority_queue<std::pair<float, idx_t> > > results(nb);
+            quantizer->searchKnnBatch(x + b * d, nb, spill_candidates + 1, results.data(), batch_size);
+
+            std::vector<float> residual(d);
+            for (size_t i = 0; i < nb; i++) {
+                const float *point = x + (b + i) * d;
+                const float *centroid = quantizer->getDataByInternalId(idx[b + i]);
+                for (size_t j = 0; j < d; j++)
+                    residual[j] = point[j] - centroid[j];
+                const float dist = faiss::fvec_norm_L2sqr(residual.data(), d);
+                if (dist == 0)
+                    continue;
+
+                float min_loss = std::numeric_limits<float>::max();
+                for (; !results[i].empty(); results[i].pop()) {
+                    const idx_t centroid_idx = results[i].top().second;
+                    if (centroid_idx == idx[b + i])
+                        continue;
+
+                    const float *candidate = quantizer->getDataByInternalId(centroid_idx);
+                    float candidate_dist = 0;
+                    float projection = 0;
+                    for (size_t j = 0; j < d; j++) {
+                        const float diff = point[j] - candidate[j];
+                        candidate_dist += diff * diff;
+                        projection += diff * residual[j];
+                    }
+                    if (candidate_dist > spill_ratio * dist)
+                        continue;
+
+                    const float loss = candidate_dist + spill_lambda * projection * projection / dist;
+                    if (loss < min_loss) {
+                        min_loss = loss;
+                        spill_idx[b + i] = centroid_idx;
+                        is_spilled[b + i] = 1;
+                    }
+                }
+            }
         }
+        std::vector<size_t> spilled;
+        for (size_t i = 0; i < n; i++)
+            if (is_spilled[i])
+                spilled.push_back(i);
+        return spilled;
+    }
+
+    void IndexIVF_HNSW::encode(size_t n, const float *x, const idx_t *idx, uint8_t *xcodes, uint8_t *xnorm_codes)
+    {
         // Compute residuals for original vectors
         std::vector<float> residuals(n * d);
         compute_residuals(n, x, residuals.data(), idx);
 
         // If do_opq, rotate residuals
-        if (do_opq){
-            std::vector<float> copy_residuals(n * d);
-            memcpy(copy_residuals.data(), residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_residuals.data(), residuals.data());
-        }
+        if (do_opq)
+            rotate(n, residuals.data());
+
+        // Encode residuals and compute l2 square norms of reconstructed vectors
+        std::vector<const float *> centroids(n);
+        for (size_t i = 0; i < n; i++)
+            centroids[i] = quantizer->getDataByInternalId(idx[i]);
+
+        std::vector<float> norms(n);
+        encode_residuals(n, residuals.data(), centroids.data(), xcodes, norms.data());
+
+        // Encode norms
+        norm_pq->compute_codes(norms.data(), xnorm_codes, n);
+    }
 
+    void IndexIVF_HNSW::encode_residuals(size_t n, const float *residuals, const float *const *bases,
+                                         uint8_t *xcodes, float *norms)
+    {
         // Encode residuals
-        std::vector <uint8_t> xcodes(n * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), n);
+        codec->encode(n, residuals, xcodes);
 
         // Decode residuals
         std::vector<float> decoded_residuals(n * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), n);
+        codec->decode(n, xcodes, decoded_residuals.data());
 
         // Reverse rotation
         if (do_opq){
@@ -105,33 +269,27 @@ namespace ivfhnsw {
             opq_matrix->transform_transpose(n, copy_decoded_residuals.data(), decoded_residuals.data());
         }
 
-        // Reconstruct original vectors 
-        std::vector<float> reconstructed_x(n * d);
-        reconstruct(n, reconstructed_x.data(), decoded_residuals.data(), idx);
-
-        // Compute l2 square norms of reconstructed vectors
-        std::vector<float> norms(n);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, n);
-
-        // Encode norms
-        std::vector <uint8_t> xnorm_codes(n);
-        norm_pq->compute_codes(norms.data(), xnorm_codes.data(), n);
-
-        // Add vector indices and PQ codes for residuals and norms to Index
+        // Reconstruct original vectors and compute their l2 square norms
+        std::vector<float> reconstructed_x(d);
         for (size_t i = 0; i < n; i++) {
-            const idx_t key = idx[i];
-            const idx_t id = xids[i];
-            ids[key].push_back(id);
-            const uint8_t *code = xcodes.data() + i * code_size;
-            for (size_t j = 0; j < code_size; j++)
-                codes[key].push_back(code[j]);
-
-            norm_codes[key].push_back(xnorm_codes[i]);
+            faiss::fvec_madd(d, decoded_residuals.data() + i*d, 1., bases[i], reconstructed_x.data());
+            norms[i] = faiss::fvec_norm_L2sqr(reconstructed_x.data(), d);
         }
-        
-        // Free memory, if it is allocated 
-        if (idx != precomputed_idx)
-            delete idx;
+    }
+
+    void IndexIVF_HNSW::rotate(size_t n, float *x) const
+    {
+        std::vector<float> copy_x(x, x + n * d);
+        opq_matrix->apply_noalloc(n, copy_x.data(), x);
+    }
+
+    const float *IndexIVF_HNSW::inner_products(size_t node, size_t n, const uint8_t *codes, const float *table,
+                                               std::vector<float> &buffer) const
+    {
+        if (buffer.size() < n)
+            buffer.resize(n);
+        node_codec(node)->inner_products(n, codes, table, buffer.data());
+        return buffer.data();
     }
 
     /** Search procedure
@@ -164,56 +322,237 @@ namespace ivfhnsw {
     */
     void IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels)
     {
-        float query_centroid_dists[nprobe]; // Distances to the coarse centroids.
-        idx_t centroid_idxs[nprobe];        // Indices of the nearest coarse centroids
+        search(k, x, distances, labels, search_buffers);
+    }
+
+    void IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels, SearchBuffers &buffers)
+    {
+        SearchStats *stats = buffers.stats;
+        StageTimer timer(stats);
 
         // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        const float *query = x;
+        if (do_opq) {
+            buffers.queries.resize(std::max(buffers.queries.size(), d));
+            opq_matrix->apply_noalloc(1, x, buffers.queries.data());
+            query = buffers.queries.data();
+            timer.stop(SearchStats::rotate);
+        }
 
         // Find the nearest coarse centroids to the query
-        auto coarse = quantizer->searchKnn(query, nprobe);
+        hnswlib::SearchCounters counters;
+        auto coarse = node_quantizer(numa_node())->searchKnn(query, nprobe, stats ? &counters : nullptr,
+                                                             quantizer->efSearch);
+        if (stats) {
+            timer.stop(SearchStats::coarse);
+            stats->nqueries++;
+            stats->nhops += counters.nhops;
+            stats->ndist += counters.ndist;
+        }
+        search_preassigned(k, query, coarse, nullptr, buffers, distances, labels);
+    }
+
+    void IndexIVF_HNSW::search_batch(size_t n, size_t k, const float *x, float *distances, long *labels)
+    {
+        search_batch(n, k, x, distances, labels, search_buffers);
+    }
+
+    void IndexIVF_HNSW::search_batch(size_t n, size_t k, const float *x, float *distances, long *labels,
+                                     SearchBuffers &buffers)
+    {
+        const size_t batch_size = std::max<size_t>(query_batch_size, 1);
+        std::vector<std::priority_queue<std::pair<float, idx_t> > > coarse(std::min(n, batch_size));
+
+        for (size_t i0 = 0; i0 < n; i0 += batch_size) {
+            const size_t nbatch = std::min(batch_size, n - i0);
+            const float *queries = preprocess_queries(nbatch, x + i0 * d, buffers);
+
+            // Find the nearest coarse centroids to the queries interleaving their traversals
+            SearchStats *stats = buffers.stats;
+            StageTimer timer(stats);
+            hnswlib::SearchCounters counters;
+            node_quantizer(numa_node())->searchKnnBatch(queries, nbatch, nprobe, coarse.data(), coarse_batch_size,
+                                                        stats ? &counters : nullptr, quantizer->efSearch);
+            if (stats) {
+                timer.stop(SearchStats::coarse);
+                stats->nqueries += nbatch;
+                stats->nhops += counters.nhops;
+                stats->ndist += counters.ndist;
+            }
+
+            for (size_t i = 0; i < nbatch; i++)
+                search_preassigned(k, queries + i * d, coarse[i], buffers.tables.data() + i * codec->table_size,
+                                   buffers, distances + (i0 + i) * k, labels + (i0 + i) * k);
+        }
+    }
+
+    const float *IndexIVF_HNSW::preprocess_queries(size_t n, const float *x, SearchBuffers &buffers)
+    {
+        StageTimer timer(buffers.stats);
+        const float *queries = x;
+        // For correct search using OPQ rotate queries
+        if (do_opq) {
+            buffers.queries.resize(std::max(buffers.queries.size(), n * d));
+            opq_matrix->apply_noalloc(n, x, buffers.queries.data());
+            queries = buffers.queries.data();
+            timer.stop(SearchStats::rotate);
+        }
+        buffers.tables.resize(std::max(buffers.tables.size(), n * codec->table_size));
+        node_codec(numa_node())->compute_tables(n, queries, buffers.tables.data());
+        timer.stop(SearchStats::table);
+        return queries;
+    }
+
+    void IndexIVF_HNSW::search_preassigned(size_t k, const float *query,
+                                           std::priority_queue<std::pair<float, idx_t> > &coarse,
+                                           const float *table, SearchBuffers &buffers,
+                                           float *distances, long *labels)
+    {
+        SearchStats *stats = buffers.stats;
+        StageTimer timer(stats);
+        float query_centroid_dists[nprobe]; // Distances to the coarse centroids.
+        idx_t centroid_idxs[nprobe];        // Indices of the nearest coarse centroids
+
+        // Use the codebooks of the current NUMA node
+        const size_t node = numa_node();
+
         for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
             query_centroid_dists[i] = coarse.top().first;
             centroid_idxs[i] = coarse.top().second;
             coarse.pop();
         }
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
+        // Lists far from the query relative to the nearest one are not probed
+        const size_t nprobe_query = probe_count(query_centroid_dists);
+
+        // Start reading the lists from SSD while the table is computed
+        if (ondisk_lists)
+            ondisk_lists->prefetch(centroid_idxs, nprobe_query);
+
+        // Precompute table unless it is computed with the batch
+        if (!table) {
+            buffers.table.resize(codec->table_size);
+            node_codec(node)->compute_table(query, buffers.table.data());
+            table = buffers.table.data();
+            timer.stop(SearchStats::table);
+        }
 
         // Prepare max heap with k answers
         faiss::maxheap_heapify(k, distances, labels);
 
+        // Split the probed lists across threads
+        if (nthreads_per_query > 1) {
+            std::vector<ScanRange> ranges;
+            std::vector<ListView> lists;
+            ranges.reserve(nprobe_query);
+            lists.reserve(nprobe_query);
+
+            size_t ncode = 0;
+            for (size_t i = 0; i < nprobe_query; i++) {
+                const idx_t centroid_idx = centroid_idxs[i];
+                const size_t group_size = list_size(centroid_idx);
+                if (group_size == 0)
+                    continue;
+
+                lists.push_back(get_list(centroid_idx));
+                const ListView &list = lists.back();
+                const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+                ranges.push_back({centroid_idx, term1, group_size, list.codes, list.norm_codes, &list, 0});
+                ncode += group_size;
+                if (ncode >= max_codes)
+                    break;
+            }
+            size_t nscanned = 0;
+            const size_t npushes = parallel_scan(k, ranges, table, distances, labels, ncode, nscanned);
+            if (stats) {
+                timer.stop(SearchStats::scan);
+                stats->nlists += nscanned;
+                stats->ncodes += ncode;
+                stats->nheap_pushes += npushes;
+            }
+            return;
+        }
+
         size_t ncode = 0;
-        for (size_t i = 0; i < nprobe; i++) {
+        size_t nlists = 0;
+        size_t npushes = 0;
+        ScanStop stop(stop_codes);
+        for (size_t i = 0; i < nprobe_query; i++) {
             const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
+            const size_t group_size = list_size(centroid_idx);
             if (group_size == 0)
                 continue;
 
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
+            const ListView list = get_list(centroid_idx);
             const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+            const ScanRange range = {centroid_idx, term1, group_size, list.codes, list.norm_codes, &list, 0};
+            npushes += scan_range(node, k, range, table, buffers.norms, buffers.inner_prods, distances, labels);
+            ncode += group_size;
+            nlists++;
+            if (ncode >= max_codes || stop.update(group_size, distances[0]))
+                break;
+        }
+        if (stats) {
+            timer.stop(SearchStats::scan);
+            stats->nlists += nlists;
+            stats->ncodes += ncode;
+            stats->nheap_pushes += npushes;
+        }
+    }
 
-            // Decode the norms of each vector in the list
-            norm_pq->decode(norm_code, norms.data(), group_size);
+    float IndexIVF_HNSW::train_probe_ratio(size_t n, const float *x, const idx_t *gt, size_t ngt, float coverage)
+    {
+        if (n == 0)
+            throw std::runtime_error("No training queries for probe_ratio");
+
+        // Nearest coarse centroids of the queries, rotated as the quantizer if do_opq
+        std::vector<float> queries(x, x + n * d);
+        if (do_opq)
+            rotate(n, queries.data());
+        std::vector<std::priority_queue<std::pair<float, idx_t> > > coarse(n);
+        quantizer->searchKnnBatch(queries.data(), n, nprobe, coarse.data(), coarse_batch_size);
 
+        // Lists holding the neighbours, two of them if the neighbour is spilled
+        std::unordered_map<label_t, std::vector<idx_t> > neighbour_lists;
+        for (size_t q = 0; q < n; q++)
+            neighbour_lists[gt[q * ngt]];
+        for (idx_t centroid_idx = 0; centroid_idx < nc; centroid_idx++) {
+            const size_t group_size = list_size(centroid_idx);
+            if (group_size == 0)
+                continue;
+            const ListView list = get_list(centroid_idx);
             for (size_t j = 0; j < group_size; j++) {
-                const float term3 = 2 * pq_L2sqr(code + j * code_size);
-                const float dist = term1 + norms[j] - term3; //term2 = norms[j]
-                if (dist < distances[0]) {
-                    faiss::maxheap_pop(k, distances, labels);
-                    faiss::maxheap_push(k, distances, labels, dist, id[j]);
-                }
+                auto it = neighbour_lists.find(list.id(j));
+                if (it != neighbour_lists.end())
+                    it->second.push_back(centroid_idx);
             }
-            ncode += group_size;
-            if (ncode >= max_codes)
+        }
+
+        // Ratio each query needs, infinity if its neighbour is beyond the nprobe lists
+        const float inf = std::numeric_limits<float>::infinity();
+        std::vector<float> ratios(n, inf);
+        std::vector<std::pair<float, idx_t> > sorted;
+        for (size_t q = 0; q < n; q++) {
+            sorted.resize(coarse[q].size());
+            for (size_t i = sorted.size(); i-- > 0; coarse[q].pop())
+                sorted[i] = coarse[q].top();
+
+            const std::vector<idx_t> &lists = neighbour_lists[gt[q * ngt]];
+            for (const std::pair<float, idx_t> &probe : sorted) {
+                if (std::find(lists.begin(), lists.end(), probe.second) == lists.end())
+                    continue;
+                const float nearest = sorted[0].first;
+                ratios[q] = nearest > 0 ? probe.first / nearest : (probe.first > 0 ? inf : 1);
                 break;
+            }
         }
-        if (do_opq)
-            delete const_cast<float *>(query);
-    }
 
+        std::sort(ratios.begin(), ratios.end());
+        const size_t ncovered = std::min<size_t>(n, std::max<size_t>(1, std::ceil(coverage * n)));
+        const float ratio = ratios[ncovered - 1];
+        // Scale up slightly so that the list of the ratio passes the comparison in probe_count
+        probe_ratio = std::isinf(ratio) ? 0 : ratio * (1 + 1e-6f);
+        return probe_ratio;
+    }
 
     void IndexIVF_HNSW::train_pq(size_t n, const float *x)
     {
@@ -227,7 +566,9 @@ namespace ivfhnsw {
 
         // Train OPQ rotation matrix and rotate residuals
         if (do_opq){
-            faiss::OPQMatrix *matrix = new faiss::OPQMatrix(d, pq->M);
+            if (codec->M == 0)
+                throw std::runtime_error("OPQ requires a codec splitting vectors into subspaces");
+            faiss::OPQMatrix *matrix = new faiss::OPQMatrix(d, codec->M);
 
             std::cout << "Training OPQ Matrix" << std::endl;
             matrix->verbose = true;
@@ -235,38 +576,20 @@ namespace ivfhnsw {
             matrix->niter = 70;
             matrix->train(n, residuals.data());
             opq_matrix = matrix;
-
-            std::vector<float> copy_residuals(n * d);
-            memcpy(copy_residuals.data(), residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_residuals.data(), residuals.data());
-        }
-        // Train residual PQ
-        printf("Training %zdx%zd product quantizer on %ld vectors in %dD\n", pq->M, pq->ksub, n, d);
-        pq->verbose = true;
-        pq->train(n, residuals.data());
-
-        // Encode residuals
-        std::vector <uint8_t> xcodes(n * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), n);
-
-        // Decode residuals
-        std::vector<float> decoded_residuals(n * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), n);
-
-        // Reverse rotation
-        if (do_opq){
-            std::vector<float> copy_decoded_residuals(n * d);
-            memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), n * d * sizeof(float));
-            opq_matrix->transform_transpose(n, copy_decoded_residuals.data(), decoded_residuals.data());
+            rotate(n, residuals.data());
         }
-
-        // Reconstruct original vectors 
-        std::vector<float> reconstructed_x(n * d);
-        reconstruct(n, reconstructed_x.data(), decoded_residuals.data(), assigned.data());
+        // Train residual codec
+        codec->verbose = true;
+        codec->train(n, residuals.data());
 
         // Compute l2 square norms of reconstructed vectors
+        std::vector<const float *> centroids(n);
+        for (size_t i = 0; i < n; i++)
+            centroids[i] = quantizer->getDataByInternalId(assigned[i]);
+
+        std::vector<uint8_t> xcodes(n * code_size);
         std::vector<float> norms(n);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, n);
+        encode_residuals(n, residuals.data(), centroids.data(), xcodes.data(), norms.data());
 
         // Train norm PQ
         printf("Training %zdx%zd product quantizer on %ld vectors in %dD\n", norm_pq->M, norm_pq->ksub, n, d);
@@ -274,17 +597,29 @@ namespace ivfhnsw {
         norm_pq->train(n, norms.data());
     }
 
+    void IndexIVF_HNSW::set_codec(Codec *new_codec)
+    {
+        if (new_codec->d != d)
+            throw std::runtime_error("Codec dimension differs from the index dimension");
+        delete codec;
+        codec = new_codec;
+        code_size = codec->code_size;
+    }
+
     // Write index 
     void IndexIVF_HNSW::write(const char *path_index)
     {
+        // In-memory lists are released by load_ondisk_lists
+        FAISS_THROW_IF_NOT_MSG(!ondisk_lists, "Index with inverted lists served from SSD cannot be written");
         std::ofstream output(path_index, std::ios::binary);
 
+        write_id_size(output);
+        write_spill_mark(output, has_spill);
         write_variable(output, d);
         write_variable(output, nc);
 
         // Save vector indices
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, ids[i]);
+        write_ids(output);
 
         // Save PQ codes
         for (size_t i = 0; i < nc; i++)
@@ -303,25 +638,397 @@ namespace ivfhnsw {
     {
         std::ifstream input(path_index, std::ios::binary);
 
+        const size_t id_size = read_id_size(input);
+        has_spill = read_spill_mark(input);
         read_variable(input, d);
         read_variable(input, nc);
 
-        // Read vector indices
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
+        // Read vector indices, skip them if inverted lists are served from SSD
+        read_ids(input, id_size, ondisk_lists != nullptr);
 
-        // Read PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
+        // Skip inverted lists if they are served from SSD
+        if (ondisk_lists) {
+            for (size_t i = 0; i < nc; i++)
+                skip_vector<uint8_t>(input);
+            for (size_t i = 0; i < nc; i++)
+                skip_vector<uint8_t>(input);
+        }
+        else {
+            // Read PQ codes
+            for (size_t i = 0; i < nc; i++)
+                read_vector(input, codes[i]);
 
-        // Read norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+            // Read norm PQ codes
+            for (size_t i = 0; i < nc; i++)
+                read_vector(input, norm_codes[i]);
+        }
 
         // Read centroid norms
         read_vector(input, centroid_norms);
     }
 
+    void IndexIVF_HNSW::check_mergeable(const IndexIVF_HNSW &other) const
+    {
+        if (other.d != d || other.nc != nc || other.code_size != code_size)
+            throw std::runtime_error("Indexes to merge have different dimension, number of centroids or code size");
+        if (ondisk_lists || other.ondisk_lists || !compressed_ids.empty() || !other.compressed_ids.empty())
+            throw std::runtime_error("Indexes to merge have to keep uncompressed inverted lists in memory");
+    }
+
+    void IndexIVF_HNSW::merge_from(const IndexIVF_HNSW &other)
+    {
+        check_mergeable(other);
+        has_spill = has_spill || other.has_spill;
+        for (size_t i = 0; i < nc; i++) {
+            ids[i].insert(ids[i].end(), other.ids[i].begin(), other.ids[i].end());
+            codes[i].insert(codes[i].end(), other.codes[i].begin(), other.codes[i].end());
+            norm_codes[i].insert(norm_codes[i].end(), other.norm_codes[i].begin(), other.norm_codes[i].end());
+        }
+    }
+
+    std::vector<std::unique_ptr<std::ifstream> > IndexIVF_HNSW::open_shards(const std::vector<const char *> &shard_paths,
+                                                                           std::vector<size_t> &id_sizes,
+                                                                           size_t &d, size_t &nc, bool &has_spill)
+    {
+        if (shard_paths.empty())
+            throw std::runtime_error("No shards to merge");
+
+        std::vector<std::unique_ptr<std::ifstream> > inputs;
+        id_sizes.resize(shard_paths.size());
+        has_spill = false;
+        for (size_t s = 0; s < shard_paths.size(); s++) {
+            inputs.emplace_back(new std::ifstream(shard_paths[s], std::ios::binary));
+            if (!inputs[s]->good())
+                throw std::runtime_error(std::string("Cannot open shard ") + shard_paths[s]);
+            id_sizes[s] = read_id_size(*inputs[s]);
+            if (read_spill_mark(*inputs[s]))
+                has_spill = true;
+
+            size_t shard_d, shard_nc;
+            read_variable(*inputs[s], shard_d);
+            read_variable(*inputs[s], shard_nc);
+            if (s == 0) {
+                d = shard_d;
+                nc = shard_nc;
+            } else if (shard_d != d || shard_nc != nc)
+                throw std::runtime_error(std::string("Shard ") + shard_paths[s] + " has different d or nc");
+        }
+        return inputs;
+    }
+
+    /// Concatenate the i-th lists of the shards for each of nc lists
+    template<typename T>
+    static void concat_lists(std::vector<std::unique_ptr<std::ifstream> > &inputs, std::ostream &output, size_t nc)
+    {
+        std::vector<T> merged_list, shard_list;
+        for (size_t i = 0; i < nc; i++) {
+            merged_list.clear();
+            for (auto &input : inputs) {
+                read_vector(*input, shard_list);
+                merged_list.insert(merged_list.end(), shard_list.begin(), shard_list.end());
+            }
+            write_vector(output, merged_list);
+        }
+    }
+
+    void IndexIVF_HNSW::merge_shards(const std::vector<const char *> &shard_paths, const char *path)
+    {
+        std::vector<size_t> id_sizes;
+        size_t d, nc;
+        bool has_spill;
+        std::vector<std::unique_ptr<std::ifstream> > inputs = open_shards(shard_paths, id_sizes, d, nc, has_spill);
+
+        std::ofstream output(path, std::ios::binary);
+        write_id_size(output);
+        write_spill_mark(output, has_spill);
+        write_variable(output, d);
+        write_variable(output, nc);
+
+        // Merge vector indices
+        std::vector<label_t> merged_ids, shard_ids;
+        for (size_t i = 0; i < nc; i++) {
+            merged_ids.clear();
+            for (size_t s = 0; s < inputs.size(); s++) {
+                read_id_list(*inputs[s], id_sizes[s], shard_ids);
+                merged_ids.insert(merged_ids.end(), shard_ids.begin(), shard_ids.end());
+            }
+            write_vector(output, merged_ids);
+        }
+
+        // Merge PQ codes and norm PQ codes
+        concat_lists<uint8_t>(inputs, output, nc);
+        concat_lists<uint8_t>(inputs, output, nc);
+
+        // Centroid norms are the same in all shards
+        std::vector<float> centroid_norms;
+        read_vector(*inputs[0], centroid_norms);
+        write_vector(output, centroid_norms);
+    }
+
+    void IndexIVF_HNSW::write_ondisk_lists(const char *path)
+    {
+        if (ondisk_lists) {
+            std::cout << "Inverted lists are already served from SSD\n";
+            return;
+        }
+        if (compressed_ids.empty()) {
+            OnDiskInvertedLists::write(path, code_size, ids, codes, norm_codes);
+            return;
+        }
+        std::vector<std::vector<label_t> > decoded_ids(nc);
+        for (size_t i = 0; i < nc; i++)
+            compressed_ids[i].decode(decoded_ids[i]);
+        OnDiskInvertedLists::write(path, code_size, decoded_ids, codes, norm_codes);
+    }
+
+    void IndexIVF_HNSW::load_ondisk_lists(const char *path, size_t nthreads, size_t cache_capacity)
+    {
+        if (ondisk_lists)
+            delete ondisk_lists;
+        ondisk_lists = new OnDiskInvertedLists(path, nthreads, cache_capacity);
+        FAISS_THROW_IF_NOT_MSG(ondisk_lists->nc == nc && ondisk_lists->code_size == code_size,
+                               "On-disk inverted lists do not match the index");
+
+        // Release in-memory lists
+        std::vector<CompressedIds>().swap(compressed_ids);
+        for (size_t i = 0; i < nc; i++) {
+            std::vector<label_t>().swap(ids[i]);
+            std::vector<uint8_t>().swap(codes[i]);
+            std::vector<uint8_t>().swap(norm_codes[i]);
+        }
+    }
+
+    void IndexIVF_HNSW::compress_ids()
+    {
+        if (ondisk_lists || !compressed_ids.empty()) {
+            std::cout << "Inverted lists for indexes are served from SSD or already compressed\n";
+            return;
+        }
+        compressed_ids.resize(nc);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < nc; i++) {
+            compressed_ids[i] = CompressedIds(ids[i]);
+            std::vector<label_t>().swap(ids[i]);
+        }
+    }
+
+    IndexIVF_HNSW::ListView IndexIVF_HNSW::get_list(idx_t centroid_idx)
+    {
+        ListView list;
+        list.compressed_ids = nullptr;
+        if (ondisk_lists) {
+            list.holder = ondisk_lists->get(centroid_idx);
+            list.ids = list.holder->ids;
+            list.codes = list.holder->codes;
+            list.norm_codes = list.holder->norm_codes;
+        } else {
+            if (compressed_ids.empty())
+                list.ids = ids[centroid_idx].data();
+            else {
+                list.ids = nullptr;
+                list.compressed_ids = &compressed_ids[centroid_idx];
+            }
+            list.codes = codes[centroid_idx].data();
+            list.norm_codes = norm_codes[centroid_idx].data();
+        }
+        return list;
+    }
+
+    void IndexIVF_HNSW::reconstruct_list(idx_t centroid_idx, const ListView &list, float *x) const
+    {
+        const size_t group_size = list_size(centroid_idx);
+        codec->decode(group_size, list.codes, x);
+        const float *centroid = quantizer->getDataByInternalId(centroid_idx);
+        for (size_t i = 0; i < group_size; i++)
+            faiss::fvec_madd(d, x + i * d, 1., centroid, x + i * d);
+    }
+
+    void IndexIVF_HNSW::adjacent_lists(idx_t centroid_idx, std::vector<idx_t> &lists) const
+    {
+        const uint8_t *links = quantizer->get_linklist0(centroid_idx);
+        const hnswlib::idx_t *neighbors = (const hnswlib::idx_t *) (links + 1);
+        lists.assign(neighbors, neighbors + *links);
+    }
+
+    void IndexIVF_HNSW::knn_graph(size_t k, size_t nadjacent, size_t chunk_size, const GraphCallback &emit)
+    {
+        // The vector itself is found first, with spilling a neighbour may also be found twice
+        const size_t nfound = has_spill ? 2 * k + 2 : k + 1;
+        chunk_size = std::max<size_t>(chunk_size, 1);
+
+        struct ListGraph
+        {
+            std::vector<label_t> ids;
+            std::vector<long> labels;
+            std::vector<float> distances;
+        };
+        std::vector<ListGraph> graphs(std::min(chunk_size, nc));
+
+        for (size_t c0 = 0; c0 < nc; c0 += chunk_size) {
+            const size_t nchunk = std::min(chunk_size, nc - c0);
+#pragma omp parallel
+            {
+                std::vector<idx_t> lists;
+                std::vector<std::pair<float, idx_t> > adjacent;
+                std::vector<float> x;
+                std::vector<label_t> x_ids;
+                std::vector<float> found_distances;
+                std::vector<long> found_labels;
+
+#pragma omp for schedule(dynamic)
+                for (size_t i = 0; i < nchunk; i++) {
+                    const idx_t centroid_idx = c0 + i;
+                    const size_t group_size = list_size(centroid_idx);
+                    ListGraph &graph = graphs[i];
+                    graph.ids.clear();
+                    if (group_size == 0)
+                        continue;
+
+                    // Nearest adjacent lists by the distances between the centroids
+                    const float *centroid = quantizer->getDataByInternalId(centroid_idx);
+                    adjacent_lists(centroid_idx, lists);
+                    adjacent.clear();
+                    for (idx_t list_idx : lists)
+                        if (list_idx != centroid_idx)
+                            adjacent.emplace_back(
+                                    faiss::fvec_L2sqr(centroid, quantizer->getDataByInternalId(list_idx), d), list_idx);
+                    const size_t nlists = std::min(nadjacent, adjacent.size());
+                    std::partial_sort(adjacent.begin(), adjacent.begin() + nlists, adjacent.end());
+
+                    // Reconstruct the list followed by the adjacent lists
+                    x_ids.clear();
+                    for (size_t l = 0; l <= nlists; l++) {
+                        const idx_t list_idx = l == 0 ? centroid_idx : adjacent[l - 1].second;
+                        const size_t n = list_size(list_idx);
+                        if (n == 0)
+                            continue;
+                        const ListView list = get_list(list_idx);
+                        const size_t offset = x_ids.size();
+                        x.resize((offset + n) * d);
+                        reconstruct_list(list_idx, list, x.data() + offset * d);
+                        for (size_t j = 0; j < n; j++)
+                            x_ids.push_back(list.id(j));
+                    }
+
+                    // Vectors of the list against all reconstructed vectors
+                    found_distances.resize(group_size * nfound);
+                    found_labels.resize(group_size * nfound);
+                    faiss::float_maxheap_array_t heaps = {group_size, nfound, found_labels.data(),
+                                                          found_distances.data()};
+                    faiss::knn_L2sqr(x.data(), x.data(), d, group_size, x_ids.size(), &heaps);
+
+                    // Drop the vector itself and the second copies of spilled neighbours
+                    graph.ids.assign(x_ids.begin(), x_ids.begin() + group_size);
+                    graph.labels.resize(group_size * k);
+                    graph.distances.resize(group_size * k);
+                    for (size_t j = 0; j < group_size; j++) {
+                        long *labels = graph.labels.data() + j * k;
+                        float *distances = graph.distances.data() + j * k;
+                        size_t m = 0;
+                        for (size_t r = 0; r < nfound && m < k; r++) {
+                            const long pos = found_labels[j * nfound + r];
+                            if (pos < 0)
+                                break;
+                            const long id = x_ids[pos];
+                            if (id == (long) x_ids[j] || std::find(labels, labels + m, id) != labels + m)
+                                continue;
+                            labels[m] = id;
+                            distances[m] = found_distances[j * nfound + r];
+                            m++;
+                        }
+                        for (; m < k; m++) {
+                            labels[m] = -1;
+                            distances[m] = std::numeric_limits<float>::max();
+                        }
+                    }
+                }
+            }
+            for (size_t i = 0; i < nchunk; i++) {
+                const ListGraph &graph = graphs[i];
+                if (!graph.ids.empty())
+                    emit(graph.ids.size(), graph.ids.data(), graph.labels.data(), graph.distances.data());
+            }
+        }
+    }
+
+    void IndexIVF_HNSW::write_ids(std::ostream &output)
+    {
+        if (compressed_ids.empty()) {
+            for (size_t i = 0; i < nc; i++)
+                write_vector(output, ids[i]);
+            return;
+        }
+        std::vector<label_t> decoded_ids;
+        for (size_t i = 0; i < nc; i++) {
+            compressed_ids[i].decode(decoded_ids);
+            write_vector(output, decoded_ids);
+        }
+    }
+
+    void IndexIVF_HNSW::read_ids(std::istream &input, size_t id_size, bool skip)
+    {
+        std::vector<CompressedIds>().swap(compressed_ids);
+
+        for (size_t i = 0; i < nc; i++) {
+            if (skip) {
+                uint32_t size;
+                read_variable(input, size);
+                input.seekg(size * id_size, std::ios::cur);
+            }
+            else
+                read_id_list(input, id_size, ids[i]);
+        }
+    }
+
+    void IndexIVF_HNSW::read_id_list(std::istream &input, size_t id_size, std::vector<label_t> &list_ids)
+    {
+        if (id_size == sizeof(label_t)) {
+            read_vector(input, list_ids);
+            return;
+        }
+        // Widen 32-bit ids
+        std::vector<uint32_t> narrow_ids;
+        read_vector(input, narrow_ids);
+        list_ids.assign(narrow_ids.begin(), narrow_ids.end());
+    }
+
+    void IndexIVF_HNSW::write_id_size(std::ostream &output)
+    {
+        if (sizeof(label_t) == sizeof(uint64_t))
+            write_variable(output, ids64_mark);
+    }
+
+    size_t IndexIVF_HNSW::read_id_size(std::istream &input)
+    {
+        // Index files with 32-bit ids start with d
+        size_t mark;
+        read_variable(input, mark);
+        if (mark == ids64_mark) {
+            if (sizeof(label_t) < sizeof(uint64_t))
+                throw std::runtime_error("The index stores 64-bit ids, rebuild with IVFHNSW_64BIT_IDS");
+            return sizeof(uint64_t);
+        }
+        input.seekg(-(std::streamoff) sizeof(size_t), std::ios::cur);
+        return sizeof(uint32_t);
+    }
+
+    void IndexIVF_HNSW::write_spill_mark(std::ostream &output, bool has_spill)
+    {
+        if (has_spill)
+            write_variable(output, spill_mark);
+    }
+
+    bool IndexIVF_HNSW::read_spill_mark(std::istream &input)
+    {
+        // Files without spilled vectors continue with d
+        size_t mark;
+        read_variable(input, mark);
+        if (mark == spill_mark)
+            return true;
+        input.seekg(-(std::streamoff) sizeof(size_t), std::ios::cur);
+        return false;
+    }
+
     void IndexIVF_HNSW::compute_centroid_norms()
     {
         for (size_t i = 0; i < nc; i++) {
@@ -343,29 +1050,346 @@ namespace ivfhnsw {
         }
     }
 
-    float IndexIVF_HNSW::pq_L2sqr(const uint8_t *code)
+    void IndexIVF_HNSW::place_numa()
     {
-        float result = 0.;
-        const size_t dim = code_size >> 2;
-        size_t m = 0;
-        for (size_t i = 0; i < dim; i++) {
-            result += precomputed_table[pq->ksub * m + code[m]]; m++;
-            result += precomputed_table[pq->ksub * m + code[m]]; m++;
-            result += precomputed_table[pq->ksub * m + code[m]]; m++;
-            result += precomputed_table[pq->ksub * m + code[m]]; m++;
+        if (!quantizers.empty()) {
+            std::cout << "Index is already placed on NUMA nodes\n";
+            return;
         }
-        return result;
+        const size_t nnodes = numa.nnodes();
+        quantizers.resize(nnodes);
+        codecs.resize(nnodes);
+        norm_pqs.resize(nnodes);
+        list_nodes = partition_lists(nnodes);
+
+        // Memory is first touched by threads pinned to the node it has to be placed on
+        numa.run_on_each_node([&](size_t node) {
+            quantizers[node] = new hnswlib::HierarchicalNSW(*quantizer);
+            codecs[node] = codec->clone();
+            norm_pqs[node] = new faiss::ProductQuantizer(*norm_pq);
+
+            for (size_t i = 0; i < nc; i++) {
+                if (list_nodes[i] != node)
+                    continue;
+                std::vector<label_t>(ids[i]).swap(ids[i]);
+                if (!compressed_ids.empty())
+                    compressed_ids[i] = CompressedIds(compressed_ids[i]);
+                std::vector<uint8_t>(codes[i]).swap(codes[i]);
+                std::vector<uint8_t>(norm_codes[i]).swap(norm_codes[i]);
+            }
+        });
+        delete quantizer;
+        delete codec;
+        delete norm_pq;
+        quantizer = quantizers[0];
+        codec = codecs[0];
+        norm_pq = norm_pqs[0];
+
+        // The kernel may place pages elsewhere, e.g. if the node is out of memory: take the nodes of the codes
+        std::vector<const void *> addrs;
+        std::vector<idx_t> placed;
+        for (size_t i = 0; i < nc; i++)
+            if (!codes[i].empty()) {
+                addrs.push_back(codes[i].data());
+                placed.push_back(i);
+            }
+        std::vector<int> nodes;
+        numa_stats.reset();
+        numa_stats.measured = !addrs.empty() && numa.page_nodes(addrs, nodes);
+        size_t nmisplaced = 0;
+        for (size_t j = 0; j < placed.size() && numa_stats.measured; j++)
+            if (nodes[j] >= 0 && nodes[j] != list_nodes[placed[j]]) {
+                list_nodes[placed[j]] = nodes[j];
+                nmisplaced++;
+            }
+
+        std::cout << "Index is placed on " << nnodes << " NUMA nodes, ";
+        if (numa_stats.measured)
+            std::cout << nmisplaced << " of " << placed.size() << " lists are on other nodes than intended\n";
+        else
+            std::cout << "list placement is not reported by the kernel, local/remote traffic is estimated\n";
     }
 
-    // Private 
-    void IndexIVF_HNSW::reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys)
+    std::vector<uint8_t> IndexIVF_HNSW::partition_lists(size_t nnodes) const
     {
-        for (size_t i = 0; i < n; i++) {
-            const float *centroid = quantizer->getDataByInternalId(keys[i]);
-            faiss::fvec_madd(d, decoded_residuals + i*d, 1., centroid, x + i*d);
+        std::vector<uint8_t> nodes(nc, 0);
+        if (nnodes < 2 || nc == 0)
+            return nodes;
+
+        std::vector<float> mean(d, 0);
+        for (size_t i = 0; i < nc; i++) {
+            const float *centroid = quantizer->getDataByInternalId(i);
+            for (size_t j = 0; j < d; j++)
+                mean[j] += centroid[j] / nc;
+        }
+
+        // Principal axis of the centroids by power iteration
+        std::vector<float> axis(d, 1 / std::sqrt((float) d));
+        std::vector<float> projections(nc);
+        for (size_t iter = 0; ; iter++) {
+            const float shift = faiss::fvec_inner_product(mean.data(), axis.data(), d);
+#pragma omp parallel for
+            for (size_t i = 0; i < nc; i++)
+                projections[i] = faiss::fvec_inner_product(quantizer->getDataByInternalId(i), axis.data(), d) - shift;
+            if (iter == 16)
+                break;
+
+            std::vector<float> next(d, 0);
+#pragma omp parallel
+            {
+                std::vector<float> local(d, 0);
+#pragma omp for
+                for (size_t i = 0; i < nc; i++)
+                    faiss::fvec_madd(d, local.data(), projections[i], quantizer->getDataByInternalId(i), local.data());
+#pragma omp critical
+                for (size_t j = 0; j < d; j++)
+                    next[j] += local[j];
+            }
+            const float norm = std::sqrt(faiss::fvec_norm_L2sqr(next.data(), d));
+            if (norm == 0)
+                break;
+            for (size_t j = 0; j < d; j++)
+                axis[j] = next[j] / norm;
+        }
+
+        // Slabs holding about the same number of codes
+        std::vector<idx_t> order(nc);
+        for (size_t i = 0; i < nc; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](idx_t a, idx_t b) { return projections[a] < projections[b]; });
+        size_t total = 0;
+        for (size_t i = 0; i < nc; i++)
+            total += list_size(i) + 1;
+        size_t accumulated = 0;
+        for (idx_t i : order) {
+            nodes[i] = std::min(nnodes - 1, accumulated * nnodes / total);
+            accumulated += list_size(i) + 1;
         }
+        return nodes;
     }
 
+    void IndexIVF_HNSW::search_numa(size_t n, size_t k, const float *x, float *distances, long *labels,
+                                    size_t nthreads_per_node)
+    {
+        if (quantizers.empty())
+            throw std::runtime_error("Place the index on NUMA nodes with place_numa before search_numa");
+        const size_t nnodes = quantizers.size();
+        const size_t nthreads = std::max<size_t>(nthreads_per_node, 1);
+
+        // Rotated queries (if do_opq), their nearest coarse centroids and the queries routed to each node
+        std::vector<float> rotated(do_opq ? n * d : 0);
+        const float *queries = do_opq ? rotated.data() : x;
+        std::vector<std::priority_queue<std::pair<float, idx_t> > > coarse(n);
+        std::vector<std::vector<size_t> > node_queries(nnodes);
+        std::mutex routing_mutex;
+        std::atomic<size_t> next_query(0);
+
+        numa.run_on_each_node(nthreads, [&](size_t node) {
+            std::vector<std::vector<size_t> > routed(nnodes);
+            std::vector<size_t> node_sizes(nnodes);
+            for (size_t i = next_query++; i < n; i = next_query++) {
+                if (do_opq)
+                    opq_matrix->apply_noalloc(1, x + i * d, rotated.data() + i * d);
+                coarse[i] = quantizers[node]->searchKnn(queries + i * d, nprobe, nullptr, quantizer->efSearch);
+
+                // The node holding the most codes of the probed lists
+                std::fill(node_sizes.begin(), node_sizes.end(), 0);
+                std::priority_queue<std::pair<float, idx_t> > probed = coarse[i];
+                for (; !probed.empty(); probed.pop())
+                    node_sizes[list_nodes[probed.top().second]] += list_size(probed.top().second);
+                routed[std::max_element(node_sizes.begin(), node_sizes.end()) - node_sizes.begin()].push_back(i);
+            }
+            std::unique_lock<std::mutex> lock(routing_mutex);
+            for (size_t owner = 0; owner < nnodes; owner++)
+                node_queries[owner].insert(node_queries[owner].end(), routed[owner].begin(), routed[owner].end());
+        });
+
+        // Workers scan the queries of their node first, then help the other nodes
+        std::vector<std::atomic<size_t> > next_routed(nnodes);
+        for (std::atomic<size_t> &next : next_routed)
+            next = 0;
+        numa.run_on_each_node(nthreads, [&](size_t node) {
+            SearchBuffers buffers;
+            for (size_t j = 0; j < nnodes; j++) {
+                const size_t owner = (node + j) % nnodes;
+                const std::vector<size_t> &owned = node_queries[owner];
+                for (size_t pos = next_routed[owner]++; pos < owned.size(); pos = next_routed[owner]++) {
+                    const size_t i = owned[pos];
+                    search_preassigned(k, queries + i * d, coarse[i], nullptr, buffers,
+                                       distances + i * k, labels + i * k);
+                }
+            }
+        });
+    }
+
+    IndexIVF_HNSW::MemoryUsage IndexIVF_HNSW::memory_usage() const
+    {
+        MemoryUsage usage;
+        if (quantizer)
+            usage.quantizer = quantizer->memory_usage();
+        if (codec)
+            usage.codebooks += codec->memory_usage();
+        if (norm_pq)
+            usage.codebooks += norm_pq->centroids.capacity() * sizeof(float);
+        if (opq_matrix)
+            usage.codebooks += (opq_matrix->A.capacity() + opq_matrix->b.capacity()) * sizeof(float);
+
+        // Replicas of the node 0 are the instances above
+        for (size_t node = 1; node < quantizers.size(); node++)
+            usage.replicas += quantizers[node]->memory_usage() + codecs[node]->memory_usage() +
+                              norm_pqs[node]->centroids.capacity() * sizeof(float);
+
+        usage.centroid_norms = centroid_norms.capacity() * sizeof(float);
+        for (size_t i = 0; i < ids.size(); i++)
+            count_memory(ids[i], usage.ids, usage.list_overhead);
+        for (size_t i = 0; i < codes.size(); i++)
+            count_memory(codes[i], usage.codes, usage.list_overhead);
+        for (size_t i = 0; i < norm_codes.size(); i++)
+            count_memory(norm_codes[i], usage.norm_codes, usage.list_overhead);
+        for (const CompressedIds &list : compressed_ids) {
+            count_memory(list.block_offsets, usage.ids, usage.list_overhead);
+            count_memory(list.data, usage.ids, usage.list_overhead);
+        }
+        if (ondisk_lists)
+            usage.ondisk_cache = ondisk_lists->cache_size();
+
+        const SearchBuffers &buffers = search_buffers;
+        usage.search_buffers = (buffers.table.capacity() + buffers.norms.capacity() + buffers.inner_prods.capacity() +
+                                buffers.queries.capacity() + buffers.tables.capacity() +
+                                buffers.centroid_dists.capacity()) * sizeof(float);
+        return usage;
+    }
+
+    void IndexIVF_HNSW::count_numa_traffic(size_t node, idx_t centroid_idx, size_t n)
+    {
+        const size_t bytes = n * (code_size + sizeof(uint8_t) + sizeof(label_t));
+        if (list_nodes[centroid_idx] == node)
+            numa_stats.local_bytes += bytes;
+        else
+            numa_stats.remote_bytes += bytes;
+    }
+
+    size_t IndexIVF_HNSW::parallel_scan(size_t k, const std::vector<ScanRange> &ranges, const float *table,
+                                        float *distances, long *labels, size_t &ncode, size_t &nscanned)
+    {
+        ncode = 0;
+        nscanned = 0;
+        const size_t nthreads = std::min(nthreads_per_query, ranges.size());
+        if (nthreads == 0)
+            return 0;
+
+        // Thread-local max heaps
+        std::vector<float> thread_distances(nthreads * k);
+        std::vector<long> thread_labels(nthreads * k);
+        size_t npushes = 0;
+        size_t ncodes_scanned = 0;
+        size_t nranges_scanned = 0;
+
+        // The k-th distance of the merged heaps is at most the smallest k-th distance of the threads.
+        // Once that bound is not improved over stop_codes codes of all threads, the ranges left are skipped
+        std::atomic<float> kth_bound(std::numeric_limits<float>::max());
+        std::atomic<size_t> nstale_codes(0);
+        std::atomic<bool> stopped(false);
+
+#pragma omp parallel num_threads(nthreads) reduction(+: npushes, ncodes_scanned, nranges_scanned)
+        {
+            const size_t t = omp_get_thread_num();
+            const size_t node = numa_node();
+            float *local_distances = thread_distances.data() + t * k;
+            long *local_labels = thread_labels.data() + t * k;
+            faiss::maxheap_heapify(k, local_distances, local_labels);
+
+            // Norms and inner products buffers of the thread. The shared buffers are used by the sequential scan only
+            std::vector<float> local_norms;
+            std::vector<float> local_inner_prods;
+
+            // Ranges differ in size, so threads take them one by one
+#pragma omp for schedule(dynamic)
+            for (size_t r = 0; r < ranges.size(); r++) {
+                if (stopped.load(std::memory_order_relaxed))
+                    continue;
+                npushes += scan_range(node, k, ranges[r], table, local_norms, local_inner_prods,
+                                      local_distances, local_labels);
+                ncodes_scanned += ranges[r].size;
+                nranges_scanned++;
+
+                // Fewer than k results of the thread are found so far
+                const float kth_dist = local_distances[0];
+                if (!stop_codes || kth_dist == std::numeric_limits<float>::max())
+                    continue;
+                float bound = kth_bound.load();
+                while (kth_dist < bound && !kth_bound.compare_exchange_weak(bound, kth_dist));
+                if (kth_dist < bound)
+                    nstale_codes = 0;
+                else if ((nstale_codes += ranges[r].size) >= stop_codes)
+                    stopped = true;
+            }
+        }
+        ncode = ncodes_scanned;
+        nscanned = nranges_scanned;
+
+        // Merge thread-local heaps
+        for (size_t i = 0; i < nthreads * k; i++) {
+            if (thread_labels[i] != -1 && thread_distances[i] < distances[0]) {
+                push_result(k, distances, labels, thread_distances[i], thread_labels[i]);
+                npushes++;
+            }
+        }
+        return npushes;
+    }
+
+    size_t IndexIVF_HNSW::scan_range(size_t node, size_t k, const ScanRange &range, const float *table,
+                                     std::vector<float> &norms, std::vector<float> &inner_prods,
+                                     float *distances, long *labels)
+    {
+        // Decode the norms of each vector in the range
+        if (norms.size() < range.size)
+            norms.resize(range.size);
+        node_norm_pq(node)->decode(range.norm_code, norms.data(), range.size);
+        const float *ips = inner_products(node, range.size, range.code, table, inner_prods);
+
+        if (!quantizers.empty())
+            count_numa_traffic(node, range.centroid_idx, range.size);
+
+        size_t npushes = 0;
+        for (size_t j = 0; j < range.size; j++) {
+            const float dist = range.term + norms[j] - 2 * ips[j];
+            if (dist < distances[0]) {
+                push_result(k, distances, labels, dist, range.list->id(range.offset + j));
+                npushes++;
+            }
+        }
+        return npushes;
+    }
+
+    void IndexIVF_HNSW::push_result(size_t k, float *distances, long *labels, float dist, long label) const
+    {
+        if (has_spill) {
+            for (size_t i = 0; i < k; i++) {
+                if (labels[i] != label)
+                    continue;
+                if (dist >= distances[i])
+                    return;
+                // The key of a heap element decreases, so sift it down the max heap
+                size_t pos = i;
+                for (size_t child = 2 * pos + 1; child < k; pos = child, child = 2 * pos + 1) {
+                    if (child + 1 < k && distances[child + 1] > distances[child])
+                        child++;
+                    if (distances[child] <= dist)
+                        break;
+                    distances[pos] = distances[child];
+                    labels[pos] = labels[child];
+                }
+                distances[pos] = dist;
+                labels[pos] = label;
+                return;
+            }
+        }
+        faiss::maxheap_pop(k, distances, labels);
+        faiss::maxheap_push(k, distances, labels, dist, label);
+    }
+
+    // Private 
     void IndexIVF_HNSW::compute_residuals(size_t n, const float *x, float *residuals, const idx_t *keys)
     {
         for (size_t i = 0; i < n; i++) {
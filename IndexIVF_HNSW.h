@@ -5,6 +5,9 @@
 #include <fstream>
 #include <cstdio>
 #include <unordered_map>
+#include <memory>
+#include <limits>
+#include <functional>
 
 #include <faiss/index_io.h>
 #include <faiss/Heap.h>
@@ -15,6 +18,11 @@
 
 #include <hnswlib/hnswalg.h>
 #include "utils.h"
+#include "numa_utils.h"
+#include "OnDiskInvertedLists.h"
+#include "CompressedIds.h"
+#include "Codec.h"
+#include "SearchStats.h"
 
 namespace ivfhnsw {
     /** Index based on a inverted file (IVF) with Product Quantizer encoding.
@@ -34,14 +42,14 @@ namespace ivfhnsw {
       * Supports HNSW quantizer construction, PQ training, adding vertices,
       * serialization and searching.
       *
-      * Each residual vector is encoded as a product quantizer code.
+      * Each residual vector is encoded by the codec, a product quantizer code by default.
       *
-      * Currently only asymmetric queries are supported:
-      * database-to-database queries are not implemented.
+      * Queries are asymmetric: raw query vectors against the codes.
+      * Database-to-database neighbours are found by the self-join of knn_graph.
     */
     struct IndexIVF_HNSW
     {
-        typedef uint32_t idx_t;     ///< all indices are this type
+        typedef uint32_t idx_t;     ///< Centroid indices, vector ids are label_t
 
         size_t d;               ///< Vector dimension
         size_t nc;              ///< Number of centroids
@@ -49,23 +57,83 @@ namespace ivfhnsw {
 
         hnswlib::HierarchicalNSW *quantizer; ///< Quantizer that maps vectors to inverted lists (HNSW [Y.Malkov])
 
-        faiss::ProductQuantizer *pq;         ///< Produces the residual codes
+        Codec *codec;                        ///< Produces the residual codes, PQ by default
         faiss::ProductQuantizer *norm_pq;    ///< Produces the norm codes of reconstructed base vectors
         faiss::LinearTransform *opq_matrix;  ///< Rotation matrix for OPQ encoding
         bool do_opq;                         ///< Turn on/off OPQ encoding
 
         size_t nprobe;        ///< Number of probes at search time
         size_t max_codes;     ///< Max number of codes to visit to do a query
+        float probe_ratio;    ///< Probe the lists within probe_ratio of the distance to the nearest centroid (0 - all nprobe lists)
+        size_t stop_codes;    ///< Stop a scan once the k-th distance is not improved over this many codes (0 - off)
+        size_t nthreads_per_query; ///< Number of threads scanning the probed lists of one query (1 - sequential scan)
+        size_t coarse_batch_size;  ///< Number of HNSW traversals interleaved on one thread by assign and search_batch, at most 16.
+                                   ///< They share visited marks of 4 bytes per centroid per thread
+        size_t query_batch_size;   ///< Number of queries search_batch rotates and computes query tables for at once
+        float spill_ratio;         ///< Store a vector in a second list if it is within spill_ratio of the nearest centroid (0 - off)
+        float spill_lambda;        ///< Weight of the penalty for second centroids along the residual of the nearest one
+        size_t spill_candidates;   ///< Number of the nearest centroids to choose the second list from
+        bool has_spill;            ///< Lists hold second copies of spilled vectors, search removes duplicate ids. Stored by write()
 
-        std::vector<std::vector<idx_t> > ids;           ///< Inverted lists for indexes
+        std::vector<std::vector<label_t> > ids;         ///< Inverted lists for indexes
         std::vector<std::vector<uint8_t> > codes;       ///< PQ codes of residuals
         std::vector<std::vector<uint8_t> > norm_codes;  ///< PQ codes of norms of reconstructed base vectors
+        std::vector<CompressedIds> compressed_ids;      ///< Compressed inverted lists for indexes, ids are empty if set
+
+        NumaStats numa_stats;   ///< Inverted list traffic of search from local/remote NUMA nodes (after place_numa)
+
+        OnDiskInvertedLists *ondisk_lists;  ///< Inverted lists served from SSD, in-memory lists are empty if set
+
+        AddStats *add_stats;    ///< Stats add_batch adds to, nullptr - not collected
 
     protected:
-        std::vector<float> norms;           ///< L2 square norms of reconstructed base vectors
         std::vector<float> centroid_norms;  ///< L2 square norms of coarse centroids
 
     public:
+        /** Scratch memory of a search, reused across queries
+          *
+          * search() and search_batch() without buffers use the buffers of the index,
+          * so only one thread may call them at a time. Threads searching concurrently
+          * pass their own buffers, one object per thread.
+        */
+        struct SearchBuffers
+        {
+            std::vector<float> table;           ///< Query table of the codec
+            std::vector<float> norms;           ///< Decoded norms of the vectors of a scanned list
+            std::vector<float> inner_prods;     ///< Inner products of the query with the codes of a scanned list
+            std::vector<float> queries;         ///< Rotated queries (if do_opq)
+            std::vector<float> tables;          ///< Query tables of a batch
+            std::vector<float> centroid_dists;  ///< Distances to the coarse centroids by index, zero between queries (grouping)
+            SearchStats *stats;                 ///< Stats the searches add to, nullptr - not collected
+
+            SearchBuffers(): stats(nullptr) {}
+        };
+
+        /// Bytes of memory held by the parts of the index, see memory_usage()
+        struct MemoryUsage
+        {
+            size_t quantizer;       ///< HNSW vertices with their links and the visited lists of its searches
+            size_t codebooks;       ///< Codec, norm PQ and OPQ matrix
+            size_t replicas;        ///< Copies of the quantizer and the codebooks on the other NUMA nodes
+            size_t centroid_norms;  ///< L2 square norms of the coarse centroids
+            size_t ids;             ///< Vector ids of the inverted lists, compressed ones if compress_ids is called
+            size_t codes;           ///< Residual codes of the inverted lists
+            size_t norm_codes;      ///< Norm codes of the inverted lists
+            size_t list_overhead;   ///< Unused capacity and vector objects of the per-list vectors
+            size_t grouping;        ///< Sub-centroid indices, sub-group sizes, alphas and inter-centroid distances
+            size_t ondisk_cache;    ///< Inverted lists read from SSD and cached in RAM
+            size_t search_buffers;  ///< Scratch memory of search() without buffers, e.g. the norms of max_group_size
+
+            MemoryUsage(): quantizer(0), codebooks(0), replicas(0), centroid_norms(0), ids(0), codes(0),
+                           norm_codes(0), list_overhead(0), grouping(0), ondisk_cache(0), search_buffers(0) {}
+
+            size_t total() const
+            {
+                return quantizer + codebooks + replicas + centroid_norms + ids + codes + norm_codes +
+                       list_overhead + grouping + ondisk_cache + search_buffers;
+            }
+        };
+
         explicit IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
                                size_t nbits_per_idx, size_t max_group_size = 65536);
         virtual ~IndexIVF_HNSW();
@@ -103,43 +171,417 @@ namespace ivfhnsw {
          */
         virtual void search(size_t k, const float *x, float *distances, long *labels);
 
+        /// search() with the scratch memory of the calling thread, safe to call from several threads
+        void search(size_t k, const float *x, float *distances, long *labels, SearchBuffers &buffers);
+
+        /** Query n vectors of dimension d to the index.
+         *
+         * Coarse search of the queries is done by interleaved HNSW traversals, see coarse_batch_size.
+         * Queries are processed in batches of query_batch_size: the OPQ rotation and the query tables
+         * of a batch are computed by matrix multiplications into buffers reused across batches.
+         *
+         * @param n           number of queries
+         * @param k           number of the closest vertices to search
+         * @param x           query vectors, size n * d
+         * @param distances   output pairwise distances, size n * k
+         * @param labels      output labels of the nearest neighbours, size n * k
+         */
+        void search_batch(size_t n, size_t k, const float *x, float *distances, long *labels);
+
+        /// search_batch() with the scratch memory of the calling thread, safe to call from several threads
+        void search_batch(size_t n, size_t k, const float *x, float *distances, long *labels, SearchBuffers &buffers);
+
+        /** Fit probe_ratio on training queries with known nearest neighbours
+          *
+          * A query needs the lists up to the nearest one holding its neighbour among the nprobe nearest centroids,
+          * i.e. the ratio of the L2 square distance to that list to the distance to the nearest centroid.
+          * probe_ratio is set to the smallest ratio covering the <coverage> fraction of the queries,
+          * or to 0 (all nprobe lists) if more queries have their neighbour beyond the nprobe lists.
+          * Ids of all lists are read to locate the neighbours. Set nprobe before the call.
+          *
+          * @param n           number of training queries
+          * @param x           training queries, size n * d
+          * @param gt          ground truth neighbours, size n * ngt, only the first one is used
+          * @param ngt         number of ground truth neighbours per query
+          * @param coverage    fraction of the queries to cover, e.g. 0.95
+          * @return            probe_ratio
+        */
+        float train_probe_ratio(size_t n, const float *x, const idx_t *gt, size_t ngt, float coverage);
+
         /** Add n vectors of dimension d to the index.
+          *
+          * If spill_ratio > 0, a vector is also stored in a second list (see select_spill),
+          * so the same recall is reached with a smaller nprobe. has_spill is then set and search removes
+          * duplicate ids, also after the index is written and read back.
           *
           * @param n                 number of base vectors in a batch
           * @param x                 base vectors to add, size n * d
           * @param xids              ids to store for the vectors (size n)
           * @param precomputed_idx   if non-null, assigned idxs to store for the vectors (size n)
         */
-        virtual void add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx = nullptr);
+        virtual void add_batch(size_t n, const float *x, const label_t *xids, const idx_t *precomputed_idx = nullptr);
+
+        /** Encode n vectors of dimension d assigned to coarse centroids
+          *
+          * @param n              number of vectors
+          * @param x              vectors to encode, size n * d
+          * @param idx            assigned coarse centroids, size n
+          * @param xcodes         output PQ codes of residuals, size n * code_size
+          * @param xnorm_codes    output PQ codes of norms of reconstructed vectors, size n
+        */
+        void encode(size_t n, const float *x, const idx_t *idx, uint8_t *xcodes, uint8_t *xnorm_codes);
 
-        /** Train product quantizers
+        /** Train the codec, the OPQ rotation (if do_opq) and the norm product quantizer
           *
           * @param n     number of training vectors of dimension d
           * @param x     learn vectors, size n * d
         */
         virtual void train_pq(size_t n, const float *x);
 
+        /// Replace the codec, the index takes the ownership. Call it before training or adding vectors
+        void set_codec(Codec *new_codec);
+
         /// Write index to the path
         virtual void write(const char *path);
 
-        /// Read index from the path
+        /// Read index from the path. Inverted lists are skipped if they are served from SSD
         virtual void read(const char *path);
 
+        /** Append the inverted lists of the other index built with the same quantizer and codebooks
+          *
+          * Use it to combine indexes built over disjoint sets of vectors. The other index is not changed.
+        */
+        virtual void merge_from(const IndexIVF_HNSW &other);
+
+        /** Merge index files of shards built with the same quantizer and codebooks
+          *
+          * Inverted lists are concatenated list by list, so only one list per shard is in memory at a time.
+          *
+          * @param shard_paths   paths to the shard indexes
+          * @param path          path to the merged index
+        */
+        static void merge_shards(const std::vector<const char *> &shard_paths, const char *path);
+
+        /// Write inverted lists to the path in the OnDiskInvertedLists format
+        void write_ondisk_lists(const char *path);
+
+        /** Serve inverted lists from the file written by write_ondisk_lists and release the in-memory lists
+          *
+          * The index is read-only afterwards: add_batch, add_group and write() throw.
+          *
+          * @param path              path to the lists
+          * @param nthreads          number of I/O threads
+          * @param cache_capacity    max bytes of hot lists cached in RAM
+        */
+        void load_ondisk_lists(const char *path, size_t nthreads = 16, size_t cache_capacity = 1 << 30);
+
+        /** Replace the inverted lists for indexes with compressed ones
+          *
+          * Sorted runs of indexes, e.g. ids added in increasing order, are delta coded.
+          * Call it once all vectors are added: add_batch and add_group throw afterwards.
+          * write() stores the indexes uncompressed.
+        */
+        void compress_ids();
+
         /// Compute norms of the HNSW vertices
         void compute_centroid_norms();
 
         /// For correct search using OPQ encoding rotate points in the coarse quantizer
         void rotate_quantizer();
 
+        /** Place the index on NUMA nodes
+          *
+          * The quantizer, pq and norm_pq are replicated on every node, search takes efSearch of quantizer
+          * for all replicas, so it may be set after placement. Inverted lists are split
+          * into nnodes slabs of about the same size along the principal axis of the centroids,
+          * so the nearest lists of a query are mostly on one node. The nodes holding the lists
+          * are then read from the page tables (numa_stats.measured), if the kernel reports them.
+          * Search uses the replicas of the node of the calling thread, search_numa runs
+          * pinned workers and routes each query to the node holding most of its lists.
+          * Call it once the index is constructed or loaded and the quantizer is rotated.
+        */
+        void place_numa();
+
+        /** Search n queries on worker threads pinned to the NUMA nodes, see place_numa
+          *
+          * The queries are coarse searched by the workers of all nodes. Each query is then scanned
+          * by a worker of the node holding the most bytes of its probed lists, idle workers take
+          * the queries of other nodes. Workers have their own search buffers.
+          *
+          * @param n                   number of queries
+          * @param k                   number of the closest vertices to search
+          * @param x                   query vectors, size n * d
+          * @param distances           output pairwise distances, size n * k
+          * @param labels              output labels of the nearest neighbours, size n * k
+          * @param nthreads_per_node   number of workers pinned to each node
+        */
+        void search_numa(size_t n, size_t k, const float *x, float *distances, long *labels,
+                         size_t nthreads_per_node);
+
+        /// Number of NUMA nodes the index is placed on, 0 if it is not placed
+        size_t numa_nodes() const { return quantizers.size(); }
+
+        /// Number of vectors in the inverted list
+        size_t list_size(idx_t centroid_idx) const
+        {
+            return ondisk_lists ? ondisk_lists->list_size(centroid_idx) : norm_codes[centroid_idx].size();
+        }
+
+        /** Memory held by the index by component
+          *
+          * Per-list vectors are counted by their capacity, the allocator overhead is not counted.
+        */
+        virtual MemoryUsage memory_usage() const;
+
+        /** Receives the neighbours of n indexed vectors from knn_graph
+          *
+          * @param n           number of vectors
+          * @param ids         ids of the vectors, size n
+          * @param labels      ids of their k nearest neighbours, nearest first, padded with -1s, size n * k
+          * @param distances   L2 square distances to the neighbours, size n * k
+        */
+        typedef std::function<void(size_t n, const label_t *ids, const long *labels, const float *distances)>
+                GraphCallback;
+
+        /** Approximate k-NN graph of the indexed vectors (self-join)
+          *
+          * Instead of searching every vector, each inverted list is joined with itself and with its
+          * <nadjacent> nearest adjacent lists: the HNSW base layer neighbours of its centroid
+          * (the <nsubc> nearest centroids for the grouping index). The vectors are reconstructed from their codes
+          * and the distances between the reconstructions are computed by BLAS, so no coarse search,
+          * query table or base vector read is needed.
+          *
+          * Lists are joined in parallel in chunks of <chunk_size> lists, the neighbours of the vectors of a chunk
+          * are passed to emit in list order from the calling thread, so only one chunk of the graph is in memory.
+          * Lists served from SSD are read as needed. With OPQ, call it after rotate_quantizer as for search.
+          * A vector spilled to a second list is reported from both lists.
+          *
+          * @param k            number of neighbours per vector, the vector itself is excluded
+          * @param nadjacent    number of adjacent lists joined with each list
+          * @param chunk_size   number of lists joined at a time
+          * @param emit         receives the neighbours of the vectors of each non-empty list
+        */
+        void knn_graph(size_t k, size_t nadjacent, size_t chunk_size, const GraphCallback &emit);
+
     protected:
-        /// Size pq.M * pq.ksub
-        std::vector<float> precomputed_table;
+        /// Scratch memory of search() and search_batch() called without buffers
+        SearchBuffers search_buffers;
+
+        /** Search the inverted lists of the coarse centroids found for the query
+          *
+          * @param k           number of the closest vertices to search
+          * @param query       query vector (rotated if do_opq), size d
+          * @param coarse      nprobe nearest coarse centroids to the query, it is emptied
+          * @param table       query table computed in advance, nullptr - compute it to buffers.table
+          * @param buffers     scratch memory of the calling thread
+          * @param distances   output pairwise distances, size k
+          * @param labels      output labels of the nearest neighbours, size k
+        */
+        virtual void search_preassigned(size_t k, const float *query,
+                                        std::priority_queue<std::pair<float, idx_t> > &coarse,
+                                        const float *table, SearchBuffers &buffers,
+                                        float *distances, long *labels);
+
+        /** Rotate n queries (if do_opq) and compute their tables to buffers.tables
+          *
+          * @return queries to search, buffers.queries if do_opq and x otherwise
+        */
+        const float *preprocess_queries(size_t n, const float *x, SearchBuffers &buffers);
+
+        /** Encode residuals and compute L2 square norms of the reconstructed vectors
+          *
+          * @param n           number of vectors
+          * @param residuals   residuals, rotated if do_opq, size n * d
+          * @param bases       centroids the residuals are taken from, not rotated, size n
+          * @param xcodes      output codes, size n * code_size
+          * @param norms       output L2 square norms of bases[i] + decoded residual i, size n
+        */
+        void encode_residuals(size_t n, const float *residuals, const float *const *bases,
+                              uint8_t *xcodes, float *norms);
+
+        /// Rotate n vectors in place with the OPQ matrix
+        void rotate(size_t n, float *x) const;
+
+        /// Inner products of the query with n codes by its table into the buffer, resized if needed
+        const float *inner_products(size_t node, size_t n, const uint8_t *codes, const float *table,
+                                    std::vector<float> &buffer) const;
+
+        /** Choose the second lists of vectors to spill them to
+          *
+          * Following SOAR [Sun et al.], among the <spill_candidates> nearest centroids c to x
+          * the one minimizing ||x - c||^2 + spill_lambda * (r|x - c)^2 / ||r||^2 is taken,
+          * where r is the residual to the assigned centroid. Residuals to the second centroid that are
+          * orthogonal to r are preferred, as a query missing the first list is likely to be close to x along r.
+          * The vector is spilled if ||x - c||^2 <= spill_ratio * ||r||^2.
+          *
+          * @param n           number of vectors
+          * @param x           vectors, size n * d
+          * @param idx         assigned coarse centroids, size n
+          * @param spill_idx   output second coarse centroids of spilled vectors, size n
+          * @return            positions of spilled vectors
+        */
+        std::vector<size_t> select_spill(size_t n, const float *x, const idx_t *idx, idx_t *spill_idx);
+
+        /// Replace the largest result in the max heap of k results. If has_spill, a duplicate id keeps its smaller distance
+        void push_result(size_t k, float *distances, long *labels, float dist, long label) const;
+
+        NumaTopology numa;                                    ///< NUMA nodes and their CPUs
+        std::vector<uint8_t> list_nodes;                      ///< NUMA node holding each inverted list
+        std::vector<hnswlib::HierarchicalNSW *> quantizers;   ///< Quantizer replica per NUMA node
+        std::vector<Codec *> codecs;                          ///< Codec replica per NUMA node
+        std::vector<faiss::ProductQuantizer *> norm_pqs;      ///< Norm PQ replica per NUMA node
+
+        /// NUMA node of the calling thread, 0 if the index is not placed
+        size_t numa_node() const { return quantizers.empty() ? 0 : numa.current_node(); }
+
+        /** Replicas of the node, the original instances if the index is not placed
+          *
+          * Coarse search with a quantizer replica passes quantizer->efSearch, replicas keep the one at placement.
+        */
+        hnswlib::HierarchicalNSW *node_quantizer(size_t node) const { return quantizers.empty() ? quantizer : quantizers[node]; }
+        Codec *node_codec(size_t node) const { return codecs.empty() ? codec : codecs[node]; }
+        faiss::ProductQuantizer *node_norm_pq(size_t node) const { return norm_pqs.empty() ? norm_pq : norm_pqs[node]; }
+
+        /// Segments of SegmentedIndex are probed and scanned like the lists of the index
+        friend struct SegmentedIndex;
+
+        /// Number of the nprobe nearest lists to scan, see probe_ratio. dists are the sorted distances to the lists
+        size_t probe_count(const float *dists) const
+        {
+            if (probe_ratio <= 0)
+                return nprobe;
+            size_t n = 1;
+            while (n < nprobe && dists[n] <= probe_ratio * dists[0])
+                n++;
+            return n;
+        }
+
+        /// Stops a scan once the k-th distance is not improved over stop_codes codes
+        struct ScanStop
+        {
+            size_t stop_codes;
+            float kth_dist;         ///< Best k-th distance so far
+            size_t nstale;          ///< Codes scanned since it improved
+
+            explicit ScanStop(size_t stop_codes):
+                    stop_codes(stop_codes), kth_dist(std::numeric_limits<float>::max()), nstale(0) {}
+
+            /// Account n codes scanned before the k-th distance became dist, true if the scan has to stop
+            bool update(size_t n, float dist)
+            {
+                if (!stop_codes)
+                    return false;
+                if (dist < kth_dist) {
+                    kth_dist = dist;
+                    nstale = 0;
+                    return false;
+                }
+                // Fewer than k results are found so far
+                if (dist == std::numeric_limits<float>::max())
+                    return false;
+                nstale += n;
+                return nstale >= stop_codes;
+            }
+        };
+
+        /// Account <n> codes of the list read from the node in numa_stats
+        void count_numa_traffic(size_t node, idx_t centroid_idx, size_t n);
+
+        /// Intended NUMA node of each list: slabs of similar size along the principal axis of the centroids
+        std::vector<uint8_t> partition_lists(size_t nnodes) const;
+
+        /// Data of an inverted list. <holder> keeps a list read from SSD in memory
+        struct ListView {
+            const label_t *ids;                     ///< Indexes, nullptr if they are compressed
+            const CompressedIds *compressed_ids;
+            const uint8_t *codes;
+            const uint8_t *norm_codes;
+            OnDiskInvertedLists::ListPtr holder;
+
+            /// Index of the j-th vector in the list
+            label_t id(size_t j) const { return ids ? ids[j] : compressed_ids->get(j); }
+        };
+
+        /// Get the inverted list, waits for its read if it is served from SSD
+        ListView get_list(idx_t centroid_idx);
+
+        /// Reconstruct the vectors of the list in the space of the quantizer, x of size list_size * d
+        virtual void reconstruct_list(idx_t centroid_idx, const ListView &list, float *x) const;
+
+        /// Lists adjacent to the list that knn_graph joins it with, HNSW base layer neighbours of the centroid
+        virtual void adjacent_lists(idx_t centroid_idx, std::vector<idx_t> &lists) const;
+
+        /// Contiguous run of codes from one (sub-)list and the query-dependent part of their distances
+        struct ScanRange {
+            idx_t centroid_idx;         ///< Inverted list the range belongs to
+            float term;                 ///< Distance terms shared by all codes of the range
+            size_t size;                ///< Number of codes in the range
+            const uint8_t *code;        ///< PQ codes of residuals
+            const uint8_t *norm_code;   ///< PQ codes of norms
+            const ListView *list;       ///< List of the range
+            size_t offset;              ///< Position of the range in the list
+        };
+
+        /** Scan the codes of the range into the max heap of k results
+          *
+          * @param node          NUMA node of the calling thread
+          * @param norms         buffer for the decoded norms, resized if needed
+          * @param inner_prods   buffer for the inner products, resized if needed
+          * @return              number of heap pushes
+        */
+        size_t scan_range(size_t node, size_t k, const ScanRange &range, const float *table,
+                          std::vector<float> &norms, std::vector<float> &inner_prods,
+                          float *distances, long *labels);
+
+        /** Scan the ranges with <nthreads_per_query> threads
+          *
+          * Each thread keeps its own top-k max heap over the ranges it takes,
+          * the heaps are merged into distances and labels at the end.
+          * With stop_codes, the scan stops at range granularity once the smallest k-th distance of the threads,
+          * a bound on the merged k-th distance, is not improved over stop_codes codes: the ranges not taken yet are skipped.
+          * @param table      query table
+          * @param ncode      output number of codes scanned
+          * @param nscanned   output number of ranges scanned
+          * @return           number of heap pushes
+        */
+        size_t parallel_scan(size_t k, const std::vector<ScanRange> &ranges, const float *table,
+                             float *distances, long *labels, size_t &ncode, size_t &nscanned);
+
+        /// Write the inverted lists for indexes, compressed ones are decoded
+        void write_ids(std::ostream &output);
+
+        /// Read one inverted list for indexes stored with <id_size> bytes per index, 32-bit indexes are widened
+        static void read_id_list(std::istream &input, size_t id_size, std::vector<label_t> &list_ids);
+
+        /** Read the inverted lists for indexes
+          *
+          * @param input     stream positioned at the lists
+          * @param id_size   size of ids in the file returned by read_id_size()
+          * @param skip      skip the lists instead of reading them
+        */
+        void read_ids(std::istream &input, size_t id_size, bool skip);
+
+        /// Mark the file as storing 64-bit ids, nothing is written for 32-bit ones
+        static void write_id_size(std::ostream &output);
+
+        /// Size of ids stored in the file, consumes the 64-bit id mark if it is present
+        static size_t read_id_size(std::istream &input);
+
+        /// Mark the file as holding spilled vectors, nothing is written if has_spill is not set
+        static void write_spill_mark(std::ostream &output, bool has_spill);
+
+        /// Whether the file holds spilled vectors, consumes the spill mark if it is present
+        static bool read_spill_mark(std::istream &input);
+
+        /// Throw if the other index is built with different parameters or its lists are on SSD or compressed
+        void check_mergeable(const IndexIVF_HNSW &other) const;
 
-        /// L2 sqr distance function for PQ codes
-        float pq_L2sqr(const uint8_t *code);
+        /// Open shard index files and read d and nc, they have to be the same in all shards. has_spill is set if any shard spills
+        static std::vector<std::unique_ptr<std::ifstream> > open_shards(const std::vector<const char *> &shard_paths,
+                                                                       std::vector<size_t> &id_sizes,
+                                                                       size_t &d, size_t &nc, bool &has_spill);
 
     private:
-        void reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys);
         void compute_residuals(size_t n, const float *x, float *residuals, const idx_t *keys);
     };
 }
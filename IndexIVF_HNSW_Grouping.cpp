@@ -13,14 +13,15 @@ namespace ivfhnsw
         nn_centroid_idxs.resize(nc);
         subgroup_sizes.resize(nc);
 
-        query_centroid_dists.resize(nc);
-        std::fill(query_centroid_dists.begin(), query_centroid_dists.end(), 0);
         inter_centroid_dists.resize(nc);
     }
 
     void IndexIVF_HNSW_Grouping::add_group(size_t centroid_idx, size_t group_size,
-                                           const float *data, const idx_t *idxs)
+                                           const float *data, const label_t *idxs)
     {
+        if (!compressed_ids.empty())
+            throw std::runtime_error("Groups cannot be added once the ids are compressed by compress_ids");
+        FAISS_THROW_IF_NOT_MSG(!ondisk_lists, "Groups cannot be added to inverted lists served from SSD");
         // Find NN centroids to source centroid 
         const float *centroid = quantizer->getDataByInternalId(centroid_idx);
         std::priority_queue<std::pair<float, idx_t>> nn_centroids_raw = quantizer->searchKnn(centroid, nsubc + 1);
@@ -66,46 +67,28 @@ namespace ivfhnsw
         compute_residuals(group_size, data, residuals.data(), subcentroids.data(), subcentroid_idxs.data());
 
         // Rotate residuals
-        if (do_opq){
-            std::vector<float> copy_residuals(group_size * d);
-            memcpy(copy_residuals.data(), residuals.data(), group_size * d * sizeof(float));
-            opq_matrix->apply_noalloc(group_size, copy_residuals.data(), residuals.data());
-        }
-
-        // Compute codes
-        std::vector<uint8_t> xcodes(group_size * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), group_size);
-
-        // Decode codes
-        std::vector<float> decoded_residuals(group_size * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), group_size);
-
-        // Reverse rotation
-        if (do_opq){
-            std::vector<float> copy_decoded_residuals(group_size * d);
-            memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), group_size * d * sizeof(float));
-            opq_matrix->transform_transpose(group_size, copy_decoded_residuals.data(), decoded_residuals.data());
-        }
+        if (do_opq)
+            rotate(group_size, residuals.data());
 
-        // Reconstruct data
-        std::vector<float> reconstructed_x(group_size * d);
-        reconstruct(group_size, reconstructed_x.data(), decoded_residuals.data(),
-                    subcentroids.data(), subcentroid_idxs.data());
+        // Compute codes and norms of reconstructed data
+        std::vector<const float *> bases(group_size);
+        for (size_t i = 0; i < group_size; i++)
+            bases[i] = subcentroids.data() + subcentroid_idxs[i] * d;
 
-        // Compute norms 
+        std::vector<uint8_t> xcodes(group_size * code_size);
         std::vector<float> norms(group_size);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, group_size);
+        encode_residuals(group_size, residuals.data(), bases.data(), xcodes.data(), norms.data());
 
         // Compute norm codes
         std::vector<uint8_t> xnorm_codes(group_size);
         norm_pq->compute_codes(norms.data(), xnorm_codes.data(), group_size);
 
         // Distribute codes
-        std::vector<std::vector<idx_t> > construction_ids(nsubc);
+        std::vector<std::vector<label_t> > construction_ids(nsubc);
         std::vector<std::vector<uint8_t> > construction_codes(nsubc);
         std::vector<std::vector<uint8_t> > construction_norm_codes(nsubc);
         for (size_t i = 0; i < group_size; i++) {
-            idx_t idx = idxs[i];
+            label_t idx = idxs[i];
             idx_t subcentroid_idx = subcentroid_idxs[i];
 
             construction_ids[subcentroid_idx].push_back(idx);
@@ -156,8 +139,20 @@ namespace ivfhnsw
       * Since y_R defined by a product quantizer, it is split across
       * sub-vectors and stored separately for each sub-vector.
     */
-    void IndexIVF_HNSW_Grouping::search(size_t k, const float *x, float *distances, long *labels)
+    void IndexIVF_HNSW_Grouping::search_preassigned(size_t k, const float *query,
+                                                    std::priority_queue<std::pair<float, idx_t> > &coarse,
+                                                    const float *table, SearchBuffers &buffers,
+                                                    float *distances, long *labels)
     {
+        SearchStats *stats = buffers.stats;
+        StageTimer timer(stats);
+
+        // Distances to the coarse centroids, zero if not computed for this query.
+        // Used for distance computation between a query and base points
+        if (buffers.centroid_dists.size() < nc)
+            buffers.centroid_dists.resize(nc, 0);
+        std::vector<float> &query_centroid_dists = buffers.centroid_dists;
+
         // Distances to subcentroids. Used for pruning.
         std::vector<float> query_subcentroid_dists;
 
@@ -165,31 +160,39 @@ namespace ivfhnsw
         std::vector<idx_t> used_centroid_idxs;
         used_centroid_idxs.reserve(nsubc * nprobe);
         idx_t centroid_idxs[nprobe]; // Indices of the nearest coarse centroids
+        float probe_dists[nprobe];   // Distances to them
 
-        // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        // Use the quantizer and the codebooks of the current NUMA node
+        const size_t node = numa_node();
+        hnswlib::HierarchicalNSW *local_quantizer = node_quantizer(node);
 
-        // Find the nearest coarse centroids to the query
-        auto coarse = quantizer->searchKnn(query, nprobe);
         for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
             idx_t centroid_idx = coarse.top().second;
             centroid_idxs[i] = centroid_idx;
             query_centroid_dists[centroid_idx] = coarse.top().first;
+            probe_dists[i] = coarse.top().first;
             used_centroid_idxs.push_back(centroid_idx);
             coarse.pop();
         }
+        // Groups far from the query relative to the nearest one are not probed
+        const size_t nprobe_query = probe_count(probe_dists);
+
+        // Start reading the lists from SSD while the pruning threshold and the table are computed
+        if (ondisk_lists)
+            ondisk_lists->prefetch(centroid_idxs, nprobe_query);
+
         // Computing threshold for pruning
         float threshold = 0.0;
         if (do_pruning) {
             size_t ncode = 0;
             size_t nsubgroups = 0;
 
-            query_subcentroid_dists.resize(nsubc * nprobe);
+            query_subcentroid_dists.resize(nsubc * nprobe_query);
             float *qsd = query_subcentroid_dists.data();
 
-            for (size_t i = 0; i < nprobe; i++) {
+            for (size_t i = 0; i < nprobe_query; i++) {
                 const idx_t centroid_idx = centroid_idxs[i];
-                const size_t group_size = norm_codes[centroid_idx].size();
+                const size_t group_size = list_size(centroid_idx);
                 if (group_size == 0)
                     continue;
 
@@ -203,7 +206,7 @@ namespace ivfhnsw
                     const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
                     // Compute the distance to the coarse centroid if it is not computed
                     if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
+                        const float *nn_centroid = local_quantizer->getDataByInternalId(nn_centroid_idx);
                         query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
                         used_centroid_idxs.push_back(nn_centroid_idx);
                     }
@@ -218,88 +221,191 @@ namespace ivfhnsw
                     break;
             }
             threshold /= nsubgroups;
+            timer.stop(SearchStats::threshold);
         }
 
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
+        // Precompute table unless it is computed with the batch
+        if (!table) {
+            buffers.table.resize(codec->table_size);
+            node_codec(node)->compute_table(query, buffers.table.data());
+            table = buffers.table.data();
+            timer.stop(SearchStats::table);
+        }
 
         // Prepare max heap with k answers
         faiss::maxheap_heapify(k, distances, labels);
 
+        if (do_pruning)
+            scan_subgroups<true>(k, query, centroid_idxs, nprobe_query, query_subcentroid_dists.data(), threshold,
+                                 used_centroid_idxs, table, buffers, distances, labels);
+        else
+            scan_subgroups<false>(k, query, centroid_idxs, nprobe_query, query_subcentroid_dists.data(), threshold,
+                                  used_centroid_idxs, table, buffers, distances, labels);
+
+        // Zero computed dists for later queries
+        for (idx_t used_centroid_idx : used_centroid_idxs)
+            query_centroid_dists[used_centroid_idx] = 0;
+        timer.stop(SearchStats::scan);
+    }
+
+    template<bool pruning>
+    size_t IndexIVF_HNSW_Grouping::select_subgroups(size_t node, const float *query, idx_t centroid_idx,
+                                                    const ListView &list, const float *qsd, float threshold,
+                                                    std::vector<idx_t> &used_centroid_idxs, SearchBuffers &buffers,
+                                                    std::vector<ScanRange> &ranges, size_t &npruned)
+    {
+        std::vector<float> &query_centroid_dists = buffers.centroid_dists;
+        hnswlib::HierarchicalNSW *local_quantizer = node_quantizer(node);
+
+        const float alpha = alphas[centroid_idx];
+        const float term1 = (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
+
+        const uint8_t *code = list.codes;
+        const uint8_t *norm_code = list.norm_codes;
+        size_t offset = 0;
         size_t ncode = 0;
-        const float *qsd = query_subcentroid_dists.data();
 
-        for (size_t i = 0; i < nprobe; i++) {
-            const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
-            if (group_size == 0)
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
+            if (subgroup_size == 0)
                 continue;
 
-            const float alpha = alphas[centroid_idx];
-            const float term1 = (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
+            // Check pruning condition
+            if (!pruning || qsd[subc] < threshold) {
+                const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
 
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
+                // Compute the distance to the coarse centroid if it is not computed
+                if (query_centroid_dists[nn_centroid_idx] < EPS) {
+                    const float *nn_centroid = local_quantizer->getDataByInternalId(nn_centroid_idx);
+                    query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
+                    used_centroid_idxs.push_back(nn_centroid_idx);
+                }
 
-            for (size_t subc = 0; subc < nsubc; subc++) {
-                const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
-                if (subgroup_size == 0)
-                    continue;
+                const float term2 = alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
+                ranges.push_back({centroid_idx, term1 + term2, subgroup_size, code, norm_code, &list, offset});
+                ncode += subgroup_size;
+            } else
+                npruned++;
+            // Shift to the next group
+            code += subgroup_size * code_size;
+            norm_code += subgroup_size;
+            offset += subgroup_size;
+        }
+        return ncode;
+    }
 
-                // Check pruning condition
-                if (!do_pruning || qsd[subc] < threshold) {
-                    const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
+    template<bool pruning>
+    void IndexIVF_HNSW_Grouping::scan_subgroups(size_t k, const float *query, const idx_t *centroid_idxs,
+                                                size_t nprobe_query,
+                                                const float *query_subcentroid_dists, float threshold,
+                                                std::vector<idx_t> &used_centroid_idxs,
+                                                const float *table, SearchBuffers &buffers,
+                                                float *distances, long *labels)
+    {
+        const size_t node = numa_node();
+        const bool parallel = nthreads_per_query > 1;
 
-                    // Compute the distance to the coarse centroid if it is not computed
-                    if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                        query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
-                        used_centroid_idxs.push_back(nn_centroid_idx);
-                    }
+        // Lists and sub-groups of the current group, of all probed groups for the parallel scan
+        std::vector<ListView> lists;
+        std::vector<ScanRange> ranges;
+        lists.reserve(parallel ? nprobe_query : 1);
+        ranges.reserve(parallel ? nsubc * nprobe_query : nsubc);
 
-                    const float term2 = alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
-                    norm_pq->decode(norm_code, norms.data(), subgroup_size);
+        size_t ncode = 0;
+        size_t nlists = 0;
+        size_t nscanned = 0;
+        size_t npruned = 0;
+        size_t npushes = 0;
+        const float *qsd = query_subcentroid_dists;
+        ScanStop stop(stop_codes);
+        bool stopped = false;
+
+        for (size_t i = 0; i < nprobe_query && !stopped; i++) {
+            const idx_t centroid_idx = centroid_idxs[i];
+            if (list_size(centroid_idx) == 0)
+                continue;
 
-                    for (size_t j = 0; j < subgroup_size; j++) {
-                        const float term4 = 2 * pq_L2sqr(code + j * code_size);
-                        const float dist = term1 + term2 + norms[j] - term4; //term3 = norms[j]
-                        if (dist < distances[0]) {
-                            faiss::maxheap_pop(k, distances, labels);
-                            faiss::maxheap_push(k, distances, labels, dist, id[j]);
-                        }
+            if (!parallel) {
+                lists.clear();
+                ranges.clear();
+            }
+            lists.push_back(get_list(centroid_idx));
+            const size_t group_ncode = select_subgroups<pruning>(node, query, centroid_idx, lists.back(), qsd,
+                                                                 threshold, used_centroid_idxs, buffers,
+                                                                 ranges, npruned);
+            nlists++;
+
+            if (parallel)
+                ncode += group_ncode;
+            else
+                for (const ScanRange &range : ranges) {
+                    npushes += scan_range(node, k, range, table, buffers.norms, buffers.inner_prods,
+                                          distances, labels);
+                    ncode += range.size;
+                    nscanned++;
+                    if (stop.update(range.size, distances[0])) {
+                        stopped = true;
+                        break;
                     }
-                    ncode += subgroup_size;
                 }
-                // Shift to the next group
-                code += subgroup_size * code_size;
-                norm_code += subgroup_size;
-                id += subgroup_size;
-            }
             if (ncode >= max_codes)
                 break;
-            if (do_pruning)
+            if (pruning)
                 qsd += nsubc;
         }
-        // Zero computed dists for later queries
-        for (idx_t used_centroid_idx : used_centroid_idxs)
-            query_centroid_dists[used_centroid_idx] = 0;
+        // Split the selected sub-groups across threads
+        if (parallel)
+            npushes = parallel_scan(k, ranges, table, distances, labels, ncode, nscanned);
+
+        if (SearchStats *stats = buffers.stats) {
+            stats->nlists += nlists;
+            stats->nsubgroups += nscanned;
+            stats->nsubgroups_pruned += npruned;
+            stats->ncodes += ncode;
+            stats->nheap_pushes += npushes;
+        }
+    }
 
-        if (do_opq)
-            delete const_cast<float *>(query);
+    void IndexIVF_HNSW_Grouping::reconstruct_list(idx_t centroid_idx, const ListView &list, float *x) const
+    {
+        codec->decode(list_size(centroid_idx), list.codes, x);
+
+        // Sub-centroids are c + alpha * (c_nn - c), the codes are ordered by sub-group
+        const float *centroid = quantizer->getDataByInternalId(centroid_idx);
+        const float alpha = alphas[centroid_idx];
+        std::vector<float> subcentroid(d);
+        size_t offset = 0;
+        for (size_t subc = 0; subc < nsubc; subc++) {
+            const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
+            if (subgroup_size == 0)
+                continue;
+            const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idxs[centroid_idx][subc]);
+            for (size_t j = 0; j < d; j++)
+                subcentroid[j] = (1 - alpha) * centroid[j] + alpha * nn_centroid[j];
+            for (size_t i = offset; i < offset + subgroup_size; i++)
+                faiss::fvec_madd(d, x + i * d, 1., subcentroid.data(), x + i * d);
+            offset += subgroup_size;
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::adjacent_lists(idx_t centroid_idx, std::vector<idx_t> &lists) const
+    {
+        lists = nn_centroid_idxs[centroid_idx];
     }
 
     void IndexIVF_HNSW_Grouping::write(const char *path_index)
     {
+        FAISS_THROW_IF_NOT_MSG(!ondisk_lists, "Index with inverted lists served from SSD cannot be written");
         std::ofstream output(path_index, std::ios::binary);
 
+        write_id_size(output);
+        write_spill_mark(output, has_spill);
         write_variable(output, d);
         write_variable(output, nc);
         write_variable(output, nsubc);
 
         // Save vector indices
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, ids[i]);
+        write_ids(output);
 
         // Save PQ codes
         for (size_t i = 0; i < nc; i++)
@@ -332,21 +438,31 @@ namespace ivfhnsw
     {
         std::ifstream input(path_index, std::ios::binary);
 
+        const size_t id_size = read_id_size(input);
+        has_spill = read_spill_mark(input);
         read_variable(input, d);
         read_variable(input, nc);
         read_variable(input, nsubc);
 
-        // Read ids
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
-
-        // Read PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
+        // Read ids, skip them if inverted lists are served from SSD
+        read_ids(input, id_size, ondisk_lists != nullptr);
 
-        // Read norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+        // Skip inverted lists if they are served from SSD
+        if (ondisk_lists) {
+            for (size_t i = 0; i < nc; i++)
+                skip_vector<uint8_t>(input);
+            for (size_t i = 0; i < nc; i++)
+                skip_vector<uint8_t>(input);
+        }
+        else {
+            // Read PQ codes
+            for (size_t i = 0; i < nc; i++)
+                read_vector(input, codes[i]);
+
+            // Read norm PQ codes
+            for (size_t i = 0; i < nc; i++)
+                read_vector(input, norm_codes[i]);
+        }
 
         // Read NN centroid indices
         for (size_t i = 0; i < nc; i++)
@@ -368,6 +484,136 @@ namespace ivfhnsw
     }
 
 
+    void IndexIVF_HNSW_Grouping::merge_from(const IndexIVF_HNSW &other_index)
+    {
+        const IndexIVF_HNSW_Grouping *other = dynamic_cast<const IndexIVF_HNSW_Grouping *>(&other_index);
+        if (!other || other->nsubc != nsubc)
+            throw std::runtime_error("Grouping indexes can be merged only with grouping indexes with the same nsubc");
+        check_mergeable(*other);
+
+        for (size_t i = 0; i < nc; i++) {
+            if (nn_centroid_idxs[i].empty()) {
+                nn_centroid_idxs[i] = other->nn_centroid_idxs[i];
+                inter_centroid_dists[i] = other->inter_centroid_dists[i];
+            }
+            if (other->norm_codes[i].empty())
+                continue;
+            if (!norm_codes[i].empty())
+                throw std::runtime_error("Group " + std::to_string(i) + " is not empty in both indexes");
+
+            ids[i] = other->ids[i];
+            codes[i] = other->codes[i];
+            norm_codes[i] = other->norm_codes[i];
+            subgroup_sizes[i] = other->subgroup_sizes[i];
+            alphas[i] = other->alphas[i];
+        }
+    }
+
+    /// Copy the lists of the group owners from the shards, the lists of other shards are skipped
+    template<typename T>
+    static void copy_owner_lists(std::vector<std::unique_ptr<std::ifstream> > &inputs, std::ostream &output,
+                                 const std::vector<size_t> &owners)
+    {
+        std::vector<T> owner_list;
+        for (size_t i = 0; i < owners.size(); i++) {
+            for (size_t s = 0; s < inputs.size(); s++) {
+                if (s == owners[i])
+                    read_vector(*inputs[s], owner_list);
+                else
+                    skip_vector<T>(*inputs[s]);
+            }
+            write_vector(output, owner_list);
+        }
+    }
+
+    /// Copy the first non-empty i-th list of the shards, the lists are the same in the shards where they are set
+    template<typename T>
+    static void copy_nonempty_lists(std::vector<std::unique_ptr<std::ifstream> > &inputs, std::ostream &output,
+                                    size_t nc)
+    {
+        std::vector<T> merged_list, shard_list;
+        for (size_t i = 0; i < nc; i++) {
+            merged_list.clear();
+            for (auto &input : inputs) {
+                read_vector(*input, shard_list);
+                if (merged_list.empty())
+                    merged_list.swap(shard_list);
+            }
+            write_vector(output, merged_list);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::merge_shards(const std::vector<const char *> &shard_paths, const char *path)
+    {
+        std::vector<size_t> id_sizes;
+        size_t d, nc, nsubc;
+        bool has_spill;
+        std::vector<std::unique_ptr<std::ifstream> > inputs = open_shards(shard_paths, id_sizes, d, nc, has_spill);
+        for (size_t s = 0; s < inputs.size(); s++) {
+            size_t shard_nsubc;
+            read_variable(*inputs[s], shard_nsubc);
+            if (s == 0)
+                nsubc = shard_nsubc;
+            else if (shard_nsubc != nsubc)
+                throw std::runtime_error(std::string("Shard ") + shard_paths[s] + " has different nsubc");
+        }
+
+        std::ofstream output(path, std::ios::binary);
+        write_id_size(output);
+        write_spill_mark(output, has_spill);
+        write_variable(output, d);
+        write_variable(output, nc);
+        write_variable(output, nsubc);
+
+        // Vector indices. The owner of a group is the shard where the group is not empty
+        std::vector<size_t> owners(nc, 0);
+        std::vector<label_t> owner_ids, shard_ids;
+        for (size_t i = 0; i < nc; i++) {
+            bool owned = false;
+            owner_ids.clear();
+            for (size_t s = 0; s < inputs.size(); s++) {
+                read_id_list(*inputs[s], id_sizes[s], shard_ids);
+                if (shard_ids.empty())
+                    continue;
+                if (owned)
+                    throw std::runtime_error("Group " + std::to_string(i) + " is not empty in shards " +
+                                             shard_paths[owners[i]] + " and " + shard_paths[s]);
+                owned = true;
+                owners[i] = s;
+                owner_ids.swap(shard_ids);
+            }
+            write_vector(output, owner_ids);
+        }
+
+        // PQ codes and norm PQ codes of the owners
+        copy_owner_lists<uint8_t>(inputs, output, owners);
+        copy_owner_lists<uint8_t>(inputs, output, owners);
+
+        // NN centroid indices are set by the shards which have added the group
+        copy_nonempty_lists<idx_t>(inputs, output, nc);
+
+        // Group sizes of the owners
+        copy_owner_lists<idx_t>(inputs, output, owners);
+
+        // Alphas of the owners
+        std::vector<float> alphas(nc), shard_alphas;
+        for (size_t s = 0; s < inputs.size(); s++) {
+            read_vector(*inputs[s], shard_alphas);
+            for (size_t i = 0; i < nc; i++)
+                if (owners[i] == s)
+                    alphas[i] = shard_alphas[i];
+        }
+        write_vector(output, alphas);
+
+        // Centroid norms are the same in all shards
+        std::vector<float> centroid_norms;
+        read_vector(*inputs[0], centroid_norms);
+        write_vector(output, centroid_norms);
+
+        // Inter centroid distances are set by the shards which have added the group
+        copy_nonempty_lists<float>(inputs, output, nc);
+    }
+
     void IndexIVF_HNSW_Grouping::train_pq(size_t n, const float *x)
     {
         std::vector<float> train_subcentroids;
@@ -439,7 +685,9 @@ namespace ivfhnsw
         }
         // Train OPQ rotation matrix and rotate residuals
         if (do_opq){
-            faiss::OPQMatrix *matrix = new faiss::OPQMatrix(d, pq->M);
+            if (codec->M == 0)
+                throw std::runtime_error("OPQ requires a codec splitting vectors into subspaces");
+            faiss::OPQMatrix *matrix = new faiss::OPQMatrix(d, codec->M);
 
             std::cout << "Training OPQ Matrix" << std::endl;
             matrix->verbose = true;
@@ -447,56 +695,22 @@ namespace ivfhnsw
             matrix->niter = 100;
             matrix->train(n, train_residuals.data());
             opq_matrix = matrix;
-
-            std::vector<float> copy_train_residuals(n * d);
-            memcpy(copy_train_residuals.data(), train_residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_train_residuals.data(), train_residuals.data());
+            rotate(n, train_residuals.data());
         }
 
-        printf("Training %zdx%zd PQ on %ld vectors in %dD\n", pq->M, pq->ksub, train_residuals.size() / d, d);
-        pq->verbose = true;
-        pq->train(n, train_residuals.data());
+        codec->verbose = true;
+        codec->train(n, train_residuals.data());
 
         // Norm PQ
         std::cout << "Training Norm PQ codebook " << std::endl;
-        std::vector<float> train_norms;
-        const float *residuals = train_residuals.data();
-        const float *subcentroids = train_subcentroids.data();
-
-        for (auto p : group_map) {
-            const std::vector<float> data = p.second;
-            const size_t group_size = data.size() / d;
-
-            // Compute Codes 
-            std::vector<uint8_t> xcodes(group_size * code_size);
-            pq->compute_codes(residuals, xcodes.data(), group_size);
-
-            // Decode Codes 
-            std::vector<float> decoded_residuals(group_size * d);
-            pq->decode(xcodes.data(), decoded_residuals.data(), group_size);
-
-            // Reverse rotation
-            if (do_opq){
-                std::vector<float> copy_decoded_residuals(group_size * d);
-                memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), group_size * d * sizeof(float));
-                opq_matrix->transform_transpose(group_size, copy_decoded_residuals.data(), decoded_residuals.data());
-            }
-
-            // Reconstruct Data 
-            std::vector<float> reconstructed_x(group_size * d);
-            for (size_t i = 0; i < group_size; i++)
-                faiss::fvec_madd(d, decoded_residuals.data() + i*d, 1., subcentroids+i*d, reconstructed_x.data() + i*d);
+        std::vector<const float *> train_bases(n);
+        for (size_t i = 0; i < n; i++)
+            train_bases[i] = train_subcentroids.data() + i * d;
 
-            // Compute norms 
-            std::vector<float> group_norms(group_size);
-            faiss::fvec_norms_L2sqr(group_norms.data(), reconstructed_x.data(), d, group_size);
+        std::vector<uint8_t> xcodes(n * code_size);
+        std::vector<float> train_norms(n);
+        encode_residuals(n, train_residuals.data(), train_bases.data(), xcodes.data(), train_norms.data());
 
-            for (size_t i = 0; i < group_size; i++)
-                train_norms.push_back(group_norms[i]);
-
-            residuals += group_size * d;
-            subcentroids += group_size * d;
-        }
         printf("Training %zdx%zd PQ on %ld vectors in 1D\n", norm_pq->M, norm_pq->ksub, train_norms.size());
         norm_pq->verbose = true;
         norm_pq->train(n, train_norms.data());
@@ -505,6 +719,9 @@ namespace ivfhnsw
     void IndexIVF_HNSW_Grouping::compute_inter_centroid_dists()
     {
         for (size_t i = 0; i < nc; i++) {
+            // Skip groups which are not added, e.g. groups of other shards
+            if (nn_centroid_idxs[i].empty())
+                continue;
             const float *centroid = quantizer->getDataByInternalId(i);
             inter_centroid_dists[i].resize(nsubc);
             for (size_t subc = 0; subc < nsubc; subc++) {
@@ -515,21 +732,24 @@ namespace ivfhnsw
         }
     }
 
-    void IndexIVF_HNSW_Grouping::compute_residuals(size_t n, const float *x, float *residuals,
-                                                   const float *subcentroids, const idx_t *keys)
+    IndexIVF_HNSW::MemoryUsage IndexIVF_HNSW_Grouping::memory_usage() const
     {
-        for (size_t i = 0; i < n; i++) {
-            const float *subcentroid = subcentroids + keys[i]*d;
-            faiss::fvec_madd(d, x + i*d, -1., subcentroid, residuals + i*d);
+        MemoryUsage usage = IndexIVF_HNSW::memory_usage();
+        for (size_t i = 0; i < nc; i++) {
+            count_memory(nn_centroid_idxs[i], usage.grouping, usage.list_overhead);
+            count_memory(subgroup_sizes[i], usage.grouping, usage.list_overhead);
+            count_memory(inter_centroid_dists[i], usage.grouping, usage.list_overhead);
         }
+        usage.grouping += alphas.capacity() * sizeof(float);
+        return usage;
     }
 
-    void IndexIVF_HNSW_Grouping::reconstruct(size_t n, float *x, const float *decoded_residuals,
-                                             const float *subcentroids, const idx_t *keys)
+    void IndexIVF_HNSW_Grouping::compute_residuals(size_t n, const float *x, float *residuals,
+                                                   const float *subcentroids, const idx_t *keys)
     {
         for (size_t i = 0; i < n; i++) {
-            const float *subcentroid = subcentroids + keys[i] * d;
-            faiss::fvec_madd(d, decoded_residuals + i*d, 1., subcentroid, x + i*d);
+            const float *subcentroid = subcentroids + keys[i]*d;
+            faiss::fvec_madd(d, x + i*d, -1., subcentroid, residuals + i*d);
         }
     }
 
@@ -27,37 +27,96 @@ namespace ivfhnsw{
           * @param x                 base vectors to add (size: group_size * d)
           * @param ids               ids to store for the vectors (size: groups_size)
         */
-        void add_group(size_t group_idx, size_t group_size, const float *x, const idx_t *ids);
-
-        void search(size_t k, const float *x, float *distances, long *labels);
+        void add_group(size_t group_idx, size_t group_size, const float *x, const label_t *ids);
 
         void write(const char *path_index);
         void read(const char *path_index);
 
+        /** Take the groups of the other grouping index built with the same quantizer and codebooks
+          *
+          * Sub-groups depend on the group alpha computed by add_group from all vectors of the group,
+          * so every group has to be non-empty in at most one of the indexes: shard by groups, not by ids.
+        */
+        void merge_from(const IndexIVF_HNSW &other);
+
+        /** Merge index files of shards built over disjoint group ranges with the same quantizer and codebooks
+          *
+          * Each group is taken from the shard where it is non-empty, one group per shard is in memory at a time.
+          *
+          * @param shard_paths   paths to the shard indexes
+          * @param path          path to the merged index
+        */
+        static void merge_shards(const std::vector<const char *> &shard_paths, const char *path);
+
         void train_pq(size_t n, const float *x);
 
         /// Compute distances between the group centroid and its <subc> nearest neighbors in the HNSW graph
         void compute_inter_centroid_dists();
 
+        MemoryUsage memory_usage() const;
+
     protected:
-        /// Distances to the coarse centroids. Used for distance computation between a query and base points
-        std::vector<float> query_centroid_dists;
+        void search_preassigned(size_t k, const float *query,
+                                std::priority_queue<std::pair<float, idx_t> > &coarse,
+                                const float *table, SearchBuffers &buffers,
+                                float *distances, long *labels);
+
+        /// Sub-centroid of each sub-group plus the decoded residual
+        void reconstruct_list(idx_t centroid_idx, const ListView &list, float *x) const;
+
+        /// The <nsubc> nearest centroids of the group
+        void adjacent_lists(idx_t centroid_idx, std::vector<idx_t> &lists) const;
 
         /// Distances between coarse centroids and their sub-centroids
         std::vector<std::vector<float>> inter_centroid_dists;
 
-    private:
+        // Construction kernels, protected for the benchmarks
         void compute_residuals(size_t n, const float *x, float *residuals,
                                const float *subcentroids, const idx_t *keys);
 
-        void reconstruct(size_t n, float *x, const float *decoded_residuals,
-                         const float *subcentroids, const idx_t *keys);
-
         void compute_subcentroid_idxs(idx_t *subcentroid_idxs, const float *subcentroids,
                                       const float *points, size_t group_size);
 
         float compute_alpha(const float *centroid_vectors, const float *points,
                             const float *centroid, const float *centroid_vector_norms_L2sqr, size_t group_size);
+
+    private:
+        /** Append the sub-groups of the group to scan to ranges, specialized on pruning
+          *
+          * Distances to the coarse centroids of the sub-groups not computed yet are computed
+          * to buffers.centroid_dists and their indices are appended to used_centroid_idxs.
+          *
+          * @param node          NUMA node of the calling thread
+          * @param list          inverted list of the group, the ranges point to it
+          * @param qsd           distances to the sub-centroids of the group, used for pruning
+          * @param threshold     sub-groups farther than the threshold are pruned
+          * @param npruned       number of pruned sub-groups, incremented
+          * @return              number of codes in the appended ranges
+        */
+        template<bool pruning>
+        size_t select_subgroups(size_t node, const float *query, idx_t centroid_idx, const ListView &list,
+                                const float *qsd, float threshold, std::vector<idx_t> &used_centroid_idxs,
+                                SearchBuffers &buffers, std::vector<ScanRange> &ranges, size_t &npruned);
+
+        /** Scan the sub-groups of the probed groups, specialized on pruning
+          *
+          * Sub-groups are scanned group by group as they are selected, or split across
+          * <nthreads_per_query> threads once all of them are selected.
+          *
+          * @param centroid_idxs             nprobe nearest coarse centroids to the query
+          * @param nprobe_query              number of them to probe, see probe_ratio
+          * @param query_subcentroid_dists   distances to the sub-centroids of the groups, used for pruning
+          * @param threshold                 sub-groups farther than the threshold are pruned
+          * @param used_centroid_idxs        centroids with computed distances to the query, appended
+          * @param table                     query table of the codec
+          * @param buffers                   buffers of the calling thread, centroid_dists holds the distances
+          *                                  to the coarse centroids computed so far
+        */
+        template<bool pruning>
+        void scan_subgroups(size_t k, const float *query, const idx_t *centroid_idxs, size_t nprobe_query,
+                            const float *query_subcentroid_dists, float threshold,
+                            std::vector<idx_t> &used_centroid_idxs, const float *table, SearchBuffers &buffers,
+                            float *distances, long *labels);
     };
 }
 #endif //IVF_HNSW_LIB_INDEXIVF_HNSW_GROUPING_H
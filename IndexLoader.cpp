@@ -0,0 +1,43 @@
+#include "IndexLoader.h"
+
+#include <stdexcept>
+#include <string>
+
+#include "IndexIVF_HNSW_Grouping.h"
+
+namespace ivfhnsw {
+    IndexIVF_HNSW *load_index(const Parser &opt, bool grouping)
+    {
+        if (!exists(opt.path_index) || !exists(opt.path_pq) || !exists(opt.path_norm_pq))
+            throw std::runtime_error(std::string("No index in ") + opt.path_index + ", build it with the tests first");
+
+        IndexIVF_HNSW *index = grouping ? new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, 8, opt.nsubc)
+                                        : new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
+        index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+        index->set_codec(make_codec(opt.codec, opt.d, opt.code_size));
+        index->do_opq = opt.do_opq;
+
+        std::cout << "Loading codebooks from " << opt.path_pq << " and " << opt.path_norm_pq << std::endl;
+        index->codec->read(opt.path_pq);
+        if (opt.do_opq)
+            index->opq_matrix = dynamic_cast<faiss::LinearTransform *>(faiss::read_VectorTransform(opt.path_opq_matrix));
+        if (index->norm_pq) delete index->norm_pq;
+        index->norm_pq = faiss::read_ProductQuantizer(opt.path_norm_pq);
+
+        std::cout << "Loading index from " << opt.path_index << std::endl;
+        index->read(opt.path_index);
+
+        if (opt.path_ondisk_lists) {
+            if (!exists(opt.path_ondisk_lists))
+                index->write_ondisk_lists(opt.path_ondisk_lists);
+            index->load_ondisk_lists(opt.path_ondisk_lists, 16, opt.ondisk_cache_mb << 20);
+        }
+        if (opt.do_compress_ids)
+            index->compress_ids();
+        if (opt.do_opq)
+            index->rotate_quantizer();
+        if (opt.do_numa)
+            index->place_numa();
+        return index;
+    }
+}
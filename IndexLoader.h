@@ -0,0 +1,19 @@
+#ifndef IVF_HNSW_LIB_INDEX_LOADER_H
+#define IVF_HNSW_LIB_INDEX_LOADER_H
+
+#include "IndexIVF_HNSW.h"
+#include "Parser.h"
+
+namespace ivfhnsw {
+    /** Load an index built by the tests with the same options
+      *
+      * Builds or loads the quantizer, reads the codebooks and the index, then applies the options
+      * the tests apply after loading: on-disk lists (written on the first run), compressed ids,
+      * the OPQ rotation of the quantizer and NUMA replicas. Throws if the index is not built yet.
+      *
+      * @param grouping  the index is IVF-HNSW + Grouping, built with -nsubc
+      * @return index owned by the caller
+    */
+    IndexIVF_HNSW *load_index(const Parser &opt, bool grouping);
+}
+#endif //IVF_HNSW_LIB_INDEX_LOADER_H
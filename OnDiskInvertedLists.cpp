@@ -0,0 +1,212 @@
+#include "OnDiskInvertedLists.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+#include <iterator>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+
+    OnDiskInvertedLists::OnDiskInvertedLists(const char *path, size_t nthreads, size_t cache_capacity):
+            cache_capacity(cache_capacity), readahead_capacity(size_t(256) << 20), cached_bytes(0),
+            naccesses(0), readahead_bytes(0), stop(false)
+    {
+        {
+            std::ifstream input(path, std::ios::binary);
+            if (!input.good())
+                throw std::runtime_error(std::string("Cannot open on-disk inverted lists ") + path);
+            read_variable(input, nc);
+            read_variable(input, code_size);
+            size_t id_size;
+            read_variable(input, id_size);
+            if (id_size != sizeof(label_t))
+                throw std::runtime_error(std::string("On-disk inverted lists ") + path + " store " +
+                                         std::to_string(8 * id_size) + "-bit ids, the index uses " +
+                                         std::to_string(8 * sizeof(label_t)) + "-bit ones");
+            offsets.resize(nc + 1);
+            input.read((char *) offsets.data(), (nc + 1) * sizeof(uint64_t));
+        }
+        access_counts.resize(nc, 0);
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Cannot open on-disk inverted lists ") + path);
+
+        for (size_t i = 0; i < std::max<size_t>(nthreads, 1); i++)
+            workers.emplace_back([this]() {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(tasks_mutex);
+                        tasks_cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+                        if (stop && tasks.empty())
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+    }
+
+    OnDiskInvertedLists::~OnDiskInvertedLists()
+    {
+        {
+            std::unique_lock<std::mutex> lock(tasks_mutex);
+            stop = true;
+        }
+        tasks_cv.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+        close(fd);
+    }
+
+    void OnDiskInvertedLists::write(const char *path, size_t code_size,
+                                    const std::vector<std::vector<label_t> > &ids,
+                                    const std::vector<std::vector<uint8_t> > &codes,
+                                    const std::vector<std::vector<uint8_t> > &norm_codes)
+    {
+        std::ofstream output(path, std::ios::binary);
+        const size_t nc = ids.size();
+
+        write_variable(output, nc);
+        write_variable(output, code_size);
+        const size_t id_size = sizeof(label_t);
+        write_variable(output, id_size);
+
+        // Lists start right after the offsets table
+        std::vector<uint64_t> offsets(nc + 1);
+        offsets[0] = 3 * sizeof(size_t) + (nc + 1) * sizeof(uint64_t);
+        for (size_t i = 0; i < nc; i++)
+            offsets[i + 1] = offsets[i] + ids[i].size() * (sizeof(label_t) + code_size + 1);
+        output.write((char *) offsets.data(), (nc + 1) * sizeof(uint64_t));
+
+        for (size_t i = 0; i < nc; i++) {
+            output.write((char *) ids[i].data(), ids[i].size() * sizeof(label_t));
+            output.write((char *) codes[i].data(), codes[i].size());
+            output.write((char *) norm_codes[i].data(), norm_codes[i].size());
+        }
+    }
+
+    OnDiskInvertedLists::ListPtr OnDiskInvertedLists::read_list(idx_t list_no) const
+    {
+        std::shared_ptr<List> list = std::make_shared<List>();
+        list->size = list_size(list_no);
+
+        const size_t nbytes = offsets[list_no + 1] - offsets[list_no];
+        list->data.resize(nbytes);
+
+        size_t nread = 0;
+        while (nread < nbytes) {
+            const ssize_t ret = pread(fd, list->data.data() + nread, nbytes - nread, offsets[list_no] + nread);
+            if (ret <= 0)
+                throw std::runtime_error("Failed to read an on-disk inverted list");
+            nread += ret;
+        }
+        list->ids = (const label_t *) list->data.data();
+        list->codes = list->data.data() + list->size * sizeof(label_t);
+        list->norm_codes = list->codes + list->size * code_size;
+        return list;
+    }
+
+    void OnDiskInvertedLists::prefetch(const idx_t *list_nos, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const idx_t list_no = list_nos[i];
+            if (list_size(list_no) == 0)
+                continue;
+
+            std::shared_ptr<std::promise<ListPtr> > promise = std::make_shared<std::promise<ListPtr> >();
+            {
+                std::unique_lock<std::mutex> lock(cache_mutex);
+                if (cache.count(list_no) || readahead.count(list_no))
+                    continue;
+                readahead_order.push_back(list_no);
+                readahead[list_no] = {promise->get_future().share(), std::prev(readahead_order.end())};
+                readahead_bytes += offsets[list_no + 1] - offsets[list_no];
+
+                // Lists prefetched for queries that have not taken them, e.g. stopped early
+                while (readahead_bytes > readahead_capacity && readahead_order.size() > 1)
+                    drop_readahead(readahead_order.front());
+            }
+            {
+                std::unique_lock<std::mutex> lock(tasks_mutex);
+                tasks.emplace_back([this, list_no, promise]() {
+                    try {
+                        promise->set_value(read_list(list_no));
+                    } catch (...) {
+                        promise->set_exception(std::current_exception());
+                    }
+                });
+            }
+            tasks_cv.notify_one();
+        }
+    }
+
+    OnDiskInvertedLists::ListPtr OnDiskInvertedLists::get(idx_t list_no)
+    {
+        std::shared_future<ListPtr> pending;
+        {
+            std::unique_lock<std::mutex> lock(cache_mutex);
+            count_access(list_no);
+
+            auto cached = cache.find(list_no);
+            if (cached != cache.end()) {
+                lru.splice(lru.begin(), lru, cached->second.second);
+                return cached->second.first;
+            }
+            auto read = readahead.find(list_no);
+            if (read != readahead.end()) {
+                pending = read->second.list;
+                drop_readahead(list_no);
+            }
+        }
+        // Wait for the prefetched read or read the list synchronously
+        ListPtr list = pending.valid() ? pending.get() : read_list(list_no);
+        std::unique_lock<std::mutex> lock(cache_mutex);
+        admit(list_no, list);
+        return list;
+    }
+
+    void OnDiskInvertedLists::admit(idx_t list_no, const ListPtr &list)
+    {
+        const size_t nbytes = list->data.size();
+        if (cache.count(list_no) || access_counts[list_no] < 2 || nbytes > cache_capacity)
+            return;
+
+        // Evict least recently used lists
+        while (cached_bytes + nbytes > cache_capacity) {
+            const idx_t evicted = lru.back();
+            cached_bytes -= cache[evicted].first->data.size();
+            cache.erase(evicted);
+            lru.pop_back();
+        }
+        lru.push_front(list_no);
+        cache[list_no] = std::make_pair(list, lru.begin());
+        cached_bytes += nbytes;
+    }
+
+    void OnDiskInvertedLists::count_access(idx_t list_no)
+    {
+        if (access_counts[list_no] < std::numeric_limits<uint8_t>::max())
+            access_counts[list_no]++;
+        if (++naccesses >= 8 * nc) {
+            for (uint8_t &count : access_counts)
+                count /= 2;
+            naccesses = 0;
+        }
+    }
+
+    void OnDiskInvertedLists::drop_readahead(idx_t list_no)
+    {
+        auto read = readahead.find(list_no);
+        readahead_bytes -= offsets[list_no + 1] - offsets[list_no];
+        readahead_order.erase(read->second.order);
+        readahead.erase(read);
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef IVF_HNSW_LIB_ONDISK_INVERTED_LISTS_H
+#define IVF_HNSW_LIB_ONDISK_INVERTED_LISTS_H
+
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+
+#include "utils.h"
+
+namespace ivfhnsw {
+    /** Inverted lists kept in a file on a local SSD
+      *
+      * File layout: nc, code_size, id_size, nc+1 list offsets and then the lists.
+      * Each list is stored contiguously: ids, PQ codes and norm PQ codes.
+      *
+      * Lists are read with pread by a pool of I/O threads. prefetch() issues
+      * asynchronous reads, e.g. right after the coarse search, so the reads overlap
+      * with the distance table computation. A prefetched list is kept until get() takes it,
+      * at most readahead_capacity bytes of them, the oldest ones are dropped.
+      * Hot lists are kept in an LRU cache in RAM. A list is admitted to the cache on its second get(),
+      * so one-off lists do not evict hot ones. Access counts are one byte per list and are halved
+      * every 8 * nc gets, so only recent accesses count. All methods are thread-safe.
+    */
+    struct OnDiskInvertedLists
+    {
+        typedef uint32_t idx_t;
+
+        /// Inverted list read from the file
+        struct List {
+            size_t size;                 ///< Number of vectors in the list
+            std::vector<uint8_t> data;   ///< ids, codes and norm codes
+            const label_t *ids;
+            const uint8_t *codes;
+            const uint8_t *norm_codes;
+        };
+        typedef std::shared_ptr<const List> ListPtr;
+
+        size_t nc;                      ///< Number of lists
+        size_t code_size;               ///< Code size per vector in bytes
+        size_t cache_capacity;          ///< Max bytes of lists cached in RAM
+        size_t readahead_capacity;      ///< Max bytes of prefetched lists not taken by get() yet
+
+        /** Open the file
+          *
+          * @param path              path to the file written by write()
+          * @param nthreads          number of I/O threads
+          * @param cache_capacity    max bytes of lists cached in RAM
+        */
+        OnDiskInvertedLists(const char *path, size_t nthreads, size_t cache_capacity);
+        ~OnDiskInvertedLists();
+
+        /// Write in-memory lists to the file at the path
+        static void write(const char *path, size_t code_size,
+                          const std::vector<std::vector<label_t> > &ids,
+                          const std::vector<std::vector<uint8_t> > &codes,
+                          const std::vector<std::vector<uint8_t> > &norm_codes);
+
+        /// Number of vectors in the list, does not touch the disk
+        size_t list_size(idx_t list_no) const
+        {
+            return (offsets[list_no + 1] - offsets[list_no]) / (sizeof(label_t) + code_size + 1);
+        }
+
+        /// Issue asynchronous reads of the lists which are neither cached nor prefetched
+        void prefetch(const idx_t *list_nos, size_t n);
+
+        /// Get the list, takes its prefetched read and waits for it if the list is not cached
+        ListPtr get(idx_t list_no);
+
+        size_t cache_size() const { return cached_bytes; }
+
+    private:
+        int fd;
+        std::vector<uint64_t> offsets;  ///< Offsets of the lists in the file, size nc + 1
+
+        // Cache
+        std::mutex cache_mutex;
+        std::list<idx_t> lru;           ///< Cached lists, most recently used first
+        std::unordered_map<idx_t, std::pair<ListPtr, std::list<idx_t>::iterator> > cache;
+        size_t cached_bytes;
+        std::vector<uint8_t> access_counts;  ///< Recent gets of each list, saturating
+        size_t naccesses;                    ///< Gets since the counts were halved
+
+        // Prefetched lists, the reads may be in progress
+        struct Readahead {
+            std::shared_future<ListPtr> list;
+            std::list<idx_t>::iterator order;
+        };
+        std::unordered_map<idx_t, Readahead> readahead;
+        std::list<idx_t> readahead_order;   ///< Prefetched lists, oldest first
+        size_t readahead_bytes;
+
+        // I/O thread pool
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()> > tasks;
+        std::mutex tasks_mutex;
+        std::condition_variable tasks_cv;
+        bool stop;
+
+        ListPtr read_list(idx_t list_no) const;
+
+        /// Put the list into the cache if it is admitted. cache_mutex has to be held
+        void admit(idx_t list_no, const ListPtr &list);
+
+        /// Count a get of the list, halve all counts every 8 * nc gets. cache_mutex has to be held
+        void count_access(idx_t list_no);
+
+        /// Remove the prefetched list, its read is dropped unless get() has taken it. cache_mutex has to be held
+        void drop_readahead(idx_t list_no);
+    };
+}
+#endif //IVF_HNSW_LIB_ONDISK_INVERTED_LISTS_H
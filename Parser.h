@@ -28,11 +28,14 @@ struct Parser
     size_t nq;             ///< Number of queries
     size_t ngt;            ///< Number of groundtruth neighbours per query
     size_t d;              ///< Vector dimension
+    size_t nshards;        ///< Number of shards the index is built in
+    size_t shard;          ///< Shard to build, the index is built over all data if nshards is 1
 
     //=================
     // PQ parameters
     //=================
     size_t code_size;      ///< Code size per vector in bytes
+    const char *codec;     ///< Codec of residuals: pq, pq4 or sq8
     bool do_opq;           ///< Turn on/off OPQ fine encoding
 
     //===================
@@ -41,8 +44,16 @@ struct Parser
     size_t k;              ///< Number of the closest vertices to search
     size_t nprobe;         ///< Number of probes at query time
     size_t max_codes;      ///< Max number of codes to visit to do a query
+    float probe_ratio;     ///< Probe the lists within the ratio of the distance to the nearest centroid (0 - all nprobe)
+    size_t stop_codes;     ///< Stop a scan once the k-th distance is not improved over this many codes (0 - off)
     size_t efSearch;       ///< Max number of candidate vertices in priority queue to observe during searching
     bool do_pruning;       ///< Turn on/off pruning in the grouping scheme
+    size_t nthreads_per_query; ///< Number of threads scanning the probed lists of one query
+    bool do_numa;          ///< Turn on/off NUMA-aware placement of the index
+    size_t nthreads_per_node; ///< Number of search threads pinned to each NUMA node (with do_numa)
+    bool do_compress_ids;  ///< Turn on/off compression of vector indices in inverted lists
+    size_t ondisk_cache_mb; ///< Max size of hot inverted lists cached in RAM if lists are served from SSD
+    float spill_ratio;     ///< Store base vectors in a second list within spill_ratio of the nearest centroid (0 - off)
 
     //=======
     // Paths
@@ -62,10 +73,25 @@ struct Parser
     const char *path_opq_matrix;       ///< Path to OPQ rotation matrix for OPQ fine encoding
     const char *path_norm_pq;          ///< Path to the product quantizer for norms of reconstructed base points
     const char *path_index;            ///< Path to the constructed index
+    const char *path_ondisk_lists;     ///< Path to inverted lists served from SSD, optional
+    const char *path_search_params;    ///< Path to search parameters found by tools/tune_search, optional
 
     Parser(int argc, char **argv)
     {
         cmd = argv[0];
+        nthreads_per_query = 1;
+        do_numa = false;
+        nthreads_per_node = 1;
+        do_compress_ids = false;
+        nshards = 1;
+        shard = 0;
+        ondisk_cache_mb = 1024;
+        spill_ratio = 0;
+        probe_ratio = 0;
+        stop_codes = 0;
+        codec = "pq";
+        path_ondisk_lists = nullptr;
+        path_search_params = nullptr;
         if (argc == 1)
             usage();
 
@@ -95,12 +121,15 @@ struct Parser
             else if (!strcmp (a, "-nq")) sscanf(argv[++i], "%zu", &nq);
             else if (!strcmp (a, "-ngt")) sscanf(argv[++i], "%zu", &ngt);
             else if (!strcmp (a, "-d")) sscanf(argv[++i], "%zu", &d);
+            else if (!strcmp (a, "-nshards")) sscanf(argv[++i], "%zu", &nshards);
+            else if (!strcmp (a, "-shard")) sscanf(argv[++i], "%zu", &shard);
 
             //===============
             // PQ parameters
             //===============
             else if (!strcmp (a, "-code_size"))sscanf(argv[++i], "%zu", &code_size);
             else if (!strcmp (a, "-opq")) do_opq = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-codec")) codec = argv[++i];
 
             //===================
             // Search parameters
@@ -108,8 +137,16 @@ struct Parser
             else if (!strcmp (a, "-k")) sscanf(argv[++i], "%zu", &k);
             else if (!strcmp (a, "-nprobe")) sscanf(argv[++i], "%zu", &nprobe);
             else if (!strcmp (a, "-max_codes")) sscanf(argv[++i], "%zu", &max_codes);
+            else if (!strcmp (a, "-probe_ratio")) sscanf(argv[++i], "%f", &probe_ratio);
+            else if (!strcmp (a, "-stop_codes")) sscanf(argv[++i], "%zu", &stop_codes);
             else if (!strcmp (a, "-efSearch")) sscanf(argv[++i], "%zu", &efSearch);
             else if (!strcmp (a, "-pruning")) do_pruning = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-nthreads_per_query")) sscanf(argv[++i], "%zu", &nthreads_per_query);
+            else if (!strcmp (a, "-numa")) do_numa = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-nthreads_per_node")) sscanf(argv[++i], "%zu", &nthreads_per_node);
+            else if (!strcmp (a, "-compress_ids")) do_compress_ids = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-ondisk_cache_mb")) sscanf(argv[++i], "%zu", &ondisk_cache_mb);
+            else if (!strcmp (a, "-spill_ratio")) sscanf(argv[++i], "%f", &spill_ratio);
 
             //=======
             // Paths
@@ -129,6 +166,8 @@ struct Parser
             else if (!strcmp (a, "-path_opq_matrix")) path_opq_matrix = argv[++i];
             else if (!strcmp (a, "-path_norm_pq")) path_norm_pq = argv[++i];
             else if (!strcmp (a, "-path_index")) path_index = argv[++i];
+            else if (!strcmp (a, "-path_ondisk_lists")) path_ondisk_lists = argv[++i];
+            else if (!strcmp (a, "-path_search_params")) path_search_params = argv[++i];
         }
     }
 
@@ -151,19 +190,34 @@ struct Parser
                 "    -nq #                 Number of queries\n"
                 "    -ngt #                Number of groundtruth neighbours per query\n"
                 "    -d #                  Vector dimension\n"
+                "    -nshards #            Number of shards to build the index in, merge them with tools/merge_shards, default: 1\n"
+                "    -shard #              Shard to build (0 - nshards-1), it is saved to path_index, default: 0\n"
                 "#################\n"
                 "# PQ Parameters #\n"
                 "#################\n"
                 "    -code_size #          Code size per vector in bytes\n"
                 "    -opq on/off           Turn on/off OPQ compression\n"
+                "    -codec name           Codec of residuals: pq, pq4 (4-bit PQ) or sq8 (code_size is d), default: pq\n"
                 "####################\n"
                 "# Search Parameters #\n"
                 "#####################\n"
                 "    -k #                  Number of the closest vertices to search\n"
                 "    -nprobe #             Number of probes at query time\n"
                 "    -max_codes #          Max number of codes to visit to do a query\n"
+                "    -probe_ratio #        Probe only the lists within the ratio of the L2 square distance to the nearest\n"
+                "                          centroid, e.g. 1.5, at most nprobe, default: 0 (all nprobe lists)\n"
+                "    -stop_codes #         Stop a query once its k-th distance is not improved over this many codes,\n"
+                "                          default: 0 (off)\n"
                 "    -efSearch #           Max number of candidate vertices in priority queue to observe during searching\n"
                 "    -pruning on/off       Turn on/off pruning in the grouping scheme\n"
+                "    -nthreads_per_query # Number of threads scanning the probed lists of one query, default: 1\n"
+                "    -numa on/off          Turn on/off NUMA-aware placement, search by threads pinned to the nodes\n"
+                "                          and report local/remote list traffic\n"
+                "    -nthreads_per_node #  Number of search threads pinned to each NUMA node with -numa on\n"
+                "    -compress_ids on/off  Turn on/off compression of vector indices in inverted lists\n"
+                "    -ondisk_cache_mb #    Max size of hot inverted lists cached in RAM if lists are on SSD, default: 1024\n"
+                "    -spill_ratio #        Also store base vectors in a second list if it is within the ratio of the nearest one,\n"
+                "                          e.g. 1.2, used when building the index, the index file records it, default: 0 (off)\n"
                 "#########\n"
                 "# Paths #\n"
                 "#########\n"
@@ -178,11 +232,14 @@ struct Parser
                 "    -path_info filename               Path to parameters of HNSW graph\n"
                 "    -path_edges filename              Path to edges of HNSW graph\n"
                 "                        \n"
-                "    -path_pq filename                 Path to the product quantizer for residuals\n"
+                "    -path_pq filename                 Path to the codec for residuals (the product quantizer by default)\n"
                 "    -path_opq_matrix filename         Path to the rotation matrix for OPQ compression\n"
                 "    -path_norm_pq filename            Path to the product quantizer for norms of reconstructed base points\n"
                 "    "
                 "    -path_index filename              Path to the constructed index\n"
+                "    -path_ondisk_lists filename       Path to inverted lists served from SSD, optional\n"
+                "    -path_search_params filename      Path to search parameters found by tools/tune_search, optional,\n"
+                "                                      they replace -nprobe, -max_codes, -efSearch and -pruning\n"
         );
         exit(0);
     }
@@ -0,0 +1,174 @@
+#ifndef IVF_HNSW_LIB_SEARCH_STATS_H
+#define IVF_HNSW_LIB_SEARCH_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+#include "perf_utils.h"
+
+namespace ivfhnsw {
+    /** Work and time of searches, filled by search() if SearchBuffers::stats is set
+      *
+      * search() adds the counts of a query to the stats: reset them before a search to get the stats of one query,
+      * keep them across the queries of a thread to aggregate. Threads searching concurrently fill their own stats,
+      * which are summed with add(). Without stats search() does not read the clock.
+      * Stages of search_batch() are timed for the whole batch of queries.
+      *
+      * If perf is set, the hardware counters of the searching thread are also sampled around each stage.
+      * Lists scanned by the helper threads of nthreads_per_query are not counted.
+    */
+    struct SearchStats
+    {
+        enum Stage {
+            rotate,             ///< OPQ rotation of the queries
+            coarse,             ///< HNSW search of the nearest coarse centroids
+            threshold,          ///< Distances to the sub-centroids and the pruning threshold (grouping)
+            table,              ///< Query tables of the codec
+            scan,               ///< Scan of the inverted lists
+            nstages
+        };
+
+        size_t nqueries;            ///< Number of queries
+        size_t nhops;               ///< HNSW vertices whose neighbors are visited by the coarse search
+        size_t ndist;               ///< Distance computations of the coarse search
+        size_t nlists;              ///< Inverted lists scanned
+        size_t nsubgroups;          ///< Sub-groups scanned (grouping)
+        size_t nsubgroups_pruned;   ///< Sub-groups skipped by pruning (grouping)
+        size_t ncodes;              ///< Codes scanned
+        size_t nheap_pushes;        ///< Candidates pushed to the top-k heaps
+
+        uint64_t stage_ns[nstages];         ///< Time of each stage
+        PerfSample stage_perf[nstages];     ///< Hardware counters of each stage, if perf is set
+        const PerfCounters *perf;           ///< Counters of the searching thread, nullptr - stages are only timed
+
+        SearchStats(): perf(nullptr) { reset(); }
+
+        /// Zero the stats, perf is kept
+        void reset()
+        {
+            nqueries = nhops = ndist = nlists = nsubgroups = nsubgroups_pruned = ncodes = nheap_pushes = 0;
+            for (size_t s = 0; s < nstages; s++) {
+                stage_ns[s] = 0;
+                stage_perf[s].reset();
+            }
+        }
+
+        /// Sum the stats of another thread
+        void add(const SearchStats &other)
+        {
+            nqueries += other.nqueries;
+            nhops += other.nhops;
+            ndist += other.ndist;
+            nlists += other.nlists;
+            nsubgroups += other.nsubgroups;
+            nsubgroups_pruned += other.nsubgroups_pruned;
+            ncodes += other.ncodes;
+            nheap_pushes += other.nheap_pushes;
+            for (size_t s = 0; s < nstages; s++) {
+                stage_ns[s] += other.stage_ns[s];
+                stage_perf[s].add(other.stage_perf[s]);
+            }
+        }
+
+        /// Time of all stages
+        uint64_t total_ns() const
+        {
+            uint64_t ns = 0;
+            for (size_t s = 0; s < nstages; s++)
+                ns += stage_ns[s];
+            return ns;
+        }
+
+        static const char *stage_name(size_t stage)
+        {
+            static const char *names[nstages] = {"rotate", "coarse", "threshold", "table", "scan"};
+            return names[stage];
+        }
+    };
+
+    /** Work and time of add_batch(), filled if IndexIVF_HNSW::add_stats is set
+      *
+      * The stages run on all threads of the OpenMP team, so the hardware counters
+      * have to be opened with PerfCounters(true) to count all of them.
+    */
+    struct AddStats
+    {
+        enum Stage {
+            assign,             ///< HNSW search of the nearest coarse centroids
+            encode,             ///< Residuals, their codes and the norm codes
+            spill,              ///< Choice of the second lists and encoding of the spilled vectors
+            append,             ///< Appending to the inverted lists
+            nstages
+        };
+
+        size_t nvectors;            ///< Number of vectors added
+        size_t nspilled;            ///< Vectors also stored in a second list
+
+        uint64_t stage_ns[nstages];         ///< Time of each stage
+        PerfSample stage_perf[nstages];     ///< Hardware counters of each stage, if perf is set
+        const PerfCounters *perf;           ///< Counters of the team, nullptr - stages are only timed
+
+        AddStats(): perf(nullptr) { reset(); }
+
+        /// Zero the stats, perf is kept
+        void reset()
+        {
+            nvectors = nspilled = 0;
+            for (size_t s = 0; s < nstages; s++) {
+                stage_ns[s] = 0;
+                stage_perf[s].reset();
+            }
+        }
+
+        static const char *stage_name(size_t stage)
+        {
+            static const char *names[nstages] = {"assign", "encode", "spill", "append"};
+            return names[stage];
+        }
+    };
+
+    /** Adds the time and the hardware counts since the previous stop() to a stage of the stats
+      *
+      * Does nothing if the stats are null, so that calls without stats do not read the clock.
+    */
+    class StageTimer
+    {
+    public:
+        template<typename Stats>
+        explicit StageTimer(Stats *stats):
+                stage_ns(stats ? stats->stage_ns : nullptr),
+                stage_perf(stats ? stats->stage_perf : nullptr),
+                perf(stats ? stats->perf : nullptr)
+        {
+            if (stage_ns)
+                last = std::chrono::steady_clock::now();
+            if (perf)
+                perf->read(last_sample);
+        }
+
+        /// End the current stage, e.g. stop(SearchStats::scan)
+        void stop(size_t stage)
+        {
+            if (!stage_ns)
+                return;
+            if (perf) {
+                PerfSample sample;
+                perf->read(sample);
+                stage_perf[stage].add_delta(last_sample, sample);
+                last_sample = sample;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            stage_ns[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+            last = now;
+        }
+
+    private:
+        uint64_t *stage_ns;
+        PerfSample *stage_perf;
+        const PerfCounters *perf;
+        std::chrono::steady_clock::time_point last;
+        PerfSample last_sample;
+    };
+}
+#endif //IVF_HNSW_LIB_SEARCH_STATS_H
@@ -0,0 +1,216 @@
+#include "SearchTuner.h"
+#include "IndexIVF_HNSW_Grouping.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    void SearchParams::apply(IndexIVF_HNSW *index) const
+    {
+        index->nprobe = nprobe;
+        index->max_codes = max_codes;
+        index->quantizer->efSearch = efSearch;
+        if (IndexIVF_HNSW_Grouping *grouping = dynamic_cast<IndexIVF_HNSW_Grouping *>(index))
+            grouping->do_pruning = do_pruning;
+    }
+
+    void SearchParams::write(const char *path) const
+    {
+        std::ofstream output(path);
+        output << "nprobe " << nprobe << "\n"
+               << "max_codes " << max_codes << "\n"
+               << "efSearch " << efSearch << "\n"
+               << "pruning " << (do_pruning ? "on" : "off") << "\n";
+        if (!output)
+            throw std::runtime_error(std::string("Unable to write ") + path);
+    }
+
+    void SearchParams::read(const char *path)
+    {
+        std::ifstream input(path);
+        if (!input)
+            throw std::runtime_error(std::string("Unable to open ") + path);
+
+        std::string name, value;
+        size_t nread = 0;
+        while (input >> name >> value) {
+            if (name == "nprobe")
+                nprobe = std::stoul(value);
+            else if (name == "max_codes")
+                max_codes = std::stoul(value);
+            else if (name == "efSearch")
+                efSearch = std::stoul(value);
+            else if (name == "pruning")
+                do_pruning = value == "on";
+            else
+                throw std::runtime_error("Unknown search parameter " + name + " in " + path);
+            nread++;
+        }
+        if (nread != 4 || efSearch < nprobe)
+            throw std::runtime_error(std::string("Malformed search parameters in ") + path);
+    }
+
+    /// Powers of two and their midpoints 1, 2, 3, 4, 6, 8, 12, ... from lo, ending with hi
+    static std::vector<size_t> geometric_grid(size_t lo, size_t hi)
+    {
+        std::vector<size_t> grid;
+        for (size_t p = 1; p < hi; p *= 2) {
+            if (p >= lo)
+                grid.push_back(p);
+            if (p > 1 && p + p / 2 >= lo && p + p / 2 < hi)
+                grid.push_back(p + p / 2);
+        }
+        grid.push_back(hi);
+        return grid;
+    }
+
+    SearchTuner::SearchTuner(IndexIVF_HNSW *index, size_t nq, const float *queries,
+                             const IndexIVF_HNSW::idx_t *gt, size_t ngt, size_t k, size_t nthreads):
+            max_nprobe(std::min<size_t>(index->nc, 1024)), nstale(2), verbose(false), index(index), nq(nq),
+            queries(queries), gt(gt), ngt(ngt), k(k), nthreads(nthreads), best_trial(0)
+    {}
+
+    const SearchTuner::Trial &SearchTuner::measure(const SearchParams &params)
+    {
+        auto it = measured.find(params);
+        if (it != measured.end())
+            return trials[it->second];
+
+        params.apply(index);
+        std::vector<float> distances(nq * k);
+        std::vector<long> labels(nq * k);
+        const size_t d = index->d;
+
+        StopW stopw = StopW();
+#pragma omp parallel num_threads(nthreads)
+        {
+            IndexIVF_HNSW::SearchBuffers buffers;
+#pragma omp for schedule(dynamic)
+            for (size_t q = 0; q < nq; q++)
+                index->search(k, queries + q * d, distances.data() + q * k, labels.data() + q * k, buffers);
+        }
+        const double seconds = stopw.getElapsedTimeMicro() / 1000000;
+
+        size_t correct = 0;
+        for (size_t q = 0; q < nq; q++) {
+            const long *found = labels.data() + q * k;
+            if (std::find(found, found + k, (long) gt[q * ngt]) != found + k)
+                correct++;
+        }
+
+        trials.push_back({params, 1.0 * correct / nq, nq / std::max(seconds, 1e-9)});
+        measured[params] = trials.size() - 1;
+        const Trial &trial = trials.back();
+        if (verbose)
+            std::cout << "nprobe " << params.nprobe << " efSearch " << params.efSearch
+                      << " max_codes " << params.max_codes << " pruning " << (params.do_pruning ? "on" : "off")
+                      << ": R@" << k << " " << trial.recall << " QPS " << trial.qps << std::endl;
+        return trial;
+    }
+
+    void SearchTuner::minimize(SearchParams &params, size_t SearchParams::*param, const std::vector<size_t> &grid,
+                               size_t min_value, double target_recall)
+    {
+        size_t lo = std::lower_bound(grid.begin(), grid.end(), min_value) - grid.begin();
+        size_t hi = std::lower_bound(grid.begin(), grid.end(), params.*param) - grid.begin();
+        hi = std::min(hi, grid.size() - 1);
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            SearchParams candidate = params;
+            candidate.*param = grid[mid];
+            if (reaches(candidate, target_recall))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        params.*param = grid[hi];
+    }
+
+    bool SearchTuner::tune_with_pruning(bool do_pruning, double target_recall)
+    {
+        // Generous efSearch for the nprobe, lowered later
+        auto generous_efSearch = [this](size_t nprobe) {
+            const size_t ef = std::max<size_t>(2 * nprobe, 128);
+            auto it = std::lower_bound(efSearch_grid.begin(), efSearch_grid.end(), ef);
+            return it == efSearch_grid.end() ? efSearch_grid.back() : *it;
+        };
+        const size_t unbounded_codes = max_codes_grid.back();
+
+        // Smallest nprobe reaching the target with unbounded efSearch and max_codes
+        size_t lo = 0;
+        size_t hi = nprobe_grid.size() - 1;
+        SearchParams params(nprobe_grid[hi], unbounded_codes, generous_efSearch(nprobe_grid[hi]), do_pruning);
+        if (!reaches(params, target_recall))
+            return false;
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            params.nprobe = nprobe_grid[mid];
+            params.efSearch = generous_efSearch(params.nprobe);
+            if (reaches(params, target_recall))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        // Grow nprobe while the fastest setting for it improves
+        double best_qps = 0;
+        size_t nworse = 0;
+        for (size_t i = lo; i < nprobe_grid.size() && nworse < nstale; i++) {
+            params = SearchParams(nprobe_grid[i], unbounded_codes, generous_efSearch(nprobe_grid[i]), do_pruning);
+            if (!reaches(params, target_recall)) {
+                nworse++;
+                continue;
+            }
+            minimize(params, &SearchParams::efSearch, efSearch_grid, params.nprobe, target_recall);
+            minimize(params, &SearchParams::max_codes, max_codes_grid, 0, target_recall);
+
+            const double qps = measure(params).qps;
+            if (qps > best_qps) {
+                best_qps = qps;
+                nworse = 0;
+            } else
+                nworse++;
+        }
+        return true;
+    }
+
+    SearchParams SearchTuner::tune(double target_recall)
+    {
+        size_t ncodes = 0;
+        for (const std::vector<uint8_t> &list : index->norm_codes)
+            ncodes += list.size();
+        // Lists served from SSD are not counted
+        if (ncodes == 0)
+            ncodes = size_t(1) << 30;
+
+        nprobe_grid = geometric_grid(1, max_nprobe);
+        efSearch_grid = geometric_grid(1, 2 * max_nprobe);
+        // max_codes of all codes is unbounded
+        max_codes_grid = geometric_grid(std::min<size_t>(256, ncodes), ncodes);
+
+        std::vector<bool> pruning_values = {false};
+        if (dynamic_cast<IndexIVF_HNSW_Grouping *>(index))
+            pruning_values.push_back(true);
+        for (bool do_pruning : pruning_values)
+            tune_with_pruning(do_pruning, target_recall);
+
+        // Highest QPS reaching the target, the highest recall if none does
+        best_trial = 0;
+        for (size_t i = 1; i < trials.size(); i++) {
+            const Trial &trial = trials[i];
+            const Trial &best = trials[best_trial];
+            const bool reached = trial.recall >= target_recall;
+            const bool best_reached = best.recall >= target_recall;
+            if (reached != best_reached ? reached : (reached ? trial.qps > best.qps : trial.recall > best.recall))
+                best_trial = i;
+        }
+        if (trials.empty())
+            throw std::runtime_error("No search parameters are measured");
+        trials[best_trial].params.apply(index);
+        return trials[best_trial].params;
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef IVF_HNSW_LIB_SEARCH_TUNER_H
+#define IVF_HNSW_LIB_SEARCH_TUNER_H
+
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <tuple>
+
+#include "IndexIVF_HNSW.h"
+
+namespace ivfhnsw {
+    /// Search parameters of an index, saved next to it by tools/tune_search
+    struct SearchParams
+    {
+        size_t nprobe;        ///< Number of probes at search time
+        size_t max_codes;     ///< Max number of codes to visit to do a query
+        size_t efSearch;      ///< efSearch of the quantizer, at least nprobe
+        bool do_pruning;      ///< Pruning of the grouping index, ignored by IndexIVF_HNSW
+
+        SearchParams(size_t nprobe = 16, size_t max_codes = 10000, size_t efSearch = 64, bool do_pruning = false):
+                nprobe(nprobe), max_codes(max_codes), efSearch(efSearch), do_pruning(do_pruning)
+        {}
+
+        /// Set the parameters of the index
+        void apply(IndexIVF_HNSW *index) const;
+
+        /// Write as text lines "name value"
+        void write(const char *path) const;
+
+        /// Read the parameters written by write(), throws if the file is missing or malformed
+        void read(const char *path);
+
+        bool operator<(const SearchParams &other) const
+        {
+            return std::make_tuple(nprobe, max_codes, efSearch, do_pruning) <
+                   std::make_tuple(other.nprobe, other.max_codes, other.efSearch, other.do_pruning);
+        }
+    };
+
+    /** Finds the search parameters of the highest QPS reaching a target recall on held-out queries
+      *
+      * Recall@k is the fraction of queries with their first ground truth neighbour among the k found,
+      * as reported by the tests. QPS is measured with <nthreads> threads searching different queries.
+      *
+      * The space is searched by coordinate descent on grids of roughly geometric values, not exhaustively.
+      * Recall grows with each parameter, so for a given nprobe the smallest efSearch and max_codes
+      * reaching the target are found by binary search on their grids. nprobe starts at the smallest value
+      * reaching the target with unbounded max_codes and grows while QPS improves: a larger nprobe
+      * with a smaller max_codes is often faster. With grouping, pruning on and off are tuned separately.
+      * Each setting is measured once, the measurements are kept in trials.
+    */
+    struct SearchTuner
+    {
+        /// Measurement of one setting
+        struct Trial
+        {
+            SearchParams params;
+            double recall;     ///< Recall@k over the queries
+            double qps;        ///< Queries per second with nthreads threads
+        };
+
+        size_t max_nprobe;             ///< Largest nprobe tried, default: min(nc, 1024)
+        size_t nstale;                 ///< nprobe stops growing after this many values without a better QPS, default: 2
+        bool verbose;                  ///< Print the trials
+        std::vector<Trial> trials;     ///< All measured settings in the order of measurement
+
+        /**
+          * @param index     index to tune, its search parameters are changed
+          * @param nq        number of held-out queries
+          * @param queries   queries, size nq * d
+          * @param gt        ground truth neighbours, size nq * ngt
+          * @param ngt       number of ground truth neighbours per query
+          * @param k         rank of the recall and number of neighbours searched
+          * @param nthreads  number of threads searching the queries
+        */
+        SearchTuner(IndexIVF_HNSW *index, size_t nq, const float *queries,
+                    const IndexIVF_HNSW::idx_t *gt, size_t ngt, size_t k, size_t nthreads);
+
+        /** Parameters of the highest QPS with recall@k of at least target_recall
+          *
+          * If no setting reaches the target, the parameters of the highest recall are returned,
+          * compare the recall of the result with the target via best().
+        */
+        SearchParams tune(double target_recall);
+
+        /// Measure the setting, measurements are cached
+        const Trial &measure(const SearchParams &params);
+
+        /// The trial of the parameters returned by the last tune()
+        const Trial &best() const { return trials[best_trial]; }
+
+    private:
+        IndexIVF_HNSW *index;
+        size_t nq;
+        const float *queries;
+        const IndexIVF_HNSW::idx_t *gt;
+        size_t ngt;
+        size_t k;
+        size_t nthreads;
+
+        std::vector<size_t> nprobe_grid;
+        std::vector<size_t> efSearch_grid;
+        std::vector<size_t> max_codes_grid;
+        std::map<SearchParams, size_t> measured;    ///< Position of the trial of measured settings
+        size_t best_trial;
+
+        bool reaches(const SearchParams &params, double target_recall)
+        {
+            return measure(params).recall >= target_recall;
+        }
+
+        /// Lower one parameter to the smallest grid value >= min_value keeping the target, recall is assumed monotone
+        void minimize(SearchParams &params, size_t SearchParams::*param, const std::vector<size_t> &grid,
+                      size_t min_value, double target_recall);
+
+        /// Tune nprobe, efSearch and max_codes with pruning fixed, returns false if the target is not reached
+        bool tune_with_pruning(bool do_pruning, double target_recall);
+    };
+}
+#endif //IVF_HNSW_LIB_SEARCH_TUNER_H
@@ -0,0 +1,424 @@
+#include "SegmentedIndex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    SegmentedIndex::Segment::Segment(size_t nc): nc(nc), ntotal(0), ids(nc), codes(nc), norm_codes(nc), ndeleted(0)
+    {}
+
+    void SegmentedIndex::Segment::seal()
+    {
+        list_offsets.resize(nc);
+        size_t offset = 0;
+        for (size_t i = 0; i < nc; i++) {
+            list_offsets[i] = offset;
+            offset += ids[i].size();
+        }
+        ntotal = offset;
+
+        const size_t nwords = (ntotal + 63) / 64;
+        tombstones.reset(new std::atomic<uint64_t>[nwords]);
+        for (size_t i = 0; i < nwords; i++)
+            tombstones[i].store(0, std::memory_order_relaxed);
+    }
+
+    SegmentedIndex::SegmentedIndex(IndexIVF_HNSW *index, size_t max_mutable_size, size_t max_segments):
+            index(index), max_mutable_size(max_mutable_size), max_segments(max_segments), merge_factor(4),
+            spill_ratio(index->spill_ratio), mutable_segment(new Segment(index->nc)),
+            segments(std::make_shared<std::vector<SegmentPtr> >()), merge_requested(false), stop(false)
+    {
+        if (!index->quantizer || !index->codec || !index->norm_pq)
+            throw std::runtime_error("SegmentedIndex needs the index with the quantizer and the codebooks trained");
+
+        centroid_norms.resize(index->nc);
+        for (size_t i = 0; i < index->nc; i++)
+            centroid_norms[i] = faiss::fvec_norm_L2sqr(index->quantizer->getDataByInternalId(i), index->d);
+
+        // Search removes the duplicate ids of spilled vectors
+        if (spill_ratio > 0)
+            index->has_spill = true;
+
+        merge_thread = std::thread([this]() {
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(merge_wait_mutex);
+                    merge_cv.wait(lock, [this]() { return stop || merge_requested; });
+                    if (stop)
+                        return;
+                    merge_requested = false;
+                }
+                merge_tiers();
+            }
+        });
+    }
+
+    SegmentedIndex::~SegmentedIndex()
+    {
+        {
+            std::unique_lock<std::mutex> lock(merge_wait_mutex);
+            stop = true;
+        }
+        merge_cv.notify_all();
+        merge_thread.join();
+    }
+
+    void SegmentedIndex::add(size_t n, const float *x, const label_t *xids)
+    {
+        const size_t d = index->d;
+        const size_t code_size = index->code_size;
+
+        // Assign and encode outside of the locks
+        std::vector<idx_t> idx(n);
+        index->assign(n, x, idx.data());
+
+        std::vector<uint8_t> xcodes(n * code_size);
+        std::vector<uint8_t> xnorm_codes(n);
+        index->encode(n, x, idx.data(), xcodes.data(), xnorm_codes.data());
+
+        // Second lists of spilled vectors, as in IndexIVF_HNSW::add_batch
+        std::vector<size_t> spilled;
+        std::vector<idx_t> spill_idx(spill_ratio > 0 ? n : 0);
+        std::vector<uint8_t> spilled_codes;
+        std::vector<uint8_t> spilled_norm_codes;
+        if (spill_ratio > 0) {
+            spilled = index->select_spill(n, x, idx.data(), spill_idx.data());
+            const size_t nspilled = spilled.size();
+            std::vector<float> spilled_x(nspilled * d);
+            std::vector<idx_t> spilled_idx(nspilled);
+            for (size_t i = 0; i < nspilled; i++) {
+                memcpy(spilled_x.data() + i * d, x + spilled[i] * d, d * sizeof(float));
+                spilled_idx[i] = spill_idx[spilled[i]];
+            }
+            spilled_codes.resize(nspilled * code_size);
+            spilled_norm_codes.resize(nspilled);
+            index->encode(nspilled, spilled_x.data(), spilled_idx.data(), spilled_codes.data(), spilled_norm_codes.data());
+        }
+
+        std::unique_lock<std::mutex> write_lock(write_mutex);
+        {
+            std::unique_lock<SharedMutex> mutable_lock(mutable_mutex);
+            size_t s = 0;
+            for (size_t i = 0; i < n; i++) {
+                // Upsert: delete the previous version of the vector
+                auto found = locations.find(xids[i]);
+                if (found != locations.end()) {
+                    remove_locations(found->second);
+                    locations.erase(found);
+                }
+                Locations vector_locations = Locations();
+                vector_locations.primary = append(idx[i], xids[i], xcodes.data() + i * code_size, xnorm_codes[i]);
+                vector_locations.is_spilled = s < spilled.size() && spilled[s] == i;
+                if (vector_locations.is_spilled) {
+                    vector_locations.spilled = append(spill_idx[i], xids[i], spilled_codes.data() + s * code_size,
+                                                      spilled_norm_codes[s]);
+                    s++;
+                }
+                locations[xids[i]] = vector_locations;
+            }
+        }
+        if (mutable_segment->ntotal >= max_mutable_size)
+            seal_mutable();
+    }
+
+    SegmentedIndex::Location SegmentedIndex::append(idx_t list_no, label_t id, const uint8_t *code, uint8_t norm_code)
+    {
+        const size_t code_size = index->code_size;
+        const Location location = {nullptr, list_no, mutable_segment->ids[list_no].size()};
+        mutable_segment->ids[list_no].push_back(id);
+        mutable_segment->codes[list_no].insert(mutable_segment->codes[list_no].end(), code, code + code_size);
+        mutable_segment->norm_codes[list_no].push_back(norm_code);
+        mutable_segment->ntotal++;
+        return location;
+    }
+
+    size_t SegmentedIndex::remove(size_t n, const label_t *xids)
+    {
+        size_t nremoved = 0;
+        std::unique_lock<std::mutex> write_lock(write_mutex);
+        std::unique_lock<SharedMutex> mutable_lock(mutable_mutex);
+        for (size_t i = 0; i < n; i++) {
+            auto found = locations.find(xids[i]);
+            if (found == locations.end())
+                continue;
+            remove_locations(found->second);
+            locations.erase(found);
+            nremoved++;
+        }
+        return nremoved;
+    }
+
+    void SegmentedIndex::remove_locations(const Locations &vector_locations)
+    {
+        // Copy: moving a vector of the mutable segment updates the locations
+        const Locations removed = vector_locations;
+        remove_location(removed.primary);
+        if (removed.is_spilled)
+            remove_location(removed.spilled);
+    }
+
+    void SegmentedIndex::remove_location(const Location &location)
+    {
+        if (location.segment) {
+            location.segment->mark_deleted(location.list_no, location.offset);
+            return;
+        }
+        // Move the last vector of the mutable list to the place of the removed one
+        const size_t code_size = index->code_size;
+        std::vector<label_t> &list_ids = mutable_segment->ids[location.list_no];
+        std::vector<uint8_t> &list_codes = mutable_segment->codes[location.list_no];
+        std::vector<uint8_t> &list_norm_codes = mutable_segment->norm_codes[location.list_no];
+
+        const size_t last = list_ids.size() - 1;
+        if (location.offset != last) {
+            list_ids[location.offset] = list_ids[last];
+            memcpy(list_codes.data() + location.offset * code_size, list_codes.data() + last * code_size, code_size);
+            list_norm_codes[location.offset] = list_norm_codes[last];
+            locations.find(list_ids[location.offset])->second.find(nullptr, location.list_no).offset = location.offset;
+        }
+        list_ids.pop_back();
+        list_codes.resize(last * code_size);
+        list_norm_codes.pop_back();
+        mutable_segment->ntotal--;
+    }
+
+    void SegmentedIndex::flush()
+    {
+        std::unique_lock<std::mutex> write_lock(write_mutex);
+        seal_mutable();
+    }
+
+    void SegmentedIndex::seal_mutable()
+    {
+        if (mutable_segment->ntotal == 0)
+            return;
+
+        SegmentPtr sealed;
+        size_t nsegments;
+        {
+            // Readers see the vectors either in the mutable segment or in the sealed one
+            std::unique_lock<SharedMutex> mutable_lock(mutable_mutex);
+            sealed.reset(mutable_segment.release());
+            sealed->seal();
+            mutable_segment.reset(new Segment(index->nc));
+
+            std::shared_ptr<std::vector<SegmentPtr> > updated = std::make_shared<std::vector<SegmentPtr> >(*snapshot());
+            updated->push_back(sealed);
+            nsegments = updated->size();
+            std::atomic_store(&segments, std::shared_ptr<const std::vector<SegmentPtr> >(updated));
+        }
+        for (size_t i = 0; i < sealed->nc; i++)
+            for (label_t id : sealed->ids[i])
+                locations.find(id)->second.find(nullptr, i).segment = sealed.get();
+
+        if (nsegments > max_segments) {
+            {
+                std::unique_lock<std::mutex> lock(merge_wait_mutex);
+                merge_requested = true;
+            }
+            merge_cv.notify_one();
+        }
+    }
+
+    void SegmentedIndex::merge()
+    {
+        std::unique_lock<std::mutex> merge_lock(merge_mutex);
+        std::shared_ptr<const std::vector<SegmentPtr> > current = snapshot();
+        if (current->empty() || (current->size() == 1 && current->front()->ndeleted == 0))
+            return;
+        merge_range(0, current->size());
+    }
+
+    void SegmentedIndex::merge_tiers()
+    {
+        std::unique_lock<std::mutex> merge_lock(merge_mutex);
+        const size_t width = std::max<size_t>(merge_factor, 2);
+        while (true) {
+            std::shared_ptr<const std::vector<SegmentPtr> > current = snapshot();
+            const size_t nsegments = current->size();
+            if (nsegments <= max_segments || nsegments < 2)
+                return;
+
+            // Adjacent segments of the fewest live vectors, they are of similar sizes
+            const size_t nmerged = std::min(width, nsegments);
+            size_t begin = 0;
+            size_t min_size = std::numeric_limits<size_t>::max();
+            for (size_t b = 0; b + nmerged <= nsegments; b++) {
+                size_t size = 0;
+                for (size_t j = b; j < b + nmerged; j++)
+                    size += live_size(*(*current)[j]);
+                if (size < min_size) {
+                    min_size = size;
+                    begin = b;
+                }
+            }
+            merge_range(begin, begin + nmerged);
+        }
+    }
+
+    void SegmentedIndex::merge_range(size_t begin, size_t end)
+    {
+        // Only merges remove segments and they are serialized, so [begin, end) stays in place while sealing appends
+        std::shared_ptr<const std::vector<SegmentPtr> > current = snapshot();
+        const std::vector<SegmentPtr> merged_segments(current->begin() + begin, current->begin() + end);
+
+        const size_t nc = index->nc;
+        const size_t code_size = index->code_size;
+        SegmentPtr merged = std::make_shared<Segment>(nc);
+
+        // Source of each merged vector, to carry over deletes made during the merge
+        std::vector<std::vector<std::pair<Segment *, size_t> > > sources(nc);
+
+        for (size_t i = 0; i < nc; i++) {
+            std::vector<std::pair<label_t, std::pair<Segment *, size_t> > > entries;
+            for (const SegmentPtr &segment : merged_segments)
+                for (size_t j = 0; j < segment->ids[i].size(); j++)
+                    if (!segment->is_deleted(i, j))
+                        entries.push_back(std::make_pair(segment->ids[i][j], std::make_pair(segment.get(), j)));
+
+            // Re-group the list in increasing id order
+            std::sort(entries.begin(), entries.end(),
+                      [](const std::pair<label_t, std::pair<Segment *, size_t> > &a,
+                         const std::pair<label_t, std::pair<Segment *, size_t> > &b) { return a.first < b.first; });
+
+            merged->ids[i].reserve(entries.size());
+            merged->codes[i].reserve(entries.size() * code_size);
+            merged->norm_codes[i].reserve(entries.size());
+            sources[i].reserve(entries.size());
+            for (const auto &entry : entries) {
+                const Segment *segment = entry.second.first;
+                const size_t j = entry.second.second;
+                const uint8_t *code = segment->codes[i].data() + j * code_size;
+                merged->ids[i].push_back(entry.first);
+                merged->codes[i].insert(merged->codes[i].end(), code, code + code_size);
+                merged->norm_codes[i].push_back(segment->norm_codes[i][j]);
+                sources[i].push_back(entry.second);
+            }
+        }
+        merged->seal();
+
+        std::unique_lock<std::mutex> write_lock(write_mutex);
+        for (size_t i = 0; i < nc; i++)
+            for (size_t j = 0; j < sources[i].size(); j++) {
+                Segment *source = sources[i][j].first;
+                if (source->is_deleted(i, sources[i][j].second))
+                    merged->mark_deleted(i, j);
+                else
+                    locations.find(merged->ids[i][j])->second.find(source, i) = {merged.get(), (idx_t) i, j};
+            }
+
+        // The merged segment takes the place of its sources, segments sealed during the merge are kept
+        current = snapshot();
+        std::shared_ptr<std::vector<SegmentPtr> > updated = std::make_shared<std::vector<SegmentPtr> >();
+        updated->insert(updated->end(), current->begin(), current->begin() + begin);
+        updated->push_back(merged);
+        updated->insert(updated->end(), current->begin() + end, current->end());
+        std::atomic_store(&segments, std::shared_ptr<const std::vector<SegmentPtr> >(updated));
+    }
+
+    void SegmentedIndex::search(size_t k, const float *x, float *distances, long *labels) const
+    {
+        const size_t nprobe = index->nprobe;
+
+        // For correct search using OPQ rotate a query, the buffer is local to the call for concurrent searches
+        std::vector<float> rotated(index->do_opq ? index->d : 0);
+        if (index->do_opq)
+            index->opq_matrix->apply_noalloc(1, x, rotated.data());
+        const float *query = index->do_opq ? rotated.data() : x;
+
+        // Find the nearest coarse centroids to the query
+        auto coarse = index->quantizer->searchKnn(query, nprobe);
+        const size_t ncentroids = coarse.size();
+        std::vector<float> query_centroid_dists(std::max(nprobe, ncentroids), std::numeric_limits<float>::max());
+        std::vector<idx_t> centroid_idxs(ncentroids);
+        for (int_fast32_t i = ncentroids - 1; i >= 0; i--) {
+            query_centroid_dists[i] = coarse.top().first;
+            centroid_idxs[i] = coarse.top().second;
+            coarse.pop();
+        }
+        // Lists far from the query relative to the nearest one are not probed
+        const size_t nprobe_query = ncentroids ? std::min(index->probe_count(query_centroid_dists.data()), ncentroids) : 0;
+
+        // Query distance table, local to the call for concurrent searches
+        std::vector<float> table(index->codec->table_size);
+        index->codec->compute_table(query, table.data());
+
+        // Prepare max heap with k answers
+        faiss::maxheap_heapify(k, distances, labels);
+
+        std::vector<float> norms;
+        std::vector<float> inner_prods;
+        size_t ncode = 0;
+
+        // The mutable segment holds the latest vectors, its probed lists are scanned in place. The shared lock is
+        // held through the scan of the immutable segments too: an upsert marks the tombstone of the old copy and
+        // appends the new one under the exclusive lock, so a search sees either both changes or none of them
+        SharedLock mutable_lock(mutable_mutex);
+        std::shared_ptr<const std::vector<SegmentPtr> > snapshot_segments = snapshot();
+        for (size_t i = 0; i < nprobe_query; i++) {
+            const idx_t centroid_idx = centroid_idxs[i];
+            const size_t group_size = mutable_segment->ids[centroid_idx].size();
+            const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+            scan_list(k, group_size, mutable_segment->ids[centroid_idx].data(),
+                      mutable_segment->codes[centroid_idx].data(), mutable_segment->norm_codes[centroid_idx].data(),
+                      nullptr, centroid_idx, term1, table.data(), norms, inner_prods, distances, labels);
+            ncode += group_size;
+        }
+
+        IndexIVF_HNSW::ScanStop scan_stop(index->stop_codes);
+        for (size_t i = 0; i < nprobe_query && ncode < index->max_codes; i++) {
+            const idx_t centroid_idx = centroid_idxs[i];
+            const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+
+            size_t nscanned = 0;
+            for (const SegmentPtr &segment : *snapshot_segments) {
+                const size_t group_size = segment->ids[centroid_idx].size();
+                scan_list(k, group_size, segment->ids[centroid_idx].data(), segment->codes[centroid_idx].data(),
+                          segment->norm_codes[centroid_idx].data(), segment.get(), centroid_idx, term1,
+                          table.data(), norms, inner_prods, distances, labels);
+                nscanned += group_size;
+            }
+            ncode += nscanned;
+            if (nscanned > 0 && scan_stop.update(nscanned, distances[0]))
+                break;
+        }
+    }
+
+    void SegmentedIndex::scan_list(size_t k, size_t size, const label_t *ids, const uint8_t *codes,
+                                   const uint8_t *norm_codes, const Segment *segment, idx_t list_no,
+                                   float term1, const float *table, std::vector<float> &norms,
+                                   std::vector<float> &inner_prods, float *distances, long *labels) const
+    {
+        if (size == 0)
+            return;
+
+        // Decode the norms of each vector in the list and compute the inner products with the query
+        norms.resize(size);
+        index->norm_pq->decode(norm_codes, norms.data(), size);
+        inner_prods.resize(size);
+        index->codec->inner_products(size, codes, table, inner_prods.data());
+
+        for (size_t j = 0; j < size; j++) {
+            if (segment && segment->is_deleted(list_no, j))
+                continue;
+
+            const float dist = term1 + norms[j] - 2 * inner_prods[j];
+            if (dist < distances[0])
+                index->push_result(k, distances, labels, dist, ids[j]);
+        }
+    }
+
+    size_t SegmentedIndex::ntotal() const
+    {
+        std::unique_lock<std::mutex> write_lock(write_mutex);
+        return locations.size();
+    }
+
+    size_t SegmentedIndex::nsegments() const
+    {
+        return snapshot()->size();
+    }
+}
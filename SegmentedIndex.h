@@ -0,0 +1,219 @@
+#ifndef IVF_HNSW_LIB_SEGMENTED_INDEX_H
+#define IVF_HNSW_LIB_SEGMENTED_INDEX_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <pthread.h>
+
+#include "IndexIVF_HNSW.h"
+
+namespace ivfhnsw {
+    /** Segmented (LSM-style) index supporting concurrent inserts, deletes and searches
+      *
+      * All segments share the quantizer and the codebooks of a trained IndexIVF_HNSW
+      * and store codes in its inverted list layout.
+      *
+      * - Fresh vectors go to the mutable segment. Writers encode them outside of any lock
+      *   and only append the codes under a short lock.
+      * - Once the mutable segment holds <max_mutable_size> vectors, it is sealed into an immutable segment.
+      * - If spill_ratio of the index is set at construction, vectors are also stored in their second lists
+      *   like in IndexIVF_HNSW::add_batch, and search removes the duplicate ids.
+      * - Deletes and upserts mark the vectors of immutable segments in their tombstone bitmaps,
+      *   vectors of the mutable segment are removed in place.
+      * - A background thread merges immutable segments once there are more than <max_segments> of them.
+      *   Size-tiered: the <merge_factor> adjacent segments of the fewest live vectors are merged,
+      *   so a vector is rewritten about log(ntotal / max_mutable_size) times. Deleted vectors are dropped
+      *   and the lists are re-grouped in increasing id order.
+      *
+      * Search probes the lists like IndexIVF_HNSW::search (nprobe, probe_ratio, max_codes, stop_codes).
+      * It scans the mutable segment and the snapshot of the immutable segments under one shared lock,
+      * so an upsert, which deletes the old copy and appends the new one under the exclusive lock, is seen
+      * whole or not at all. Searches run concurrently with each other and with encoding and merging,
+      * writers wait for the searches in progress to append their codes.
+      * All methods may be called concurrently.
+    */
+    struct SegmentedIndex
+    {
+        typedef IndexIVF_HNSW::idx_t idx_t;
+
+        /// Inverted lists of a segment
+        struct Segment
+        {
+            size_t nc;                                         ///< Number of lists
+            size_t ntotal;                                     ///< Number of vectors, including deleted ones
+            std::vector<std::vector<label_t> > ids;            ///< Inverted lists for indexes
+            std::vector<std::vector<uint8_t> > codes;          ///< PQ codes of residuals
+            std::vector<std::vector<uint8_t> > norm_codes;     ///< PQ codes of norms of reconstructed vectors
+            std::vector<size_t> list_offsets;                  ///< Position of the first vector of each list in the bitmap
+            std::unique_ptr<std::atomic<uint64_t>[]> tombstones;  ///< Bit per vector, set if it is deleted
+            std::atomic<size_t> ndeleted;                      ///< Number of deleted vectors
+
+            explicit Segment(size_t nc);
+
+            /// Allocate the tombstone bitmap once the lists are filled
+            void seal();
+
+            bool is_deleted(idx_t list_no, size_t j) const
+            {
+                const size_t pos = list_offsets[list_no] + j;
+                return (tombstones[pos >> 6].load(std::memory_order_relaxed) >> (pos & 63)) & 1;
+            }
+
+            void mark_deleted(idx_t list_no, size_t j)
+            {
+                const size_t pos = list_offsets[list_no] + j;
+                tombstones[pos >> 6].fetch_or(1ULL << (pos & 63), std::memory_order_relaxed);
+                ndeleted++;
+            }
+        };
+        typedef std::shared_ptr<Segment> SegmentPtr;
+
+        IndexIVF_HNSW *index;      ///< Trained quantizer and codebooks, not owned
+        size_t max_mutable_size;   ///< Number of vectors in the mutable segment to seal it
+        size_t max_segments;       ///< Number of immutable segments to trigger the background merge
+        size_t merge_factor;       ///< Number of adjacent segments merged at once by the background merge
+
+        /** Construct on top of the trained index
+          *
+          * @param index               index with the quantizer, codec, norm_pq and OPQ matrix (if do_opq) trained
+          * @param max_mutable_size    number of vectors in the mutable segment to seal it
+          * @param max_segments        number of immutable segments to trigger the background merge
+        */
+        explicit SegmentedIndex(IndexIVF_HNSW *index, size_t max_mutable_size = 1 << 20, size_t max_segments = 8);
+        ~SegmentedIndex();
+
+        /** Add n vectors of dimension d. Vectors with the ids already in the index are replaced
+          *
+          * @param n       number of vectors
+          * @param x       vectors to add, size n * d
+          * @param xids    ids to store for the vectors, size n
+        */
+        void add(size_t n, const float *x, const label_t *xids);
+
+        /// Delete the vectors with the ids, unknown ids are ignored. Returns the number of deleted vectors
+        size_t remove(size_t n, const label_t *xids);
+
+        /** Query a vector of dimension d. Uses nprobe and max_codes of the index
+          *
+          * @param k           number of the closest vertices to search
+          * @param x           query vector, size d
+          * @param distances   output pairwise distances, size k
+          * @param labels      output labels of the nearest neighbours, size k
+        */
+        void search(size_t k, const float *x, float *distances, long *labels) const;
+
+        /// Seal the mutable segment, even if it is not full
+        void flush();
+
+        /// Merge all immutable segments into one now
+        void merge();
+
+        /// Number of live vectors
+        size_t ntotal() const;
+
+        /// Number of immutable segments
+        size_t nsegments() const;
+
+    private:
+        /// Readers-writer lock, exclusive with std::unique_lock and shared with SharedLock
+        class SharedMutex
+        {
+            pthread_rwlock_t rwlock;
+        public:
+            SharedMutex() { pthread_rwlock_init(&rwlock, nullptr); }
+            ~SharedMutex() { pthread_rwlock_destroy(&rwlock); }
+            void lock() { pthread_rwlock_wrlock(&rwlock); }
+            void unlock() { pthread_rwlock_unlock(&rwlock); }
+            void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+            void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+        };
+
+        struct SharedLock
+        {
+            SharedMutex &mutex;
+            explicit SharedLock(SharedMutex &mutex): mutex(mutex) { mutex.lock_shared(); }
+            ~SharedLock() { mutex.unlock_shared(); }
+        };
+
+        /// Location of a stored vector, <segment> is nullptr for the mutable segment
+        struct Location {
+            Segment *segment;
+            idx_t list_no;
+            size_t offset;
+        };
+
+        /// Locations of a live vector, a spilled vector also has a copy in its second list
+        struct Locations {
+            Location primary;
+            Location spilled;
+            bool is_spilled;
+
+            /// The location of the copy in the list of the segment
+            Location &find(const Segment *segment, idx_t list_no)
+            {
+                return (is_spilled && spilled.segment == segment && spilled.list_no == list_no) ? spilled : primary;
+            }
+        };
+
+        std::vector<float> centroid_norms;   ///< L2 square norms of coarse centroids
+        const float spill_ratio;             ///< spill_ratio of the index at construction
+
+        // Writers: locations, sealing and merge publishing
+        mutable std::mutex write_mutex;
+        std::unordered_map<label_t, Locations> locations;
+
+        // Mutable segment, searches hold a shared lock through the whole scan, writers an exclusive one
+        mutable SharedMutex mutable_mutex;
+        std::unique_ptr<Segment> mutable_segment;
+
+        /// Immutable segments, replaced atomically
+        std::shared_ptr<const std::vector<SegmentPtr> > segments;
+
+        // Background merge
+        std::mutex merge_mutex;          ///< Serializes merges
+        std::mutex merge_wait_mutex;
+        std::condition_variable merge_cv;
+        bool merge_requested;
+        bool stop;
+        std::thread merge_thread;
+
+        std::shared_ptr<const std::vector<SegmentPtr> > snapshot() const { return std::atomic_load(&segments); }
+
+        /// Delete the copies of a vector. write_mutex and mutable_mutex have to be held
+        void remove_locations(const Locations &vector_locations);
+
+        /// Delete a copy of a vector by its location. write_mutex and mutable_mutex have to be held
+        void remove_location(const Location &location);
+
+        /// Append a code to the list of the mutable segment. write_mutex and mutable_mutex have to be held
+        Location append(idx_t list_no, label_t id, const uint8_t *code, uint8_t norm_code);
+
+        /// Merge the immutable segments [begin, end) of the current snapshot into one. merge_mutex has to be held
+        void merge_range(size_t begin, size_t end);
+
+        /// Merge adjacent segments while there are more than max_segments, see merge_factor
+        void merge_tiers();
+
+        /// Seal the mutable segment and publish it. write_mutex has to be held
+        void seal_mutable();
+
+        /** Scan the codes of one list with the query distance table
+          *
+          * @param segment       segment of the list to check tombstones, nullptr for a mutable list
+          * @param norms         buffer for decoded norms
+          * @param inner_prods   buffer for inner products of the query with the codes
+        */
+        void scan_list(size_t k, size_t size, const label_t *ids, const uint8_t *codes, const uint8_t *norm_codes,
+                       const Segment *segment, idx_t list_no, float term1, const float *table,
+                       std::vector<float> &norms, std::vector<float> &inner_prods,
+                       float *distances, long *labels) const;
+
+        /// Live vectors of a segment
+        static size_t live_size(const Segment &segment) { return segment.ntotal - segment.ndeleted; }
+    };
+}
+#endif //IVF_HNSW_LIB_SEGMENTED_INDEX_H
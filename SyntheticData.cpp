@@ -0,0 +1,83 @@
+#include "SyntheticData.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    /// SplitMix64: cheap to seed per vector, unlike std::mt19937
+    class SplitMix64
+    {
+    public:
+        explicit SplitMix64(uint64_t seed): state(seed) {}
+
+        uint64_t next()
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        }
+
+        /// Uniform in [0, 1)
+        double uniform()
+        {
+            return (next() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        /// Standard normal, Box-Muller transform
+        double normal()
+        {
+            const double u1 = 1 - uniform();
+            const double u2 = uniform();
+            return std::sqrt(-2 * std::log(u1)) * std::cos(2 * M_PI * u2);
+        }
+
+    private:
+        uint64_t state;
+    };
+
+    SyntheticData::SyntheticData(size_t dim, size_t nclusters, float cluster_std, float skew,
+                                 bool round, uint64_t seed):
+            d(dim), nclusters(nclusters), cluster_std(cluster_std), skew(skew), round(round), seed(seed)
+    {
+        if (d == 0 || nclusters == 0)
+            throw std::runtime_error("Dimension and number of clusters have to be positive");
+
+        SplitMix64 rng(seed);
+        centers.resize(nclusters * d);
+        for (float &value : centers)
+            value = 255 * rng.uniform();
+
+        // Cluster c is drawn with probability proportional to 1 / (c + 1)^skew
+        cumulative_sizes.resize(nclusters);
+        double sum = 0;
+        for (size_t c = 0; c < nclusters; c++) {
+            sum += std::pow(c + 1.0, -skew);
+            cumulative_sizes[c] = sum;
+        }
+        for (double &size : cumulative_sizes)
+            size /= sum;
+    }
+
+    void SyntheticData::generate(Set set, size_t i0, size_t n, float *x) const
+    {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; i++) {
+            // Seed of the vector, the set and the seed of the data are mixed by the generator
+            SplitMix64 rng(SplitMix64(seed ^ ((uint64_t) set << 62) ^ (i0 + i)).next());
+
+            const double u = rng.uniform();
+            const size_t c = std::min<size_t>(std::upper_bound(cumulative_sizes.begin(), cumulative_sizes.end(), u)
+                                              - cumulative_sizes.begin(), nclusters - 1);
+            const float *center = centers.data() + c * d;
+            float *y = x + i * d;
+            for (size_t j = 0; j < d; j++) {
+                float value = center[j] + cluster_std * rng.normal();
+                value = std::min(255.f, std::max(0.f, value));
+                y[j] = round ? std::round(value) : value;
+            }
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef IVF_HNSW_LIB_SYNTHETIC_DATA_H
+#define IVF_HNSW_LIB_SYNTHETIC_DATA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ivfhnsw {
+    /** Gaussian mixture vectors for small-scale experiments without downloading SIFT1B/DEEP1B
+      *
+      * Cluster centers are uniform in [0, 255]^d, a vector is its cluster center plus
+      * isotropic Gaussian noise with cluster_std, clamped to [0, 255] so that it fits bvecs.
+      * Cluster sizes follow a Zipf law with exponent skew, 0 gives equal clusters.
+      *
+      * Vector i of a set is generated from its own seed, so any range of vectors
+      * can be generated independently and in parallel, and the data does not depend on batching.
+    */
+    struct SyntheticData
+    {
+        /// Vector sets, each set is an independent sample of the same mixture
+        enum Set { base = 0, learn = 1, queries = 2 };
+
+        size_t d;                 ///< Vector dimension
+        size_t nclusters;         ///< Number of mixture components
+        float cluster_std;        ///< Standard deviation of the noise around cluster centers
+        float skew;               ///< Zipf exponent of cluster sizes
+        bool round;               ///< Round values to integers, set it to write bvecs
+        uint64_t seed;            ///< Seed of the centers and all vectors
+
+        SyntheticData(size_t dim, size_t nclusters, float cluster_std = 20, float skew = 0,
+                      bool round = false, uint64_t seed = 1);
+
+        /** Generate vectors [i0, i0 + n) of a set
+          *
+          * @param x   output vectors, size n * d
+        */
+        void generate(Set set, size_t i0, size_t n, float *x) const;
+
+    private:
+        std::vector<float> centers;           ///< Cluster centers, size nclusters * d
+        std::vector<double> cumulative_sizes; ///< Cumulative cluster probabilities, size nclusters
+    };
+}
+#endif //IVF_HNSW_LIB_SYNTHETIC_DATA_H
@@ -0,0 +1,315 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <faiss/Heap.h>
+#include <faiss/utils.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/Codec.h>
+#include <ivf-hnsw/utils.h>
+
+using namespace ivfhnsw;
+
+/// Results are stored here, so that the compiler keeps the benchmarked calls
+static volatile float sink;
+
+/// Timing of one kernel over several repeats
+struct Result
+{
+    std::string kernel;   ///< Kernel name
+    std::string params;   ///< Kernel parameters, space separated key=value
+    size_t nops;          ///< Number of operations per repeat
+    double ns_median;     ///< Median time per operation in nanoseconds
+    double ns_min;        ///< Min time per operation in nanoseconds
+};
+
+/// Exposes the construction kernels of the grouping index
+struct GroupingKernels: IndexIVF_HNSW_Grouping
+{
+    GroupingKernels(size_t d, size_t nsubc): IndexIVF_HNSW_Grouping(d, 1, 16, 8, nsubc) {}
+    using IndexIVF_HNSW_Grouping::compute_alpha;
+    using IndexIVF_HNSW_Grouping::compute_subcentroid_idxs;
+};
+
+class Benchmark
+{
+public:
+    Benchmark(size_t nrepeats, const char *filter): nrepeats(nrepeats), filter(filter) {}
+
+    /** Time <run> repeated nrepeats times after one warm-up run
+      *
+      * @param nops   number of operations <run> performs, times are reported per operation
+    */
+    template<typename F>
+    void measure(const std::string &kernel, const std::string &params, size_t nops, F run)
+    {
+        if (filter && kernel.find(filter) == std::string::npos)
+            return;
+        run();
+        std::vector<double> times(nrepeats);
+        for (size_t r = 0; r < nrepeats; r++) {
+            const auto begin = std::chrono::steady_clock::now();
+            run();
+            const auto end = std::chrono::steady_clock::now();
+            times[r] = std::chrono::duration<double, std::nano>(end - begin).count() / nops;
+        }
+        std::sort(times.begin(), times.end());
+        results.push_back({kernel, params, nops, times[nrepeats / 2], times[0]});
+        std::cout << kernel << " " << params << ": " << times[nrepeats / 2] << " ns" << std::endl;
+    }
+
+    void write_csv(std::ostream &out) const
+    {
+        out << "kernel,params,nops,ns_median,ns_min\n";
+        for (const Result &r : results)
+            out << r.kernel << "," << r.params << "," << r.nops << "," << r.ns_median << "," << r.ns_min << "\n";
+    }
+
+    void write_json(std::ostream &out) const
+    {
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            out << "  {\"kernel\": \"" << r.kernel << "\", \"params\": \"" << r.params << "\", \"nops\": " << r.nops
+                << ", \"ns_median\": " << r.ns_median << ", \"ns_min\": " << r.ns_min << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+    }
+
+private:
+    size_t nrepeats;
+    const char *filter;
+    std::vector<Result> results;
+};
+
+static std::vector<float> random_vectors(size_t n, size_t d, long seed)
+{
+    std::vector<float> x(n * d);
+    faiss::float_randn(x.data(), x.size(), seed);
+    return x;
+}
+
+static std::vector<uint8_t> random_codes(size_t n, long seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> codes(n);
+    for (uint8_t &c : codes)
+        c = rng() & 255;
+    return codes;
+}
+
+static void bench_distances(Benchmark &bench, size_t d, hnswlib::HierarchicalNSW &hnsw)
+{
+    const size_t n = 4096, nrounds = 32;
+    const std::vector<float> x = random_vectors(n + 1, d, 1);
+    const float *query = x.data() + n * d;
+    const std::string params = "d=" + std::to_string(d);
+
+    bench.measure("fvec_L2sqr", params, n * nrounds, [&]() {
+        float sum = 0;
+        for (size_t r = 0; r < nrounds; r++)
+            for (size_t i = 0; i < n; i++)
+                sum += fvec_L2sqr(query, x.data() + i * d, d);
+        sink = sum;
+    });
+    bench.measure("fstdistfunc", params, n * nrounds, [&]() {
+        float sum = 0;
+        for (size_t r = 0; r < nrounds; r++)
+            for (size_t i = 0; i < n; i++)
+                sum += hnsw.fstdistfunc(query, x.data() + i * d);
+        sink = sum;
+    });
+}
+
+static void bench_codec(Benchmark &bench, const char *name, size_t d, size_t code_size)
+{
+    const size_t nt = 20000, nq = 256, n = 1 << 16;
+    Codec *codec = make_codec(name, d, code_size);
+    const std::vector<float> learn = random_vectors(nt, d, 2);
+    codec->train(nt, learn.data());
+
+    const std::vector<float> queries = random_vectors(nq, d, 3);
+    std::vector<float> tables(nq * codec->table_size);
+    const std::vector<uint8_t> codes = random_codes(n * codec->code_size, 4);
+    std::vector<float> ips(n);
+    const std::string params = std::string("codec=") + name + " d=" + std::to_string(d) +
+                               " code_size=" + std::to_string(codec->code_size);
+
+    bench.measure("compute_table", params, nq, [&]() {
+        for (size_t q = 0; q < nq; q++)
+            codec->compute_table(queries.data() + q * d, tables.data() + q * codec->table_size);
+        sink = tables[0];
+    });
+    bench.measure("compute_tables", params + " batch=" + std::to_string(nq), nq, [&]() {
+        codec->compute_tables(nq, queries.data(), tables.data());
+        sink = tables[0];
+    });
+    bench.measure("inner_products", params, n, [&]() {
+        codec->inner_products(n, codes.data(), tables.data(), ips.data());
+        sink = ips[n - 1];
+    });
+    delete codec;
+}
+
+static void bench_norm_pq(Benchmark &bench)
+{
+    const size_t nt = 20000, n = 1 << 16;
+    faiss::ProductQuantizer norm_pq(1, 1, 8);
+    std::vector<float> norms = random_vectors(nt, 1, 5);
+    for (float &norm : norms)
+        norm *= norm;
+    norm_pq.train(nt, norms.data());
+
+    const std::vector<uint8_t> codes = random_codes(n, 6);
+    std::vector<float> decoded(n);
+    bench.measure("norm_pq_decode", "ksub=256", n, [&]() {
+        norm_pq.decode(codes.data(), decoded.data(), n);
+        sink = decoded[n - 1];
+    });
+}
+
+static void bench_heap(Benchmark &bench)
+{
+    const size_t n = 1 << 20;
+    const std::vector<float> dists = random_vectors(n, 1, 7);
+    for (size_t k : {10, 100}) {
+        std::vector<float> distances(k);
+        std::vector<long> labels(k);
+        // The scan loop: push a candidate if it is closer than the farthest of the top-k
+        bench.measure("maxheap_scan", "k=" + std::to_string(k), n, [&]() {
+            faiss::maxheap_heapify(k, distances.data(), labels.data());
+            for (size_t i = 0; i < n; i++)
+                if (dists[i] < distances[0]) {
+                    faiss::maxheap_pop(k, distances.data(), labels.data());
+                    faiss::maxheap_push(k, distances.data(), labels.data(), dists[i], (long) i);
+                }
+            sink = distances[0];
+        });
+    }
+}
+
+static void bench_hnsw(Benchmark &bench, size_t d, hnswlib::HierarchicalNSW &hnsw, size_t nc)
+{
+    const size_t nq = 1000;
+    const std::vector<float> queries = random_vectors(nq, d, 8);
+    for (size_t ef : {16, 64, 256}) {
+        bench.measure("searchBaseLayer", "d=" + std::to_string(d) + " nc=" + std::to_string(nc) +
+                                         " ef=" + std::to_string(ef), nq, [&]() {
+            float sum = 0;
+            for (size_t q = 0; q < nq; q++)
+                sum += hnsw.searchBaseLayer(queries.data() + q * d, ef).top().first;
+            sink = sum;
+        });
+    }
+}
+
+static void bench_grouping(Benchmark &bench, size_t d)
+{
+    const size_t nsubc = 64, group_size = 1000;
+    GroupingKernels index(d, nsubc);
+
+    const std::vector<float> points = random_vectors(group_size, d, 9);
+    const std::vector<float> centroid_vectors = random_vectors(nsubc, d, 10);
+    const std::vector<float> centroid(d, 0);
+    std::vector<float> centroid_vector_norms(nsubc);
+    faiss::fvec_norms_L2sqr(centroid_vector_norms.data(), centroid_vectors.data(), d, nsubc);
+    std::vector<IndexIVF_HNSW::idx_t> subcentroid_idxs(group_size);
+    const std::string params = "d=" + std::to_string(d) + " nsubc=" + std::to_string(nsubc) +
+                               " group_size=" + std::to_string(group_size);
+
+    bench.measure("compute_alpha", params, group_size, [&]() {
+        sink = index.compute_alpha(centroid_vectors.data(), points.data(), centroid.data(),
+                                   centroid_vector_norms.data(), group_size);
+    });
+    bench.measure("compute_subcentroid_idxs", params, group_size, [&]() {
+        index.compute_subcentroid_idxs(subcentroid_idxs.data(), centroid_vectors.data(), points.data(), group_size);
+        sink = subcentroid_idxs[0];
+    });
+}
+
+//===================================================================
+// Microbenchmarks of the search and construction kernels
+//===================================================================
+// Synthetic data with fixed seeds, so runs are comparable across
+// commits. Times are per operation: a distance, a query table,
+// a scanned code, a decoded norm, a heap candidate, a query or
+// a group point. Results are written as CSV or JSON.
+//===================================================================
+int main(int argc, char **argv) {
+    bool json = false;
+    size_t d = 128;
+    size_t nc = 100000;
+    size_t nrepeats = 5;
+    const char *filter = nullptr;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-json"))
+            json = true;
+        else if (!strcmp(argv[arg], "-d"))
+            d = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc"))
+            nc = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nrepeats"))
+            nrepeats = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-filter"))
+            filter = argv[++arg];
+        else
+            break;
+    }
+    if (argc - arg != 1 || d == 0 || d % 32 || nrepeats == 0) {
+        std::cout << "Usage: " << argv[0] << " [options] path_results\n"
+                  << "    -json          Write results in JSON, CSV otherwise\n"
+                  << "    -d #           Vector dimension, a multiple of 32\n"
+                  << "    -nc #          Number of vertices of the HNSW graph\n"
+                  << "    -nrepeats #    Number of timed runs of each kernel\n"
+                  << "    -filter name   Run the kernels whose names contain the string\n";
+        return 1;
+    }
+
+    const char *path_results = argv[arg];
+
+    try {
+        Benchmark bench(nrepeats, filter);
+
+        // The graph is only built if its kernels are selected
+        const bool need_graph = !filter || std::string("searchBaseLayer").find(filter) != std::string::npos;
+        hnswlib::HierarchicalNSW hnsw(d, need_graph ? nc : 1, 16, 32, 100);
+        if (need_graph) {
+            std::cout << "Building HNSW on " << nc << " vectors" << std::endl;
+            const std::vector<float> vertices = random_vectors(nc, d, 11);
+            for (size_t i = 0; i < nc; i++)
+                hnsw.addPoint(vertices.data() + i * d);
+        }
+
+        bench_distances(bench, d, hnsw);
+        for (const char *codec : {"pq", "pq4", "sq8"})
+            bench_codec(bench, codec, d, 16);
+        bench_norm_pq(bench);
+        bench_heap(bench);
+        if (need_graph)
+            bench_hnsw(bench, d, hnsw, nc);
+        bench_grouping(bench, d);
+
+        std::cout << "Saving results to " << path_results << std::endl;
+        std::ofstream output(path_results);
+        if (json)
+            bench.write_json(output);
+        else
+            bench.write_csv(output);
+        if (!output)
+            throw std::runtime_error(std::string("Unable to write ") + path_results);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
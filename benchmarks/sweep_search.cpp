@@ -0,0 +1,344 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <omp.h>
+
+#include <faiss/Heap.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexLoader.h>
+#include <ivf-hnsw/Dataset.h>
+
+using namespace ivfhnsw;
+
+/// Search parameters of one point of the sweep
+struct Setting
+{
+    size_t nprobe;
+    size_t efSearch;
+    size_t max_codes;
+    bool do_pruning;
+};
+
+/// Measurements of one setting at one number of threads
+struct Result
+{
+    Setting setting;
+    size_t nthreads;
+    double recall[3];    ///< Recall@1, @10 and @100
+    double qps;          ///< Queries per second over the whole run
+    double latency[3];   ///< p50, p95 and p99 query latency in microseconds
+    SearchStats stats;   ///< Stats of all queries (if collected)
+};
+
+static const size_t recall_ranks[3] = {1, 10, 100};
+static const size_t k = 100;
+
+/// Comma separated list of numbers
+static std::vector<size_t> parse_list(const char *s)
+{
+    std::vector<size_t> values;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        values.push_back(atol(item.c_str()));
+    if (values.empty())
+        throw std::runtime_error(std::string("Empty list ") + s);
+    return values;
+}
+
+/// Nearest-rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    const size_t rank = std::max<size_t>(1, std::ceil(p / 100 * sorted.size()));
+    return sorted[rank - 1];
+}
+
+/** Search all queries with nthreads threads, each with its own search buffers
+  *
+  * Recall@R is the fraction of queries with the first ground truth neighbour among the R nearest found,
+  * as reported by the tests.
+*/
+static Result measure(IndexIVF_HNSW *index, const Setting &setting, size_t nthreads, size_t nq,
+                      const float *queries, const std::vector<IndexIVF_HNSW::idx_t> &gt, size_t ngt,
+                      bool collect_stats, bool collect_perf)
+{
+    Result result;
+    index->nprobe = setting.nprobe;
+    index->quantizer->efSearch = setting.efSearch;
+    index->max_codes = setting.max_codes;
+    if (IndexIVF_HNSW_Grouping *grouping = dynamic_cast<IndexIVF_HNSW_Grouping *>(index))
+        grouping->do_pruning = setting.do_pruning;
+
+    std::vector<double> latencies(nq);
+    std::vector<float> distances(nq * k);
+    std::vector<long> labels(nq * k);
+    const size_t d = index->d;
+
+    const auto begin = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(nthreads)
+    {
+        IndexIVF_HNSW::SearchBuffers buffers;
+        SearchStats thread_stats;
+        std::unique_ptr<PerfCounters> perf;
+        if (collect_stats)
+            buffers.stats = &thread_stats;
+        if (collect_perf) {
+            // Counters of this thread
+            perf.reset(new PerfCounters());
+            thread_stats.perf = perf.get();
+        }
+#pragma omp for schedule(dynamic)
+        for (size_t q = 0; q < nq; q++) {
+            const auto query_begin = std::chrono::steady_clock::now();
+            index->search(k, queries + q * d, distances.data() + q * k, labels.data() + q * k, buffers);
+            const auto query_end = std::chrono::steady_clock::now();
+            latencies[q] = std::chrono::duration<double, std::micro>(query_end - query_begin).count();
+        }
+#pragma omp critical
+        result.stats.add(thread_stats);
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    result.setting = setting;
+    result.nthreads = nthreads;
+    result.qps = nq / std::chrono::duration<double>(end - begin).count();
+
+    // Search returns max heaps, sort them to rank the neighbours
+    for (size_t q = 0; q < nq; q++)
+        faiss::maxheap_reorder(k, distances.data() + q * k, labels.data() + q * k);
+
+    for (size_t r = 0; r < 3; r++) {
+        size_t correct = 0;
+        for (size_t q = 0; q < nq; q++) {
+            const long *found = labels.data() + q * k;
+            if (std::find(found, found + recall_ranks[r], (long) gt[q * ngt]) != found + recall_ranks[r])
+                correct++;
+        }
+        result.recall[r] = 1.0 * correct / nq;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    result.latency[0] = percentile(latencies, 50);
+    result.latency[1] = percentile(latencies, 95);
+    result.latency[2] = percentile(latencies, 99);
+    return result;
+}
+
+/// Results with the per query averages of the stats and the hardware counters if they are collected
+static void write_results(std::ostream &out, const std::vector<Result> &results, bool stats, bool perf)
+{
+    out << "nprobe,efSearch,max_codes,pruning,nthreads,recall@1,recall@10,recall@100,qps,"
+        << "p50_us,p95_us,p99_us";
+    if (stats) {
+        out << ",hops,dist_calcs,lists,subgroups,subgroups_pruned,codes,heap_pushes";
+        for (size_t stage = 0; stage < SearchStats::nstages; stage++)
+            out << "," << SearchStats::stage_name(stage) << "_us";
+    }
+    if (perf)
+        for (size_t stage = 0; stage < SearchStats::nstages; stage++) {
+            const char *name = SearchStats::stage_name(stage);
+            for (size_t e = 0; e < PerfSample::nevents; e++)
+                out << "," << name << "_" << PerfSample::event_name(e);
+            out << "," << name << "_ipc";
+        }
+    out << "\n";
+    for (const Result &r : results) {
+        out << r.setting.nprobe << "," << r.setting.efSearch << "," << r.setting.max_codes << ","
+            << (r.setting.do_pruning ? "on" : "off") << "," << r.nthreads << ","
+            << r.recall[0] << "," << r.recall[1] << "," << r.recall[2] << "," << r.qps << ","
+            << r.latency[0] << "," << r.latency[1] << "," << r.latency[2];
+        if (stats) {
+            const SearchStats &s = r.stats;
+            const double nq = std::max<size_t>(s.nqueries, 1);
+            out << "," << s.nhops / nq << "," << s.ndist / nq << "," << s.nlists / nq << "," << s.nsubgroups / nq
+                << "," << s.nsubgroups_pruned / nq << "," << s.ncodes / nq << "," << s.nheap_pushes / nq;
+            for (size_t stage = 0; stage < SearchStats::nstages; stage++)
+                out << "," << s.stage_ns[stage] / nq / 1000;
+        }
+        if (perf) {
+            const SearchStats &s = r.stats;
+            const double nq = std::max<size_t>(s.nqueries, 1);
+            for (size_t stage = 0; stage < SearchStats::nstages; stage++) {
+                for (size_t e = 0; e < PerfSample::nevents; e++)
+                    out << "," << s.stage_perf[stage].values[e] / nq;
+                out << "," << s.stage_perf[stage].ipc();
+            }
+        }
+        out << "\n";
+    }
+}
+
+/// Settings not dominated in recall@R and QPS by another setting at the same number of threads
+static std::vector<Result> pareto_frontier(const std::vector<Result> &results, size_t r)
+{
+    std::vector<Result> frontier;
+    for (const Result &a : results) {
+        bool dominated = false;
+        for (const Result &b : results)
+            if (b.nthreads == a.nthreads && b.recall[r] >= a.recall[r] && b.qps >= a.qps &&
+                (b.recall[r] > a.recall[r] || b.qps > a.qps)) {
+                dominated = true;
+                break;
+            }
+        if (!dominated)
+            frontier.push_back(a);
+    }
+    std::sort(frontier.begin(), frontier.end(), [r](const Result &a, const Result &b) {
+        return a.nthreads != b.nthreads ? a.nthreads < b.nthreads : a.recall[r] < b.recall[r];
+    });
+    return frontier;
+}
+
+//===================================================================
+// Recall/QPS sweep of the search parameters
+//===================================================================
+// Loads an index built by the tests once and searches the queries
+// for each combination of nprobe, efSearch, max_codes and pruning,
+// single-threaded and with -nthreads threads, each thread with
+// its own search buffers. One CSV row per setting and number of
+// threads: recall@{1,10,100}, QPS and p50/p95/p99 latency.
+// The settings on the recall@10/QPS Pareto frontier are written
+// separately. Index options are the options of the tests.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    bool bvecs = false;
+    bool stats = false;
+    bool perf = false;
+    size_t nthreads = omp_get_max_threads();
+    const char *path_results = nullptr;
+    const char *path_pareto = nullptr;
+    const char *sweep_nprobe = "16,32,64,128";
+    const char *sweep_efSearch = "64,128,256";
+    const char *sweep_max_codes = "10000,30000,100000";
+    const char *sweep_pruning = "on";
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (!strcmp(argv[arg], "-grouping"))
+            grouping = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-stats"))
+            stats = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-perf"))
+            perf = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-nthreads"))
+            nthreads = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-path_results"))
+            path_results = argv[++arg];
+        else if (!strcmp(argv[arg], "-path_pareto"))
+            path_pareto = argv[++arg];
+        else if (!strcmp(argv[arg], "-sweep_nprobe"))
+            sweep_nprobe = argv[++arg];
+        else if (!strcmp(argv[arg], "-sweep_efSearch"))
+            sweep_efSearch = argv[++arg];
+        else if (!strcmp(argv[arg], "-sweep_max_codes"))
+            sweep_max_codes = argv[++arg];
+        else if (!strcmp(argv[arg], "-sweep_pruning"))
+            sweep_pruning = argv[++arg];
+    }
+    if (!path_results || nthreads == 0) {
+        std::cout << "Usage: " << argv[0] << " [test options] -path_results filename [sweep options]\n"
+                  << "    -grouping on/off        Index is IVF-HNSW + Grouping, built with -nsubc\n"
+                  << "    -bvecs on/off           Queries are stored in bvecs format, fvecs otherwise\n"
+                  << "    -stats on/off           Add per query work and stage times to the results, see SearchStats\n"
+                  << "    -perf on/off            Add per query hardware counters of each stage, implies -stats on\n"
+                  << "    -nthreads #             Number of threads of the multithreaded runs, default: all\n"
+                  << "    -path_results filename  Path to write the results to in CSV\n"
+                  << "    -path_pareto filename   Path to write the Pareto frontier to, default: path_results.pareto\n"
+                  << "    -sweep_nprobe list      Comma separated values of nprobe, default: " << sweep_nprobe << "\n"
+                  << "    -sweep_efSearch list    Comma separated values of efSearch, default: " << sweep_efSearch << "\n"
+                  << "    -sweep_max_codes list   Comma separated values of max_codes, default: " << sweep_max_codes << "\n"
+                  << "    -sweep_pruning list     Comma separated on/off values of pruning (grouping), default: "
+                  << sweep_pruning << "\n"
+                  << "Test options describe the index as for tests/, see Parser.h\n";
+        return 1;
+    }
+    Parser opt = Parser(argc, argv);
+    const std::string pareto_path = path_pareto ? path_pareto : std::string(path_results) + ".pareto";
+    stats |= perf;
+
+    try {
+        if (opt.ngt == 0 || opt.nq == 0)
+            throw std::runtime_error("-nq and -ngt have to be positive");
+
+        std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
+        std::vector<IndexIVF_HNSW::idx_t> gt(opt.nq * opt.ngt);
+        XvecDataset<IndexIVF_HNSW::idx_t>(opt.path_gt, opt.ngt).read(0, opt.nq, gt.data());
+
+        std::cout << "Loading queries from " << opt.path_q << std::endl;
+        std::vector<float> queries(opt.nq * opt.d);
+        if (bvecs)
+            XvecDataset<uint8_t>(opt.path_q, opt.d).read(0, opt.nq, queries.data());
+        else
+            XvecDataset<float>(opt.path_q, opt.d).read(0, opt.nq, queries.data());
+
+        IndexIVF_HNSW *index = load_index(opt, grouping);
+        // Threads search different queries, each query is scanned by its thread
+        index->nthreads_per_query = 1;
+
+        // Pruning only applies to the grouping index
+        std::vector<bool> pruning_values;
+        std::stringstream ss(sweep_pruning);
+        std::string item;
+        while (std::getline(ss, item, ','))
+            pruning_values.push_back(item == "on");
+        if (!grouping || pruning_values.empty())
+            pruning_values.assign(1, false);
+
+        std::vector<Setting> settings;
+        for (size_t nprobe : parse_list(sweep_nprobe))
+            for (size_t efSearch : parse_list(sweep_efSearch))
+                for (size_t max_codes : parse_list(sweep_max_codes))
+                    for (bool do_pruning : pruning_values)
+                        // The coarse search returns at most efSearch centroids
+                        if (nprobe <= efSearch)
+                            settings.push_back({nprobe, efSearch, max_codes, do_pruning});
+
+        if (perf && !PerfCounters().available())
+            throw std::runtime_error("Hardware counters are not available, check /proc/sys/kernel/perf_event_paranoid");
+
+        std::vector<size_t> thread_counts = {1};
+        if (nthreads > 1)
+            thread_counts.push_back(nthreads);
+
+        std::vector<Result> results;
+        for (const Setting &setting : settings)
+            for (size_t n : thread_counts) {
+                results.push_back(measure(index, setting, n, opt.nq, queries.data(), gt, opt.ngt, stats, perf));
+                const Result &r = results.back();
+                std::cout << "nprobe " << setting.nprobe << " efSearch " << setting.efSearch
+                          << " max_codes " << setting.max_codes << " pruning " << (setting.do_pruning ? "on" : "off")
+                          << " threads " << n << ": R@1 " << r.recall[0] << " R@10 " << r.recall[1]
+                          << " R@100 " << r.recall[2] << " QPS " << r.qps << " p99 " << r.latency[2] << " us"
+                          << std::endl;
+            }
+
+        std::cout << "Saving results to " << path_results << std::endl;
+        std::ofstream output(path_results);
+        write_results(output, results, stats, perf);
+        if (!output)
+            throw std::runtime_error(std::string("Unable to write ") + path_results);
+
+        std::cout << "Saving Pareto frontier to " << pareto_path << std::endl;
+        std::ofstream pareto_output(pareto_path);
+        write_results(pareto_output, pareto_frontier(results, 1), stats, perf);
+        if (!pareto_output)
+            throw std::runtime_error("Unable to write " + pareto_path);
+
+        delete index;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
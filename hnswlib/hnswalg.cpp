@@ -1,4 +1,5 @@
 #include "hnswalg.h"
+#include "../Dataset.h"
 
 namespace hnswlib {
 
@@ -33,20 +34,52 @@ namespace hnswlib {
     std::cout << "Size Mb: " << (maxelements_ * size_data_per_element) / (1000 * 1000) << std::endl;
 
     visitedlistpool = new VisitedListPool(1, maxelements_);
+    visitedbatchpool = new VisitedBatchListPool(0, maxelements_);
 
     enterpoint_node = 0;
     cur_element_count = 0;
 }
 
+HierarchicalNSW::HierarchicalNSW(const HierarchicalNSW &other)
+{
+    d_ = other.d_;
+    data_size_ = other.data_size_;
+
+    efConstruction_ = other.efConstruction_;
+    efSearch = other.efSearch;
+
+    maxelements_ = other.maxelements_;
+    M_ = other.M_;
+    maxM_ = other.maxM_;
+    size_links_level0 = other.size_links_level0;
+    size_data_per_element = other.size_data_per_element;
+    offset_data = other.offset_data;
+
+    data_level0_memory_ = (char *) malloc(maxelements_ * size_data_per_element);
+    memcpy(data_level0_memory_, other.data_level0_memory_, maxelements_ * size_data_per_element);
+
+    visitedlistpool = new VisitedListPool(1, maxelements_);
+    visitedbatchpool = new VisitedBatchListPool(0, maxelements_);
+
+    enterpoint_node = other.enterpoint_node;
+    cur_element_count = other.cur_element_count;
+}
+
 HierarchicalNSW::~HierarchicalNSW()
 {
     free(data_level0_memory_);
     delete visitedlistpool;
+    delete visitedbatchpool;
 }
 
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(const float *point, size_t ef)
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(const float *point, size_t ef,
+                                                                             SearchCounters *counters)
 {
+    // Counted in registers and added to the counters at the end
+    size_t nhops = 0;
+    size_t ndist = 0;
+
     VisitedList *vl = visitedlistpool->getFreeVisitedList();
     vl_type *massVisited = vl->mass;
     vl_type currentV = vl->curV;
@@ -54,7 +87,7 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
     std::priority_queue<std::pair<float, idx_t >> candidateSet;
 
     float dist = fstdistfunc(point, getDataByInternalId(enterpoint_node));
-    dist_calc++;
+    ndist++;
 
     topResults.emplace(dist, enterpoint_node);
     candidateSet.emplace(-dist, enterpoint_node);
@@ -69,6 +102,7 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
 
         candidateSet.pop();
         idx_t curNodeNum = curr_el_pair.second;
+        nhops++;
 
         uint8_t *ll_cur = get_linklist0(curNodeNum);
         size_t size = *ll_cur;
@@ -88,7 +122,7 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
                 massVisited[tnum] = currentV;
 
                 float dist = fstdistfunc(point, getDataByInternalId(tnum));
-                dist_calc++;
+                ndist++;
 
                 if (topResults.top().first > dist || topResults.size() < ef) {
                     candidateSet.emplace(-dist, tnum);
@@ -105,10 +139,150 @@ std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(co
         }
     }
     visitedlistpool->releaseVisitedList(vl);
+    if (counters) {
+        counters->nhops += nhops;
+        counters->ndist += ndist;
+    }
     return topResults;
 }
 
 
+namespace {
+    /// Stages of one traversal step, each of them ends with prefetches for the next one
+    enum TraversalStage { EXPAND, LINKS, FILTER, COMPUTE, DONE };
+
+    /// State of one query traversal in searchBaseLayerBatch
+    struct Traversal {
+        const float *point;
+        VisitedBatchList::mark_type slot_bit;   ///< Bit of the traversal in the shared visited marks
+        std::priority_queue<std::pair<float, idx_t>> *topResults;
+        std::priority_queue<std::pair<float, idx_t>> candidateSet;
+        float lowerBound;
+        TraversalStage stage;
+        uint8_t *ll_cur;                ///< Link list of the vertex being expanded
+        std::vector<idx_t> unvisited;   ///< Unvisited neighbors whose vectors are prefetched
+    };
+
+    inline void prefetch_range(const char *ptr, size_t size)
+    {
+        for (size_t offset = 0; offset < size; offset += 64)
+            _mm_prefetch(ptr + offset, _MM_HINT_T0);
+    }
+}
+
+void HierarchicalNSW::searchBaseLayerBatch(const float *x, size_t n, size_t ef,
+                                           std::priority_queue<std::pair<float, idx_t>> *topResults,
+                                           size_t ninterleave, SearchCounters *counters)
+{
+    if (ninterleave == 0)
+        ninterleave = 1;
+    if (ninterleave > VisitedBatchList::max_slots)
+        ninterleave = VisitedBatchList::max_slots;
+    size_t nhops = 0;
+    size_t ndist = 0;
+
+    // Traversals of a batch share the visited marks, each of them tests and sets its own bit
+    VisitedBatchList *vl = visitedbatchpool->getFreeVisitedList();
+    std::vector<Traversal> traversals;
+    for (size_t start = 0; start < n; start += ninterleave) {
+        const size_t nb = std::min(ninterleave, n - start);
+        traversals.clear();
+        traversals.resize(nb);
+        if (start > 0)
+            vl->reset();
+
+        for (size_t i = 0; i < nb; i++) {
+            Traversal &t = traversals[i];
+            t.point = x + (start + i) * d_;
+            t.slot_bit = VisitedBatchList::mark_type(1) << i;
+            t.topResults = topResults + start + i;
+            t.unvisited.reserve(maxM_);
+
+            float dist = fstdistfunc(t.point, getDataByInternalId(enterpoint_node));
+            ndist++;
+
+            t.topResults->emplace(dist, enterpoint_node);
+            t.candidateSet.emplace(-dist, enterpoint_node);
+            vl->visit(enterpoint_node, t.slot_bit);
+            t.lowerBound = dist;
+            t.stage = EXPAND;
+        }
+
+        size_t nactive = nb;
+        while (nactive > 0) {
+            for (Traversal &t : traversals) {
+                switch (t.stage) {
+                    // Take the closest candidate and prefetch its link list
+                    case EXPAND: {
+                        if (t.candidateSet.empty() || -t.candidateSet.top().first > t.lowerBound) {
+                            t.stage = DONE;
+                            nactive--;
+                            break;
+                        }
+                        t.ll_cur = get_linklist0(t.candidateSet.top().second);
+                        t.candidateSet.pop();
+                        nhops++;
+                        prefetch_range((char *) t.ll_cur, size_links_level0);
+                        t.stage = LINKS;
+                        break;
+                    }
+                    // Prefetch visited marks of the neighbors
+                    case LINKS: {
+                        size_t size = *t.ll_cur;
+                        idx_t *data = (idx_t *)(t.ll_cur + 1);
+                        for (size_t j = 0; j < size; j++)
+                            _mm_prefetch((char *) (vl->mass + data[j]), _MM_HINT_T0);
+                        t.stage = FILTER;
+                        break;
+                    }
+                    // Mark unvisited neighbors and prefetch their vectors
+                    case FILTER: {
+                        size_t size = *t.ll_cur;
+                        idx_t *data = (idx_t *)(t.ll_cur + 1);
+                        t.unvisited.clear();
+                        for (size_t j = 0; j < size; j++) {
+                            idx_t tnum = data[j];
+                            if (vl->visit(tnum, t.slot_bit)) {
+                                t.unvisited.push_back(tnum);
+                                prefetch_range((char *) getDataByInternalId(tnum), data_size_);
+                            }
+                        }
+                        t.stage = COMPUTE;
+                        break;
+                    }
+                    // Compute distances to the neighbors and update the queues
+                    case COMPUTE: {
+                        for (idx_t tnum : t.unvisited) {
+                            float dist = fstdistfunc(t.point, getDataByInternalId(tnum));
+                            ndist++;
+
+                            if (t.topResults->top().first > dist || t.topResults->size() < ef) {
+                                t.candidateSet.emplace(-dist, tnum);
+                                t.topResults->emplace(dist, tnum);
+
+                                if (t.topResults->size() > ef)
+                                    t.topResults->pop();
+
+                                t.lowerBound = t.topResults->top().first;
+                            }
+                        }
+                        t.stage = EXPAND;
+                        break;
+                    }
+                    case DONE:
+                        break;
+                }
+            }
+        }
+    }
+    visitedbatchpool->releaseVisitedList(vl);
+    if (counters) {
+        counters->nhops += nhops;
+        counters->ndist += ndist;
+    }
+}
+
+
 void HierarchicalNSW::getNeighborsByHeuristic(std::priority_queue<std::pair<float, idx_t>> &topResults, size_t NN)
 {
     if (topResults.size() < NN)
@@ -224,15 +398,26 @@ void HierarchicalNSW::addPoint(const float *point)
     }
 };
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k)
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k,
+                                                                       SearchCounters *counters, size_t ef)
 {
-    auto topResults = searchBaseLayer(query, efSearch);
+    auto topResults = searchBaseLayer(query, ef ? ef : efSearch, counters);
     while (topResults.size() > k)
         topResults.pop();
 
     return topResults;
 };
 
+void HierarchicalNSW::searchKnnBatch(const float *queries, size_t n, size_t k,
+                                     std::priority_queue<std::pair<float, idx_t>> *results, size_t ninterleave,
+                                     SearchCounters *counters, size_t ef)
+{
+    searchBaseLayerBatch(queries, n, ef ? ef : efSearch, results, ninterleave, counters);
+    for (size_t i = 0; i < n; i++)
+        while (results[i].size() > k)
+            results[i].pop();
+}
+
 void HierarchicalNSW::SaveInfo(const std::string &location)
 {
     std::cout << "Saving info to " << location << std::endl;
@@ -285,24 +470,18 @@ void HierarchicalNSW::LoadInfo(const std::string &location)
     cur_element_count = maxelements_;
 
     visitedlistpool = new VisitedListPool(1, maxelements_);
+    visitedbatchpool = new VisitedBatchListPool(0, maxelements_);
 }
 
 void HierarchicalNSW::LoadData(const std::string &location)
 {
     std::cout << "Loading data from " << location << std::endl;
-    std::ifstream input(location, std::ios::binary);
+    ivfhnsw::XvecDataset<float> data(location.c_str(), d_);
+    if (data.size() < maxelements_)
+        throw std::runtime_error("Fewer than " + std::to_string(maxelements_) + " vectors in " + location);
 
-    uint32_t dim;
-    float mass[d_];
-    for (size_t i = 0; i < maxelements_; i++) {
-        input.read((char *) &dim, sizeof(uint32_t));
-        if (dim != d_) {
-            std::cout << "Wront data dim" << std::endl;
-            exit(1);
-        }
-        input.read((char *) mass, dim * sizeof(float));
-        memcpy(getDataByInternalId(i), mass, data_size_);
-    }
+    for (size_t i = 0; i < maxelements_; i++)
+        memcpy(getDataByInternalId(i), data.vector(i), data_size_);
 }
 
 void HierarchicalNSW::LoadEdges(const std::string &location)
@@ -323,6 +502,11 @@ void HierarchicalNSW::LoadEdges(const std::string &location)
     }
 }
 
+size_t HierarchicalNSW::memory_usage() const
+{
+    return maxelements_ * size_data_per_element + visitedlistpool->memory_usage() + visitedbatchpool->memory_usage();
+}
+
 float HierarchicalNSW::fstdistfunc(const float *x, const float *y)
 {
     float PORTABLE_ALIGN32 TmpRes[8];
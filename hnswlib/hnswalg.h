@@ -44,6 +44,13 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
 namespace hnswlib {
     typedef uint32_t idx_t;
 
+    /// Work of base layer searches, added to by the searches it is passed to
+    struct SearchCounters
+    {
+        size_t nhops = 0;   ///< Vertices whose neighbors are visited
+        size_t ndist = 0;   ///< Distance computations
+    };
+
     struct HierarchicalNSW
     {
         size_t maxelements_;
@@ -51,12 +58,11 @@ namespace hnswlib {
         size_t efConstruction_;
 
         VisitedListPool *visitedlistpool;
+        VisitedBatchListPool *visitedbatchpool;   ///< Visited marks of searchBaseLayerBatch, one per running batch
 
         std::mutex cur_element_count_guard_;
         idx_t enterpoint_node;
 
-        size_t dist_calc;
-
         char *data_level0_memory_;
 
         size_t d_;
@@ -71,6 +77,9 @@ namespace hnswlib {
     public:
         HierarchicalNSW(const std::string &infoLocation, const std::string &dataLocation, const std::string &edgeLocation);
         HierarchicalNSW(size_t d, size_t maxelements, size_t M, size_t maxM, size_t efConstruction = 500);
+
+        /// Deep copy. The graph memory is allocated and first touched by the calling thread
+        HierarchicalNSW(const HierarchicalNSW &other);
         ~HierarchicalNSW();
 
         inline float *getDataByInternalId(idx_t internal_id) const {
@@ -81,7 +90,27 @@ namespace hnswlib {
             return (uint8_t *) (data_level0_memory_ + internal_id * size_data_per_element);
         }
 
-        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(const float *x, size_t ef);
+        /// Base layer search, counters of the search are added to <counters> if it is not null
+        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(const float *x, size_t ef,
+                                                                     SearchCounters *counters = nullptr);
+
+        /** Base layer search for n queries with interleaved traversals
+          *
+          * Traversals of <ninterleave> queries advance in turn on the calling thread:
+          * each step issues prefetches for one query and switches to the next one,
+          * so memory latency of a step is hidden behind the steps of other queries.
+          * Results are the same as searchBaseLayer gives for each query.
+          *
+          * The traversals share one VisitedBatchList of 4 bytes per vertex with a bit per traversal,
+          * so at most VisitedBatchList::max_slots (16) of them are interleaved.
+          *
+          * @param x            queries, size n * d
+          * @param topResults   output ef nearest vertices for each query, size n
+          * @param counters     counters of all n searches are added to it, optional
+        */
+        void searchBaseLayerBatch(const float *x, size_t n, size_t ef,
+                                  std::priority_queue<std::pair<float, idx_t>> *topResults, size_t ninterleave,
+                                  SearchCounters *counters = nullptr);
 
         void getNeighborsByHeuristic(std::priority_queue<std::pair<float, idx_t>> &topResults, size_t NN);
 
@@ -89,7 +118,14 @@ namespace hnswlib {
 
         void addPoint(const float *point);
 
-        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k);
+        /// k nearest vertices to the query, ef is the size of the candidate queue (0 - efSearch)
+        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k,
+                                                                SearchCounters *counters = nullptr, size_t ef = 0);
+
+        /// searchKnn for n queries using interleaved traversals, results has to be of size n
+        void searchKnnBatch(const float *queries, size_t n, size_t k,
+                            std::priority_queue<std::pair<float, idx_t >> *results, size_t ninterleave = 16,
+                            SearchCounters *counters = nullptr, size_t ef = 0);
 
         void SaveInfo(const std::string &location);
         void SaveEdges(const std::string &location);
@@ -99,5 +135,8 @@ namespace hnswlib {
         void LoadEdges(const std::string &location);
         
         float fstdistfunc(const float *x, const float *y);
+
+        /// Bytes of the vertices with their links and the visited lists of the searches
+        size_t memory_usage() const;
     };
 }
@@ -9,6 +9,8 @@ namespace hnswlib{
 
 class VisitedList {
 public:
+	typedef vl_type mark_type;
+
 	vl_type curV;
 	vl_type *mass;
 	size_t numelements;
@@ -32,29 +34,74 @@ public:
 	~VisitedList() { delete mass; }
 };
 
+/// Visited marks shared by the interleaved traversals of HierarchicalNSW::searchBaseLayerBatch
+///
+/// A mark holds the epoch of the batch in the high 16 bits and a bit per traversal slot in the low 16 bits,
+/// marks of older epochs are unvisited. 4 bytes per vertex replace a VisitedList per traversal.
+class VisitedBatchList {
+public:
+	typedef uint32_t mark_type;
+
+	static const size_t max_slots = 16;                 ///< Traversals sharing the marks
+	static const mark_type epoch_mask = 0xffff0000;
+
+	mark_type curV;                                     ///< Current epoch in the high bits
+	mark_type *mass;
+	size_t numelements;
+
+	VisitedBatchList(size_t numelements1)
+	{
+		curV = epoch_mask;
+		numelements = numelements1;
+		mass = new mark_type[numelements];
+	}
+
+	void reset()
+	{
+		curV += mark_type(1) << 16;
+		if (curV == 0) {
+			memset(mass, 0, sizeof(mark_type) * numelements);
+			curV += mark_type(1) << 16;
+		}
+	};
+
+	/// Mark vertex i visited by the slot, returns false if the slot has already visited it
+	bool visit(size_t i, mark_type slot_bit)
+	{
+		const mark_type mark = (mass[i] & epoch_mask) == curV ? mass[i] : curV;
+		if (mark & slot_bit)
+			return false;
+		mass[i] = mark | slot_bit;
+		return true;
+	}
+
+	~VisitedBatchList() { delete[] mass; }
+};
+
 ///////////////////////////////////////////////////////////
 //
 // Class for multi-threaded pool-management of VisitedLists
 //
 /////////////////////////////////////////////////////////
 
-class VisitedListPool {
-	std::deque<VisitedList *> pool;
+template <typename List>
+class ListPool {
+	std::deque<List *> pool;
 	std::mutex poolguard;
 	size_t maxpools;
 	size_t numelements;
 
 public:
-	VisitedListPool(size_t initmaxpools, size_t numelements1)
+	ListPool(size_t initmaxpools, size_t numelements1)
 	{
 		numelements = numelements1;
 		for (size_t i = 0; i < initmaxpools; i++)
-			pool.push_front(new VisitedList(numelements));
+			pool.push_front(new List(numelements));
 	}
 
-	VisitedList *getFreeVisitedList()
+	List *getFreeVisitedList()
 	{
-		VisitedList *rez;
+		List *rez;
 		{
 			std::unique_lock<std::mutex> lock(poolguard);
 			if (pool.size() > 0) {
@@ -62,27 +109,37 @@ public:
 				pool.pop_front();
 			}
 			else {
-				rez = new VisitedList(numelements);
+				rez = new List(numelements);
 			}
 		}
 		rez->reset();
 		return rez;
 	};
 
-	void releaseVisitedList(VisitedList *vl)
+	/// Bytes of the lists in the pool
+	size_t memory_usage()
+	{
+		std::unique_lock<std::mutex> lock(poolguard);
+		return pool.size() * (sizeof(List) + numelements * sizeof(typename List::mark_type));
+	}
+
+	void releaseVisitedList(List *vl)
 	{
 		std::unique_lock<std::mutex> lock(poolguard);
 		pool.push_front(vl);
 	};
 
-	~VisitedListPool()
+	~ListPool()
 	{
 		while (pool.size()) {
-			VisitedList *rez = pool.front();
+			List *rez = pool.front();
 			pool.pop_front();
 			delete rez;
 		}
 	};
 };
+
+typedef ListPool<VisitedList> VisitedListPool;
+typedef ListPool<VisitedBatchList> VisitedBatchListPool;
 }
 
@@ -0,0 +1,101 @@
+#include "numa_utils.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace ivfhnsw {
+
+    /// Parse cpulist format, e.g. "0-7,16-23", also used for node lists
+    static std::vector<int> parse_cpulist(const std::string &cpulist)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(cpulist);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty() || range == "\n")
+                continue;
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    NumaTopology::NumaTopology()
+    {
+        // Node ids may have gaps, e.g. offline nodes
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string nodelist;
+        std::getline(online, nodelist);
+        for (int node_id : parse_cpulist(nodelist)) {
+            std::ifstream input("/sys/devices/system/node/node" + std::to_string(node_id) + "/cpulist");
+            std::string cpulist;
+            std::getline(input, cpulist);
+            std::vector<int> cpus = parse_cpulist(cpulist);
+            // Memory-only nodes cannot run pinned threads
+            if (cpus.empty())
+                continue;
+            node_ids.push_back(node_id);
+            node_cpus.push_back(cpus);
+        }
+        // Single node with all CPUs
+        if (node_cpus.empty()) {
+            node_ids.assign(1, 0);
+            node_cpus.resize(1);
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+                node_cpus[0].push_back(cpu);
+        }
+        for (size_t node = 0; node < node_cpus.size(); node++)
+            for (int cpu : node_cpus[node]) {
+                if (cpu >= cpu_nodes.size())
+                    cpu_nodes.resize(cpu + 1, 0);
+                cpu_nodes[cpu] = node;
+            }
+    }
+
+    size_t NumaTopology::current_node() const
+    {
+        const int cpu = sched_getcpu();
+        return (cpu < 0 || cpu >= cpu_nodes.size()) ? 0 : cpu_nodes[cpu];
+    }
+
+    bool NumaTopology::bind_thread(size_t node) const
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int cpu : node_cpus[node])
+            CPU_SET(cpu, &cpuset);
+        return sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) == 0;
+    }
+
+    bool NumaTopology::page_nodes(const std::vector<const void *> &addrs, std::vector<int> &nodes) const
+    {
+        nodes.assign(addrs.size(), -1);
+        if (addrs.empty())
+            return true;
+#ifdef SYS_move_pages
+        // Page aligned addresses, the status of each page is its node without moving it
+        const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        std::vector<void *> pages(addrs.size());
+        for (size_t i = 0; i < addrs.size(); i++)
+            pages[i] = (void *) ((uintptr_t) addrs[i] & ~(page_size - 1));
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, nodes.data(), 0) != 0)
+            return false;
+        // Kernel node ids to the numbering of the topology, pages on skipped nodes are -1
+        for (int &node : nodes) {
+            const auto found = std::find(node_ids.begin(), node_ids.end(), node);
+            node = found == node_ids.end() ? -1 : int(found - node_ids.begin());
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef IVF_HNSW_LIB_NUMA_UTILS_H
+#define IVF_HNSW_LIB_NUMA_UTILS_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+
+namespace ivfhnsw {
+    /** NUMA topology of the machine
+      *
+      * Online nodes and their CPUs are read from /sys/devices/system/node. Node ids may be sparse,
+      * nodes are numbered 0..nnodes-1 here and nodes without CPUs are skipped.
+      * If the information is not available, the machine is treated as a single node.
+    */
+    struct NumaTopology
+    {
+        std::vector<int> node_ids;                 ///< Kernel id of each node
+        std::vector<std::vector<int> > node_cpus;  ///< CPUs of each node
+        std::vector<int> cpu_nodes;                ///< Node of each CPU
+
+        NumaTopology();
+
+        size_t nnodes() const { return node_cpus.size(); }
+
+        /// Node of the CPU the calling thread runs on
+        size_t current_node() const;
+
+        /// Pin the calling thread to the CPUs of the node
+        bool bind_thread(size_t node) const;
+
+        /** Run f on a thread pinned to the node
+          *
+          * Memory first touched inside f is allocated on that node.
+        */
+        template<typename F>
+        void run_on_node(size_t node, F f) const
+        {
+            std::thread worker([&]() {
+                bind_thread(node);
+                f();
+            });
+            worker.join();
+        }
+
+        /// Run f(node) on every node in parallel, each call on a thread pinned to its node
+        template<typename F>
+        void run_on_each_node(F f) const
+        {
+            run_on_each_node(1, f);
+        }
+
+        /// Run f(node) on <nthreads_per_node> threads pinned to each node in parallel
+        template<typename F>
+        void run_on_each_node(size_t nthreads_per_node, F f) const
+        {
+            std::vector<std::thread> workers;
+            for (size_t node = 0; node < nnodes(); node++)
+                for (size_t t = 0; t < nthreads_per_node; t++)
+                    workers.emplace_back([&, node]() {
+                        bind_thread(node);
+                        f(node);
+                    });
+            for (std::thread &worker : workers)
+                worker.join();
+        }
+
+        /** Nodes holding the pages of the addresses, queried with move_pages
+          *
+          * @return false if the kernel does not report page placement
+        */
+        bool page_nodes(const std::vector<const void *> &addrs, std::vector<int> &nodes) const;
+    };
+
+    /// Bytes of inverted lists read by search from the local and remote NUMA nodes
+    struct NumaStats
+    {
+        std::atomic<size_t> local_bytes;
+        std::atomic<size_t> remote_bytes;
+        bool measured;      ///< Lists are attributed to the nodes of their pages, otherwise to their intended nodes
+
+        NumaStats(): local_bytes(0), remote_bytes(0), measured(false) {}
+
+        void reset()
+        {
+            local_bytes = 0;
+            remote_bytes = 0;
+        }
+    };
+}
+#endif //IVF_HNSW_LIB_NUMA_UTILS_H
@@ -0,0 +1,139 @@
+#include "perf_utils.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <omp.h>
+
+namespace ivfhnsw {
+
+    const char *PerfSample::event_name(size_t event)
+    {
+        static const char *names[nevents] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+        return names[event];
+    }
+
+    /// Attributes of a user space event read together with its group
+    static void event_attr(size_t event, perf_event_attr &attr)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        switch (event) {
+            case PerfSample::cycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case PerfSample::instructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case PerfSample::llc_misses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case PerfSample::dtlb_misses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+        }
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    }
+
+    /// Open the event for the calling thread on any CPU
+    static int open_event(size_t event, int group_fd)
+    {
+        perf_event_attr attr;
+        event_attr(event, attr);
+        return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+
+    PerfCounters::PerfCounters(bool team): nthread_events(0)
+    {
+        for (size_t e = 0; e < PerfSample::nevents; e++)
+            event_pos[e] = -1;
+
+        // Events opened for the calling thread fix the layout of the groups of all threads
+        for (size_t e = 0; e < PerfSample::nevents; e++) {
+            const int fd = open_event(e, fds.empty() ? -1 : fds[0]);
+            if (fd < 0) {
+                // Cycles lead the group
+                if (e == PerfSample::cycles)
+                    return;
+                continue;
+            }
+            event_pos[e] = nthread_events++;
+            fds.push_back(fd);
+        }
+        if (!team)
+            return;
+
+        // The calling thread is the master of the team
+        const int nthreads = omp_get_max_threads();
+        std::vector<std::vector<int> > thread_fds(nthreads);
+        bool failed = false;
+#pragma omp parallel num_threads(nthreads)
+        {
+            const int t = omp_get_thread_num();
+            if (t > 0 && !open_thread(thread_fds[t])) {
+#pragma omp critical
+                failed = true;
+            }
+        }
+        for (const std::vector<int> &tfds : thread_fds)
+            fds.insert(fds.end(), tfds.begin(), tfds.end());
+        if (failed) {
+            for (int fd : fds)
+                close(fd);
+            fds.clear();
+        }
+    }
+
+    PerfCounters::~PerfCounters()
+    {
+        for (int fd : fds)
+            close(fd);
+    }
+
+    bool PerfCounters::open_thread(std::vector<int> &thread_fds) const
+    {
+        for (size_t e = 0; e < PerfSample::nevents; e++) {
+            if (event_pos[e] < 0)
+                continue;
+            const int fd = open_event(e, thread_fds.empty() ? -1 : thread_fds[0]);
+            if (fd < 0) {
+                for (int opened : thread_fds)
+                    close(opened);
+                thread_fds.clear();
+                return false;
+            }
+            thread_fds.push_back(fd);
+        }
+        return true;
+    }
+
+    void PerfCounters::read(PerfSample &sample) const
+    {
+        sample.reset();
+        struct {
+            uint64_t nr;
+            uint64_t time_enabled;
+            uint64_t time_running;
+            uint64_t values[PerfSample::nevents];
+        } group;
+
+        for (size_t i = 0; i < fds.size(); i += nthread_events) {
+            if (::read(fds[i], &group, sizeof(group)) <= 0 || group.time_running == 0)
+                continue;
+            // Scale multiplexed counters to the time they were enabled
+            const double scale = 1.0 * group.time_enabled / group.time_running;
+            for (size_t e = 0; e < PerfSample::nevents; e++)
+                if (event_pos[e] >= 0)
+                    sample.values[e] += group.values[event_pos[e]] * scale;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef IVF_HNSW_LIB_PERF_UTILS_H
+#define IVF_HNSW_LIB_PERF_UTILS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ivfhnsw {
+    /// Hardware counter values, or their difference between two reads
+    struct PerfSample
+    {
+        enum Event { cycles, instructions, llc_misses, dtlb_misses, nevents };
+
+        uint64_t values[nevents];   ///< Counts by event
+
+        PerfSample() { reset(); }
+
+        void reset()
+        {
+            for (size_t e = 0; e < nevents; e++)
+                values[e] = 0;
+        }
+
+        void add(const PerfSample &other)
+        {
+            for (size_t e = 0; e < nevents; e++)
+                values[e] += other.values[e];
+        }
+
+        /// Add the counts between two reads of the same counters
+        void add_delta(const PerfSample &begin, const PerfSample &end)
+        {
+            for (size_t e = 0; e < nevents; e++)
+                values[e] += end.values[e] - begin.values[e];
+        }
+
+        /// Instructions per cycle
+        double ipc() const { return values[cycles] ? 1.0 * values[instructions] / values[cycles] : 0; }
+
+        static const char *event_name(size_t event);
+    };
+
+    /** Hardware counters of threads opened with perf_event_open
+      *
+      * Cycles, instructions, last level cache misses and data TLB misses are counted in user space.
+      * The counters follow the threads they are opened in: the calling thread, or with team = true
+      * every thread of the OpenMP team, for phases parallelized inside the library. libgomp keeps
+      * the same threads across parallel regions of the same size, so the team counters cover them.
+      * Counters multiplexed by the kernel are scaled by the fraction of time they ran.
+      *
+      * If perf events are not permitted (see /proc/sys/kernel/perf_event_paranoid) or not supported
+      * by the CPU, the counters are not available and read zeros. An event the CPU does not support
+      * reads zero while the others are counted.
+    */
+    class PerfCounters
+    {
+    public:
+        explicit PerfCounters(bool team = false);
+        ~PerfCounters();
+
+        PerfCounters(const PerfCounters &) = delete;
+        PerfCounters &operator=(const PerfCounters &) = delete;
+
+        bool available() const { return !fds.empty(); }
+
+        /// Whether the event is counted
+        bool counted(size_t event) const { return available() && event_pos[event] >= 0; }
+
+        /// Current counts summed over the threads
+        void read(PerfSample &sample) const;
+
+    private:
+        /// Open the events for the calling thread, returns false if one of them fails
+        bool open_thread(std::vector<int> &thread_fds) const;
+
+        std::vector<int> fds;                   ///< Events of each thread, the first one of a thread leads its group
+        int event_pos[PerfSample::nevents];     ///< Position of the event in the group of a thread, -1 if not counted
+        size_t nthread_events;                  ///< Number of events opened per thread
+    };
+}
+#endif //IVF_HNSW_LIB_PERF_UTILS_H
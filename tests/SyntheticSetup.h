@@ -0,0 +1,98 @@
+#ifndef IVF_HNSW_TESTS_SYNTHETIC_SETUP_H
+#define IVF_HNSW_TESTS_SYNTHETIC_SETUP_H
+
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <ivf-hnsw/SyntheticData.h>
+#include <ivf-hnsw/GroundTruth.h>
+#include <ivf-hnsw/HierarchicalKMeans.h>
+#include <ivf-hnsw/utils.h>
+
+namespace ivfhnsw {
+    /** Data and settings shared by the tests on synthetic data
+      *
+      * The sizes and the search settings are set by the test, prepare() generates the vectors,
+      * the groundtruth and the centroids of the quantizer.
+    */
+    struct SyntheticSetup
+    {
+        size_t d;
+        size_t nb;
+        size_t nt;
+        size_t nq;
+        size_t nc;
+        size_t code_size;
+        size_t k;
+        std::string path_centroids;
+        std::string path_info;
+        std::string path_edges;
+
+        std::vector<float> base;      ///< Base vectors, size nb * d
+        std::vector<float> learn;     ///< Learn vectors, size nt * d
+        std::vector<float> queries;   ///< Query vectors, size nq * d
+        std::vector<long> gt;         ///< Nearest base vector of each query, size nq
+
+        /// Clustered data of the tests, the sets are independent samples of it
+        SyntheticData data() const { return SyntheticData(d, 1000); }
+
+        /// Nearest base vector of each of the n queries, the base vectors [skip_begin, skip_end) are left out
+        std::vector<long> nearest(size_t n, const float *x, size_t skip_begin = 0, size_t skip_end = 0) const
+        {
+            std::vector<float> distances(n);
+            std::vector<long> labels(n);
+            GroundTruth ground_truth(d, n, 1, x);
+            if (skip_begin > 0)
+                ground_truth.add(skip_begin, base.data(), 0);
+            if (skip_end < nb)
+                ground_truth.add(nb - skip_end, base.data() + skip_end * d, skip_end);
+            ground_truth.get(distances.data(), labels.data());
+            return labels;
+        }
+
+        /** Generate the vectors and the groundtruth, train nc centroids of the quantizer
+          *
+          * Centroids are written to work_dir/<name>_centroids.fvecs and the HNSW files
+          * work_dir/<name>_hnsw.info and .edges are removed, so that the quantizer is built afresh.
+          *
+          * @param skip_begin, skip_end  base vectors [skip_begin, skip_end) are left out of the groundtruth
+        */
+        void prepare(const std::string &work_dir, const std::string &name, size_t skip_begin = 0, size_t skip_end = 0)
+        {
+            path_centroids = work_dir + "/" + name + "_centroids.fvecs";
+            path_info = work_dir + "/" + name + "_hnsw.info";
+            path_edges = work_dir + "/" + name + "_hnsw.edges";
+
+            const SyntheticData synthetic = data();
+            std::cout << "Generating " << nb << " base vectors" << std::endl;
+            base.resize(nb * d);
+            synthetic.generate(SyntheticData::base, 0, nb, base.data());
+            learn.resize(nt * d);
+            synthetic.generate(SyntheticData::learn, 0, nt, learn.data());
+            queries.resize(nq * d);
+            synthetic.generate(SyntheticData::queries, 0, nq, queries.data());
+
+            std::cout << "Computing groundtruth" << std::endl;
+            gt = nearest(nq, queries.data(), skip_begin, skip_end);
+
+            std::cout << "Training " << nc << " centroids" << std::endl;
+            std::vector<float> centroids(nc * d);
+            HierarchicalKMeans kmeans(d, nc);
+            kmeans.verbose = false;
+            kmeans.train(nt, learn.data(), centroids.data());
+            {
+                std::ofstream output(path_centroids, std::ios::binary);
+                writeXvec<float>(output, centroids.data(), d, nc);
+                if (!output)
+                    throw std::runtime_error("Unable to write " + path_centroids);
+            }
+            std::remove(path_info.c_str());
+            std::remove(path_edges.c_str());
+        }
+    };
+}
+#endif //IVF_HNSW_TESTS_SYNTHETIC_SETUP_H
@@ -0,0 +1,300 @@
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <ivf-hnsw/IndexIVF_HNSW.h>
+#include "SyntheticSetup.h"
+
+using namespace ivfhnsw;
+
+/// Distances and labels of all queries, sorted per query
+struct Results
+{
+    std::vector<float> distances;
+    std::vector<long> labels;
+};
+
+static Results search_all(IndexIVF_HNSW &index, const SyntheticSetup &s)
+{
+    Results results;
+    results.distances.resize(s.nq * s.k);
+    results.labels.resize(s.nq * s.k);
+    std::vector<std::pair<float, long> > sorted(s.k);
+    for (size_t q = 0; q < s.nq; q++) {
+        float *distances = results.distances.data() + q * s.k;
+        long *labels = results.labels.data() + q * s.k;
+        index.search(s.k, s.queries.data() + q * s.d, distances, labels);
+        for (size_t j = 0; j < s.k; j++)
+            sorted[j] = std::make_pair(distances[j], labels[j]);
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t j = 0; j < s.k; j++) {
+            distances[j] = sorted[j].first;
+            labels[j] = sorted[j].second;
+        }
+    }
+    return results;
+}
+
+/// Report Recall@k of the results and check its floor
+static bool check_recall(const Results &results, const SyntheticSetup &s, float min_recall, const char *name)
+{
+    size_t correct = 0;
+    for (size_t q = 0; q < s.nq; q++) {
+        const long *labels = results.labels.data() + q * s.k;
+        if (std::find(labels, labels + s.k, s.gt[q]) != labels + s.k)
+            correct++;
+    }
+    const float recall = 1.0f * correct / s.nq;
+    const bool passed = recall >= min_recall;
+    std::cout << name << ": Recall@" << s.k << " " << recall << " (min " << min_recall << ") "
+              << (passed ? "passed" : "FAILED") << std::endl;
+    return passed;
+}
+
+/// Check that the results are those of the reference index, labels of equal distances may differ
+static bool check_same(const Results &results, const Results &reference, const SyntheticSetup &s, const char *name)
+{
+    size_t ndiffer = 0;
+    for (size_t q = 0; q < s.nq; q++)
+        for (size_t j = 0; j < s.k; j++) {
+            const size_t i = q * s.k + j;
+            if (results.labels[i] != reference.labels[i] &&
+                std::fabs(results.distances[i] - reference.distances[i]) > 1e-4 * std::fabs(reference.distances[i])) {
+                ndiffer++;
+                break;
+            }
+        }
+    const bool passed = ndiffer == 0;
+    std::cout << name << ": " << ndiffer << " of " << s.nq << " queries differ from the in-memory index "
+              << (passed ? "passed" : "FAILED") << std::endl;
+    return passed;
+}
+
+/// Build the index over the vectors [begin, end) with the codec, trained or read from the codebook files
+static void build(IndexIVF_HNSW &index, const SyntheticSetup &s, const char *codec, size_t begin, size_t end)
+{
+    index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+    index.do_opq = false;
+    index.set_codec(make_codec(codec, s.d, strcmp(codec, "sq8") ? s.code_size : s.d));
+    index.train_pq(s.nt, s.learn.data());
+
+    std::vector<label_t> ids(end - begin);
+    for (size_t i = begin; i < end; i++)
+        ids[i - begin] = i;
+    index.quantizer->efSearch = 220;
+    index.add_batch(end - begin, s.base.data() + begin * s.d, ids.data());
+    index.compute_centroid_norms();
+
+    index.nprobe = 32;
+    index.max_codes = 10000;
+    index.quantizer->efSearch = 80;
+}
+
+//=======================================================
+// IVF-HNSW features on synthetic data
+//=======================================================
+// Test registered in ctest next to the end-to-end test:
+// small cases of the features the main tests do not
+// cover. Recall@10 of the pq4 and sq8 codecs, and that
+// compressed ids, sharded construction merged by
+// merge_shards and lists served from SSD return the
+// results of the in-memory index. The k-NN graph of the
+// index is checked against the exact nearest neighbours
+// of sampled vectors. Files are written to work_dir.
+//=======================================================
+int main(int argc, char **argv) {
+    SyntheticSetup s = {64, 100000, 50000, 1000, 1024, 16, 10};
+    float min_recall = 0.75;
+    float min_graph_recall = 0.6;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-nb"))
+            s.nb = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc"))
+            s.nc = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-min_recall"))
+            min_recall = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-min_graph_recall"))
+            min_graph_recall = atof(argv[++arg]);
+        else
+            break;
+    }
+    if (argc - arg != 1 || s.nt < s.nc) {
+        std::cout << "Usage: " << argv[0] << " [options] work_dir\n"
+                  << "    -nb #                Number of base vectors, default: 100000\n"
+                  << "    -nc #                Number of coarse centroids, default: 1024\n"
+                  << "    -min_recall #        Min Recall@10 of each codec\n"
+                  << "    -min_graph_recall #  Min share of sampled vectors with the nearest neighbour in the k-NN graph\n";
+        return 1;
+    }
+    const std::string work_dir = argv[arg];
+
+    try {
+        s.prepare(work_dir, "features");
+
+        bool passed = true;
+
+        //========
+        // Codecs
+        //========
+        for (const char *codec : {"pq4", "sq8"}) {
+            IndexIVF_HNSW index(s.d, s.nc, s.code_size, 8);
+            build(index, s, codec, 0, s.nb);
+            const std::string name = std::string("Codec ") + codec;
+            passed &= check_recall(search_all(index, s), s, min_recall, name.c_str());
+        }
+
+        //========================================
+        // Reference in-memory index, compressed ids
+        //========================================
+        IndexIVF_HNSW index(s.d, s.nc, s.code_size, 8);
+        build(index, s, "pq", 0, s.nb);
+        const Results reference = search_all(index, s);
+        passed &= check_recall(reference, s, min_recall, "Codec pq");
+
+        const std::string path_pq = work_dir + "/features.pq";
+        const std::string path_norm_pq = work_dir + "/features.norm_pq";
+        index.codec->write(path_pq.c_str());
+        faiss::write_ProductQuantizer(index.norm_pq, path_norm_pq.c_str());
+
+        index.compress_ids();
+        passed &= check_same(search_all(index, s), reference, s, "Compressed ids");
+
+        // Compressed lists cannot grow: adding has to fail and leave the lists intact
+        {
+            const label_t id = s.nb;
+            bool rejected = false;
+            try {
+                index.add_batch(1, s.base.data(), &id);
+            } catch (const std::runtime_error &) {
+                rejected = true;
+            }
+            const bool add_passed = rejected && check_same(search_all(index, s), reference, s,
+                                                           "Compressed ids after a rejected add");
+            std::cout << "Add after compress_ids: " << (rejected ? "rejected" : "accepted") << " "
+                      << (add_passed ? "passed" : "FAILED") << std::endl;
+            passed &= add_passed;
+        }
+
+        //===========
+        // k-NN graph
+        //===========
+        {
+            // Exact nearest neighbours of sampled vectors, the vector itself is the first one
+            const size_t nsample = 1000;
+            const size_t step = s.nb / nsample;
+            std::vector<float> sample(nsample * s.d);
+            for (size_t i = 0; i < nsample; i++)
+                memcpy(sample.data() + i * s.d, s.base.data() + i * step * s.d, s.d * sizeof(float));
+            std::vector<float> sample_distances(nsample * 2);
+            std::vector<long> sample_nn(nsample * 2);
+            GroundTruth sample_ground_truth(s.d, nsample, 2, sample.data());
+            sample_ground_truth.add(s.nb, s.base.data(), 0);
+            sample_ground_truth.get(sample_distances.data(), sample_nn.data());
+
+            const size_t graph_k = 10;
+            std::vector<uint8_t> nreported(s.nb, 0);
+            size_t nfound = 0;
+            size_t nself = 0;
+            index.knn_graph(graph_k, 8, 256, [&](size_t n, const label_t *ids, const long *labels, const float *) {
+                for (size_t i = 0; i < n; i++) {
+                    nreported[ids[i]]++;
+                    const long *neighbours = labels + i * graph_k;
+                    if (std::find(neighbours, neighbours + graph_k, (long) ids[i]) != neighbours + graph_k)
+                        nself++;
+                    if (ids[i] % step == 0 && ids[i] / step < nsample) {
+                        const size_t j = ids[i] / step;
+                        const long nearest = sample_nn[2 * j] == (long) ids[i] ? sample_nn[2 * j + 1] : sample_nn[2 * j];
+                        if (std::find(neighbours, neighbours + graph_k, nearest) != neighbours + graph_k)
+                            nfound++;
+                    }
+                }
+            });
+            const size_t nmissing = std::count(nreported.begin(), nreported.end(), 0);
+            const float graph_recall = 1.0f * nfound / nsample;
+            const bool graph_passed = graph_recall >= min_graph_recall && nmissing == 0 && nself == 0;
+            std::cout << "k-NN graph: nearest neighbour found for " << graph_recall << " of sampled vectors (min "
+                      << min_graph_recall << "), " << nmissing << " vectors missing, " << nself
+                      << " with themselves as neighbours " << (graph_passed ? "passed" : "FAILED") << std::endl;
+            passed &= graph_passed;
+        }
+
+        //===================================
+        // Shards merged, then served from SSD
+        //===================================
+        {
+            const size_t nshards = 2;
+            std::vector<std::string> shard_paths;
+            for (size_t shard = 0; shard < nshards; shard++) {
+                IndexIVF_HNSW shard_index(s.d, s.nc, s.code_size, 8);
+                shard_index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+                shard_index.do_opq = false;
+                shard_index.codec->read(path_pq.c_str());
+                delete shard_index.norm_pq;
+                shard_index.norm_pq = faiss::read_ProductQuantizer(path_norm_pq.c_str());
+
+                const size_t begin = shard * s.nb / nshards;
+                const size_t end = (shard + 1) * s.nb / nshards;
+                std::vector<label_t> ids(end - begin);
+                for (size_t i = begin; i < end; i++)
+                    ids[i - begin] = i;
+                shard_index.quantizer->efSearch = 220;
+                shard_index.add_batch(end - begin, s.base.data() + begin * s.d, ids.data());
+                shard_index.compute_centroid_norms();
+
+                shard_paths.push_back(work_dir + "/features_shard" + std::to_string(shard) + ".index");
+                shard_index.write(shard_paths.back().c_str());
+            }
+            std::vector<const char *> paths;
+            for (const std::string &path : shard_paths)
+                paths.push_back(path.c_str());
+            const std::string path_merged = work_dir + "/features_merged.index";
+            IndexIVF_HNSW::merge_shards(paths, path_merged.c_str());
+
+            IndexIVF_HNSW merged(s.d, s.nc, s.code_size, 8);
+            merged.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+            merged.do_opq = false;
+            merged.codec->read(path_pq.c_str());
+            delete merged.norm_pq;
+            merged.norm_pq = faiss::read_ProductQuantizer(path_norm_pq.c_str());
+            merged.read(path_merged.c_str());
+            merged.nprobe = 32;
+            merged.max_codes = 10000;
+            merged.quantizer->efSearch = 80;
+            passed &= check_same(search_all(merged, s), reference, s, "Merged shards");
+
+            // A small cache, so that most lists are read from the file
+            const std::string path_ondisk = work_dir + "/features.lists";
+            merged.write_ondisk_lists(path_ondisk.c_str());
+            merged.load_ondisk_lists(path_ondisk.c_str(), 4, 1 << 20);
+            passed &= check_same(search_all(merged, s), reference, s, "On-disk lists");
+
+            // The in-memory lists are released: adding and writing have to fail instead of losing vectors
+            size_t nrejected = 0;
+            const label_t id = s.nb;
+            try {
+                merged.add_batch(1, s.base.data(), &id);
+            } catch (const std::exception &) {
+                nrejected++;
+            }
+            try {
+                merged.write((work_dir + "/features_ondisk.index").c_str());
+            } catch (const std::exception &) {
+                nrejected++;
+            }
+            std::cout << "Add and write with on-disk lists: " << nrejected << " of 2 rejected "
+                      << (nrejected == 2 ? "passed" : "FAILED") << std::endl;
+            passed &= nrejected == 2;
+        }
+        return passed ? 0 : 1;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -7,6 +7,8 @@
 
 #include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
 #include <ivf-hnsw/Parser.h>
+#include <ivf-hnsw/SearchTuner.h>
+#include <ivf-hnsw/Dataset.h>
 
 using namespace hnswlib;
 using namespace ivfhnsw;
@@ -29,24 +31,19 @@ int main(int argc, char **argv) {
     //==================
     std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
     std::vector<idx_t> massQA(opt.nq * opt.ngt);
-    {
-        std::ifstream gt_input(opt.path_gt, std::ios::binary);
-        readXvec<idx_t>(gt_input, massQA.data(), opt.ngt, opt.nq);
-    }
+    XvecDataset<idx_t>(opt.path_gt, opt.ngt).read(0, opt.nq, massQA.data());
     //==============
     // Load Queries 
     //==============
     std::cout << "Loading queries from " << opt.path_q << std::endl;
     std::vector<float> massQ(opt.nq * opt.d);
-    {
-        std::ifstream query_input(opt.path_q, std::ios::binary);
-        readXvecFvec<uint8_t>(query_input, massQ.data(), opt.d, opt.nq);
-    }
+    XvecDataset<uint8_t>(opt.path_q, opt.d).read(0, opt.nq, massQ.data());
     //==================
     // Initialize Index 
     //==================
     IndexIVF_HNSW_Grouping *index = new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, 8, opt.nsubc);
     index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+    index->set_codec(make_codec(opt.codec, opt.d, opt.code_size));
     index->do_opq = opt.do_opq;
 
     //==========
@@ -54,8 +51,7 @@ int main(int argc, char **argv) {
     //==========
     if (exists(opt.path_pq) && exists(opt.path_norm_pq)) {
         std::cout << "Loading Residual PQ codebook from " << opt.path_pq << std::endl;
-        if (index->pq) delete index->pq;
-        index->pq = faiss::read_ProductQuantizer(opt.path_pq);
+        index->codec->read(opt.path_pq);
 
         if (opt.do_opq){
             std::cout << "Loading Residual OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
@@ -68,10 +64,7 @@ int main(int argc, char **argv) {
     else {
         // Load learn set
         std::vector<float> trainvecs(opt.nt * opt.d);
-        {
-            std::ifstream learn_input(opt.path_learn, std::ios::binary);
-            readXvecFvec<uint8_t>(learn_input, trainvecs.data(), opt.d, opt.nt);
-        }
+        XvecDataset<uint8_t>(opt.path_learn, opt.d).read(0, opt.nt, trainvecs.data());
         // Set Random Subset of sub_nt trainvecs
         std::vector<float> trainvecs_rnd_subset(opt.nsubt * opt.d);
         random_subset(trainvecs.data(), trainvecs_rnd_subset.data(), opt.d, opt.nt, opt.nsubt);
@@ -84,7 +77,7 @@ int main(int argc, char **argv) {
             faiss::write_VectorTransform(index->opq_matrix, opt.path_opq_matrix);
         }
         std::cout << "Saving Residual PQ codebook to " << opt.path_pq << std::endl;
-        faiss::write_ProductQuantizer(index->pq, opt.path_pq);
+        index->codec->write(opt.path_pq);
 
         std::cout << "Saving Norm PQ codebook to " << opt.path_norm_pq << std::endl;
         faiss::write_ProductQuantizer(index->norm_pq, opt.path_norm_pq);
@@ -97,11 +90,12 @@ int main(int argc, char **argv) {
         std::cout << "Precomputing indices" << std::endl;
         StopW stopw = StopW();
 
-        std::ifstream input(opt.path_base, std::ios::binary);
+        XvecDataset<uint8_t> base(opt.path_base, opt.d);
         std::ofstream output(opt.path_precomputed_idxs, std::ios::binary);
 
         const uint32_t batch_size = 1000000;
         const size_t nbatches = opt.nb / batch_size;
+        XvecBatchReader<uint8_t> base_reader(base, batch_size);
 
         std::vector<float> batch(batch_size * opt.d);
         std::vector<idx_t> precomputed_idx(batch_size);
@@ -112,7 +106,7 @@ int main(int argc, char **argv) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                           << (100.*i) / nbatches << "%" << std::endl;
             }
-            readXvecFvec<uint8_t>(input, batch.data(), opt.d, batch_size);
+            base_reader.next(batch.data());
             index->assign(batch_size, batch.data(), precomputed_idx.data());
 
             output.write((char *) &batch_size, sizeof(uint32_t));
@@ -139,42 +133,48 @@ int main(int argc, char **argv) {
         std::vector<uint8_t> batch(batch_size * opt.d);
         std::vector<idx_t> idx_batch(batch_size);
 
-        for (size_t ngroups_added = 0; ngroups_added < opt.nc; ngroups_added += groups_per_iter)
+        // Precomputed indices are stored as a vector of batch_size indices per batch
+        XvecDataset<uint8_t> base(opt.path_base, opt.d);
+        XvecDataset<idx_t> precomputed_idxs(opt.path_precomputed_idxs, batch_size);
+
+        // Build only the groups of the shard
+        const size_t first_group = opt.shard * opt.nc / opt.nshards;
+        const size_t last_group = (opt.shard + 1) * opt.nc / opt.nshards;
+
+        for (size_t ngroups_added = first_group; ngroups_added < last_group; ngroups_added += groups_per_iter)
         {
+            // Number of groups on this iteration, the last one is limited by the shard
+            const size_t ngroups = std::min(groups_per_iter, last_group - ngroups_added);
+
             std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                       << ngroups_added << " / " << opt.nc << std::endl;
 
             std::vector<std::vector<uint8_t>> data(groups_per_iter);
-            std::vector<std::vector<idx_t>> ids(groups_per_iter);
+            std::vector<std::vector<label_t>> ids(groups_per_iter);
 
             // Iterate through the dataset extracting points from groups,
             // whose ids lie in [ngroups_added, ngroups_added + groups_per_iter)
-            std::ifstream base_input(opt.path_base, std::ios::binary);
-            std::ifstream idx_input(opt.path_precomputed_idxs, std::ios::binary);
+            XvecBatchReader<uint8_t> base_reader(base, batch_size);
 
             for (size_t b = 0; b < nbatches; b++) {
-                readXvec<uint8_t>(base_input, batch.data(), opt.d, batch_size);
-                readXvec<idx_t>(idx_input, idx_batch.data(), batch_size, 1);
+                base_reader.next(batch.data());
+                precomputed_idxs.read(b, 1, idx_batch.data());
 
                 for (size_t i = 0; i < batch_size; i++) {
                     if (idx_batch[i] < ngroups_added ||
-                        idx_batch[i] >= ngroups_added + groups_per_iter)
+                        idx_batch[i] >= ngroups_added + ngroups)
                         continue;
 
-                    idx_t idx = idx_batch[i] % groups_per_iter;
+                    idx_t idx = idx_batch[i] - ngroups_added;
                     for (size_t j = 0; j < opt.d; j++)
                         data[idx].push_back(batch[i * opt.d + j]);
                     ids[idx].push_back(b * batch_size + i);
                 }
             }
 
-            // If <opt.nc> is not a multiple of groups_per_iter, change <groups_per_iter> on the last iteration
-            if (opt.nc - ngroups_added <= groups_per_iter)
-                groups_per_iter = opt.nc - ngroups_added;
-
             size_t j = 0;
             #pragma omp parallel for
-            for (size_t i = 0; i < groups_per_iter; i++) {
+            for (size_t i = 0; i < ngroups; i++) {
                 #pragma omp critical
                 {
                     if (j % 10000 == 0) {
@@ -201,12 +201,36 @@ int main(int argc, char **argv) {
         // Save index, pq and norm_pq 
         std::cout << "Saving index to " << opt.path_index << std::endl;
         index->write(opt.path_index);
+
+        if (opt.nshards > 1) {
+            std::cout << "Shard " << opt.shard << " of " << opt.nshards << " is built, "
+                      << "merge the shards with tools/merge_shards -grouping" << std::endl;
+            return 0;
+        }
+    }
+    //===============================
+    // Serve inverted lists from SSD
+    //===============================
+    if (opt.path_ondisk_lists) {
+        if (!exists(opt.path_ondisk_lists)) {
+            std::cout << "Saving inverted lists to " << opt.path_ondisk_lists << std::endl;
+            index->write_ondisk_lists(opt.path_ondisk_lists);
+        }
+        std::cout << "Serving inverted lists from " << opt.path_ondisk_lists << std::endl;
+        index->load_ondisk_lists(opt.path_ondisk_lists, 16, opt.ondisk_cache_mb << 20);
     }
+    // Compress vector indices of in-memory inverted lists
+    if (opt.do_compress_ids)
+        index->compress_ids();
+
     // For correct search using OPQ encoding rotate points in the coarse quantizer
     if (opt.do_opq) {
         std::cout << "Rotating centroids"<< std::endl;
         index->rotate_quantizer();
     }
+    // Replicate the quantizer and the codebooks per NUMA node and partition inverted lists between nodes
+    if (opt.do_numa)
+        index->place_numa();
     //===================
     // Parse groundtruth
     //=================== 
@@ -221,19 +245,31 @@ int main(int argc, char **argv) {
     //=======================
     index->nprobe = opt.nprobe;
     index->max_codes = opt.max_codes;
+    index->probe_ratio = opt.probe_ratio;
+    index->stop_codes = opt.stop_codes;
+    index->nthreads_per_query = opt.nthreads_per_query;
     index->quantizer->efSearch = opt.efSearch;
     index->do_pruning = opt.do_pruning;
+    if (opt.path_search_params) {
+        SearchParams params;
+        params.read(opt.path_search_params);
+        params.apply(index);
+    }
 
     //========
     // Search 
     //========
     size_t correct = 0;
-    float distances[opt.k];
-    long labels[opt.k];
+    std::vector<float> distances(opt.nq * opt.k);
+    std::vector<long> labels(opt.nq * opt.k);
 
     StopW stopw = StopW();
+    // Threads pinned to the NUMA nodes search the queries on the nodes holding most of their probed lists
+    if (opt.do_numa)
+        index->search_numa(opt.nq, opt.k, massQ.data(), distances.data(), labels.data(), opt.nthreads_per_node);
     for (size_t i = 0; i < opt.nq; i++) {
-        index->search(opt.k, massQ.data() + i*opt.d, distances, labels);
+        if (!opt.do_numa)
+            index->search(opt.k, massQ.data() + i*opt.d, distances.data() + i*opt.k, labels.data() + i*opt.k);
         std::priority_queue<std::pair<float, idx_t >> gt(answers[i]);
         std::unordered_set<idx_t> g;
 
@@ -243,7 +279,7 @@ int main(int argc, char **argv) {
         }
 
         for (size_t j = 0; j < opt.k; j++)
-            if (g.count(labels[j]) != 0) {
+            if (g.count(labels[i*opt.k + j]) != 0) {
                 correct++;
                 break;
             }
@@ -254,6 +290,11 @@ int main(int argc, char **argv) {
     const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
     std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
     std::cout << "Time per query: " << time_us_per_query << " us" << std::endl;
+    if (opt.do_numa) {
+        const char *estimated = index->numa_stats.measured ? "" : " (estimated from the intended placement)";
+        std::cout << "Local list traffic: " << index->numa_stats.local_bytes / (1 << 20) << " MB" << estimated << std::endl;
+        std::cout << "Remote list traffic: " << index->numa_stats.remote_bytes / (1 << 20) << " MB" << estimated << std::endl;
+    }
 
     delete index;
     return 0;
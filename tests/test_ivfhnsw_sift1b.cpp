@@ -7,6 +7,8 @@
 
 #include <ivf-hnsw/IndexIVF_HNSW.h>
 #include <ivf-hnsw/Parser.h>
+#include <ivf-hnsw/SearchTuner.h>
+#include <ivf-hnsw/Dataset.h>
 
 using namespace hnswlib;
 using namespace ivfhnsw;
@@ -26,25 +28,20 @@ int main(int argc, char **argv)
     //==================
     std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
     std::vector<idx_t> massQA(opt.nq * opt.ngt);
-    {
-        std::ifstream gt_input(opt.path_gt, std::ios::binary);
-        readXvec<idx_t>(gt_input, massQA.data(), opt.ngt, opt.nq);
-    }
+    XvecDataset<idx_t>(opt.path_gt, opt.ngt).read(0, opt.nq, massQA.data());
 
     //==============
     // Load Queries
     //==============
     std::cout << "Loading queries from " << opt.path_q << std::endl;
     std::vector<float> massQ(opt.nq * opt.d);
-    {
-        std::ifstream query_input(opt.path_q, std::ios::binary);
-        readXvecFvec<uint8_t>(query_input, massQ.data(), opt.d, opt.nq);
-    }
+    XvecDataset<uint8_t>(opt.path_q, opt.d).read(0, opt.nq, massQ.data());
     //==================
     // Initialize Index
     //==================
     IndexIVF_HNSW *index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
     index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+    index->set_codec(make_codec(opt.codec, opt.d, opt.code_size));
     index->do_opq = opt.do_opq;
 
     //==========
@@ -52,8 +49,7 @@ int main(int argc, char **argv)
     //==========
     if (exists(opt.path_pq) && exists(opt.path_norm_pq)) {
         std::cout << "Loading Residual PQ codebook from " << opt.path_pq << std::endl;
-        if (index->pq) delete index->pq;
-        index->pq = faiss::read_ProductQuantizer(opt.path_pq);
+        index->codec->read(opt.path_pq);
 
         if (opt.do_opq){
             std::cout << "Loading OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
@@ -66,10 +62,7 @@ int main(int argc, char **argv)
     else {
         // Load learn set
         std::vector<float> trainvecs(opt.nt * opt.d);
-        {
-            std::ifstream learn_input(opt.path_learn, std::ios::binary);
-            readXvecFvec<uint8_t>(learn_input, trainvecs.data(), opt.d, opt.nt);
-        }
+        XvecDataset<uint8_t>(opt.path_learn, opt.d).read(0, opt.nt, trainvecs.data());
         // Set Random Subset of sub_nt trainvecs
         std::vector<float> trainvecs_rnd_subset(opt.nsubt * opt.d);
         random_subset(trainvecs.data(), trainvecs_rnd_subset.data(), opt.d, opt.nt, opt.nsubt);
@@ -78,7 +71,7 @@ int main(int argc, char **argv)
         index->train_pq(opt.nsubt, trainvecs_rnd_subset.data());
 
         std::cout << "Saving Residual PQ codebook to " << opt.path_pq << std::endl;
-        faiss::write_ProductQuantizer(index->pq, opt.path_pq);
+        index->codec->write(opt.path_pq);
 
         if (opt.do_opq){
             std::cout << "Saving OPQ rotation matrix to " << opt.path_opq_matrix << std::endl;
@@ -95,11 +88,12 @@ int main(int argc, char **argv)
         std::cout << "Precomputing indices" << std::endl;
         StopW stopw = StopW();
 
-        std::ifstream input(opt.path_base, std::ios::binary);
+        XvecDataset<uint8_t> base(opt.path_base, opt.d);
         std::ofstream output(opt.path_precomputed_idxs, std::ios::binary);
 
         const uint32_t batch_size = 1000000;
         const size_t nbatches = opt.nb / batch_size;
+        XvecBatchReader<uint8_t> base_reader(base, batch_size);
 
         std::vector<float> batch(batch_size * opt.d);
         std::vector<idx_t> precomputed_idx(batch_size);
@@ -110,7 +104,7 @@ int main(int argc, char **argv)
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                           << (100.*i) / nbatches << "%" << std::endl;
             }
-            readXvecFvec<uint8_t>(input, batch.data(), opt.d, batch_size);
+            base_reader.next(batch.data());
             index->assign(batch_size, batch.data(), precomputed_idx.data());
 
             output.write((char *) &batch_size, sizeof(uint32_t));
@@ -128,22 +122,29 @@ int main(int argc, char **argv)
     } else {
         // Add elements
         StopW stopw = StopW();
-
-        std::ifstream base_input(opt.path_base, std::ios::binary);
-        std::ifstream idx_input(opt.path_precomputed_idxs, std::ios::binary);
+        index->spill_ratio = opt.spill_ratio;
 
         const size_t batch_size = 1000000;
         const size_t nbatches = opt.nb / batch_size;
         std::vector<float> batch(batch_size * opt.d);
         std::vector <idx_t> idx_batch(batch_size);
-        std::vector <idx_t> ids_batch(batch_size);
+        std::vector <label_t> ids_batch(batch_size);
 
-        for (size_t b = 0; b < nbatches; b++) {
+        // Build only the batches of the shard
+        const size_t first_batch = opt.shard * nbatches / opt.nshards;
+        const size_t last_batch = (opt.shard + 1) * nbatches / opt.nshards;
+
+        // Precomputed indices are stored as a vector of batch_size indices per batch
+        XvecDataset<uint8_t> base(opt.path_base, opt.d);
+        XvecDataset<idx_t> precomputed_idxs(opt.path_precomputed_idxs, batch_size);
+        XvecBatchReader<uint8_t> base_reader(base, batch_size, first_batch * batch_size);
+
+        for (size_t b = first_batch; b < last_batch; b++) {
             if (b % 10 == 0) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] " << (100. * b) / nbatches << "%\n";
             }
-            readXvec<idx_t>(idx_input, idx_batch.data(), batch_size, 1);
-            readXvecFvec<uint8_t>(base_input, batch.data(), opt.d, batch_size);
+            precomputed_idxs.read(b, 1, idx_batch.data());
+            base_reader.next(batch.data());
 
             for (size_t i = 0; i < batch_size; i++)
                 ids_batch[i] = batch_size * b + i;
@@ -158,12 +159,36 @@ int main(int argc, char **argv)
         // Save index, pq and norm_pq
         std::cout << "Saving index to " << opt.path_index << std::endl;
         index->write(opt.path_index);
+
+        if (opt.nshards > 1) {
+            std::cout << "Shard " << opt.shard << " of " << opt.nshards << " is built, "
+                      << "merge the shards with tools/merge_shards" << std::endl;
+            return 0;
+        }
+    }
+    //===============================
+    // Serve inverted lists from SSD
+    //===============================
+    if (opt.path_ondisk_lists) {
+        if (!exists(opt.path_ondisk_lists)) {
+            std::cout << "Saving inverted lists to " << opt.path_ondisk_lists << std::endl;
+            index->write_ondisk_lists(opt.path_ondisk_lists);
+        }
+        std::cout << "Serving inverted lists from " << opt.path_ondisk_lists << std::endl;
+        index->load_ondisk_lists(opt.path_ondisk_lists, 16, opt.ondisk_cache_mb << 20);
     }
+    // Compress vector indices of in-memory inverted lists
+    if (opt.do_compress_ids)
+        index->compress_ids();
+
     // For correct search using OPQ encoding rotate points in the coarse quantizer
     if (opt.do_opq) {
         std::cout << "Rotating centroids"<< std::endl;
         index->rotate_quantizer();
     }
+    // Replicate the quantizer and the codebooks per NUMA node and partition inverted lists between nodes
+    if (opt.do_numa)
+        index->place_numa();
 
     //===================
     // Parse groundtruth
@@ -179,18 +204,30 @@ int main(int argc, char **argv)
     //=======================
     index->nprobe = opt.nprobe;
     index->max_codes = opt.max_codes;
+    index->probe_ratio = opt.probe_ratio;
+    index->stop_codes = opt.stop_codes;
+    index->nthreads_per_query = opt.nthreads_per_query;
     index->quantizer->efSearch = opt.efSearch;
+    if (opt.path_search_params) {
+        SearchParams params;
+        params.read(opt.path_search_params);
+        params.apply(index);
+    }
 
     //========
     // Search
     //========
     size_t correct = 0;
-    float distances[opt.k];
-    long labels[opt.k];
+    std::vector<float> distances(opt.nq * opt.k);
+    std::vector<long> labels(opt.nq * opt.k);
 
     StopW stopw = StopW();
+    // Threads pinned to the NUMA nodes search the queries on the nodes holding most of their probed lists
+    if (opt.do_numa)
+        index->search_numa(opt.nq, opt.k, massQ.data(), distances.data(), labels.data(), opt.nthreads_per_node);
     for (size_t i = 0; i < opt.nq; i++) {
-        index->search(opt.k, massQ.data() + i*opt.d, distances, labels);
+        if (!opt.do_numa)
+            index->search(opt.k, massQ.data() + i*opt.d, distances.data() + i*opt.k, labels.data() + i*opt.k);
         std::priority_queue<std::pair<float, idx_t >> gt(answers[i]);
         std::unordered_set<idx_t> g;
 
@@ -200,7 +237,7 @@ int main(int argc, char **argv)
         }
 
         for (size_t j = 0; j < opt.k; j++)
-            if (g.count(labels[j]) != 0) {
+            if (g.count(labels[i*opt.k + j]) != 0) {
                 correct++;
                 break;
             }
@@ -212,6 +249,11 @@ int main(int argc, char **argv)
     const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
     std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
     std::cout << "Time per query: " << time_us_per_query << " us" << std::endl;
+    if (opt.do_numa) {
+        const char *estimated = index->numa_stats.measured ? "" : " (estimated from the intended placement)";
+        std::cout << "Local list traffic: " << index->numa_stats.local_bytes / (1 << 20) << " MB" << estimated << std::endl;
+        std::cout << "Remote list traffic: " << index->numa_stats.remote_bytes / (1 << 20) << " MB" << estimated << std::endl;
+    }
 
     delete index;
     return 0;
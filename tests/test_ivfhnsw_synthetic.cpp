@@ -0,0 +1,265 @@
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include "SyntheticSetup.h"
+
+using namespace ivfhnsw;
+
+/// Time and hardware counters of each stage of the stats per item
+template<typename Stats>
+static void print_profile(const Stats &stats, size_t n, const char *item)
+{
+    for (size_t stage = 0; stage < Stats::nstages; stage++) {
+        std::cout << "    " << Stats::stage_name(stage) << ": " << stats.stage_ns[stage] / 1000.0 / n << " us";
+        const PerfSample &sample = stats.stage_perf[stage];
+        if (stats.perf) {
+            for (size_t e = 0; e < PerfSample::nevents; e++)
+                std::cout << ", " << PerfSample::event_name(e) << " " << 1.0 * sample.values[e] / n;
+            std::cout << ", ipc " << sample.ipc();
+        }
+        std::cout << " per " << item << std::endl;
+    }
+}
+
+/** Search all queries single-threaded, report Recall@k as the tests and QPS
+  *
+  * Queries with an id found twice fail the check.
+  * If profile is set, the queries are searched once more with SearchStats to report their stages.
+*/
+static bool check(IndexIVF_HNSW *index, const SyntheticSetup &s, float min_recall, float min_qps, const char *name,
+                  bool profile, const PerfCounters *perf)
+{
+    std::vector<float> distances(s.k);
+    std::vector<long> labels(s.k);
+    size_t correct = 0;
+    size_t nduplicates = 0;
+
+    StopW stopw = StopW();
+    for (size_t q = 0; q < s.nq; q++) {
+        index->search(s.k, s.queries.data() + q * s.d, distances.data(), labels.data());
+        for (size_t j = 0; j < s.k; j++)
+            if (labels[j] == s.gt[q]) {
+                correct++;
+                break;
+            }
+        std::sort(labels.begin(), labels.end());
+        if (std::adjacent_find(labels.begin(), labels.end(), [](long a, long b) { return a == b && a != -1; })
+                != labels.end())
+            nduplicates++;
+    }
+    const float recall = 1.0f * correct / s.nq;
+    const float qps = s.nq / (stopw.getElapsedTimeMicro() / 1000000);
+
+    const bool passed = recall >= min_recall && qps >= min_qps && nduplicates == 0;
+    std::cout << name << ": Recall@" << s.k << " " << recall << " (min " << min_recall << "), "
+              << "QPS " << qps << " (min " << min_qps << ")";
+    if (nduplicates)
+        std::cout << ", " << nduplicates << " queries with duplicate ids";
+    std::cout << " " << (passed ? "passed" : "FAILED") << std::endl;
+
+    if (profile) {
+        IndexIVF_HNSW::SearchBuffers buffers;
+        SearchStats stats;
+        stats.perf = perf;
+        buffers.stats = &stats;
+        for (size_t q = 0; q < s.nq; q++)
+            index->search(s.k, s.queries.data() + q * s.d, distances.data(), labels.data(), buffers);
+        std::cout << name << " search stages:" << std::endl;
+        print_profile(stats, s.nq, "query");
+    }
+    return passed;
+}
+
+//=====================================================
+// IVF-HNSW and IVF-HNSW + Grouping on synthetic data
+//=====================================================
+// End-to-end test registered in ctest: generates a
+// clustered dataset in memory, builds both indexes
+// and checks Recall@10 (and single-threaded QPS with
+// -min_qps, the floor depends on the machine),
+// IVF-HNSW also with adaptive probing fitted on
+// held-out queries and with spilled vectors read back
+// from a file. The quantizer and index files are written
+// to work_dir.
+//=====================================================
+int main(int argc, char **argv) {
+    SyntheticSetup s = {64, 1000000, 100000, 1000, 4096, 16, 10};
+    size_t nsubc = 64;
+    float min_recall = 0.75;
+    float min_qps = 0;
+    bool profile = false;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-nb"))
+            s.nb = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-d"))
+            s.d = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc"))
+            s.nc = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-min_recall"))
+            min_recall = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-min_qps"))
+            min_qps = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-profile"))
+            profile = true;
+        else
+            break;
+    }
+    if (argc - arg != 1 || s.d % s.code_size || s.nt < s.nc) {
+        std::cout << "Usage: " << argv[0] << " [options] work_dir\n"
+                  << "    -nb #           Number of base vectors, default: 1000000\n"
+                  << "    -d #            Vector dimension, a multiple of 16, default: 64\n"
+                  << "    -nc #           Number of coarse centroids, default: 4096\n"
+                  << "    -min_recall #   Min Recall@10 of each index\n"
+                  << "    -min_qps #      Min single-threaded queries per second of each index, default: 0 - not checked\n"
+                  << "    -profile        Report time and hardware counters of the add_batch and search stages\n";
+        return 1;
+    }
+    const std::string work_dir = argv[arg];
+
+    try {
+        s.prepare(work_dir, "synthetic");
+
+        // Held-out queries to fit the adaptive probing
+        std::vector<float> train_queries(s.nq * s.d);
+        s.data().generate(SyntheticData::queries, s.nq, s.nq, train_queries.data());
+        const std::vector<long> train_gt = s.nearest(s.nq, train_queries.data());
+
+        bool passed = true;
+
+        // Counters of the calling thread for search, of all threads for add_batch
+        std::unique_ptr<PerfCounters> perf, team_perf;
+        if (profile) {
+            perf.reset(new PerfCounters());
+            team_perf.reset(new PerfCounters(true));
+            if (!perf->available() || !team_perf->available()) {
+                std::cout << "Hardware counters are not available, only time is reported" << std::endl;
+                perf.reset();
+                team_perf.reset();
+            }
+        }
+
+        //==========
+        // IVF-HNSW
+        //==========
+        {
+            IndexIVF_HNSW index(s.d, s.nc, s.code_size, 8);
+            index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+            index.do_opq = false;
+            index.train_pq(s.nt, s.learn.data());
+
+            std::vector<label_t> ids(s.nb);
+            for (size_t i = 0; i < s.nb; i++)
+                ids[i] = i;
+            index.quantizer->efSearch = 220;
+            AddStats add_stats;
+            add_stats.perf = team_perf.get();
+            if (profile)
+                index.add_stats = &add_stats;
+            index.add_batch(s.nb, s.base.data(), ids.data());
+            index.add_stats = nullptr;
+            index.compute_centroid_norms();
+            if (profile) {
+                std::cout << "IVF-HNSW add_batch stages:" << std::endl;
+                print_profile(add_stats, s.nb, "vector");
+            }
+
+            index.nprobe = 32;
+            index.max_codes = 10000;
+            index.quantizer->efSearch = 80;
+            passed &= check(&index, s, min_recall, min_qps, "IVF-HNSW", profile, perf.get());
+
+            // Probe the lists by the coarse distances and stop the scans that stall
+            std::vector<IndexIVF_HNSW::idx_t> train_gt_idxs(train_gt.begin(), train_gt.end());
+            index.train_probe_ratio(s.nq, train_queries.data(), train_gt_idxs.data(), 1, 0.99);
+            index.stop_codes = 4000;
+            std::cout << "Adaptive probing: probe_ratio " << index.probe_ratio << ", stop_codes "
+                      << index.stop_codes << std::endl;
+            passed &= check(&index, s, min_recall, min_qps, "IVF-HNSW adaptive", profile, perf.get());
+        }
+
+        //========================
+        // IVF-HNSW with spilling
+        //========================
+        {
+            IndexIVF_HNSW index(s.d, s.nc, s.code_size, 8);
+            index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+            index.do_opq = false;
+            index.train_pq(s.nt, s.learn.data());
+
+            std::vector<label_t> ids(s.nb);
+            for (size_t i = 0; i < s.nb; i++)
+                ids[i] = i;
+            index.quantizer->efSearch = 220;
+            index.spill_ratio = 1.2;
+            AddStats add_stats;
+            index.add_stats = &add_stats;
+            index.add_batch(s.nb, s.base.data(), ids.data());
+            index.add_stats = nullptr;
+            index.compute_centroid_norms();
+            std::cout << "Spilled " << add_stats.nspilled << " of " << s.nb << " vectors" << std::endl;
+
+            // Duplicates are removed by the mark of the index file, without spill_ratio
+            const std::string path_index = work_dir + "/synthetic_spill.index";
+            index.write(path_index.c_str());
+            index.spill_ratio = 0;
+            index.has_spill = false;
+            index.read(path_index.c_str());
+            if (!index.has_spill) {
+                std::cout << "IVF-HNSW spill: the index file does not record spilled vectors FAILED" << std::endl;
+                passed = false;
+            }
+
+            index.nprobe = 32;
+            index.max_codes = 10000;
+            index.quantizer->efSearch = 80;
+            passed &= check(&index, s, min_recall, min_qps, "IVF-HNSW spill", profile, perf.get());
+        }
+
+        //=====================
+        // IVF-HNSW + Grouping
+        //=====================
+        {
+            IndexIVF_HNSW_Grouping index(s.d, s.nc, s.code_size, 8, nsubc);
+            index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+            index.do_opq = false;
+            index.train_pq(s.nt, s.learn.data());
+
+            std::vector<IndexIVF_HNSW::idx_t> assigned(s.nb);
+            index.quantizer->efSearch = 220;
+            index.assign(s.nb, s.base.data(), assigned.data());
+
+            std::vector<std::vector<float>> group_data(s.nc);
+            std::vector<std::vector<label_t>> group_ids(s.nc);
+            for (size_t i = 0; i < s.nb; i++) {
+                group_data[assigned[i]].insert(group_data[assigned[i]].end(),
+                                               s.base.data() + i * s.d, s.base.data() + (i + 1) * s.d);
+                group_ids[assigned[i]].push_back(i);
+            }
+            #pragma omp parallel for
+            for (size_t c = 0; c < s.nc; c++)
+                index.add_group(c, group_ids[c].size(), group_data[c].data(), group_ids[c].data());
+            index.compute_centroid_norms();
+            index.compute_inter_centroid_dists();
+
+            index.nprobe = 64;
+            index.max_codes = 10000;
+            index.quantizer->efSearch = 100;
+            index.do_pruning = true;
+            passed &= check(&index, s, min_recall, min_qps, "IVF-HNSW + Grouping",
+                            profile, perf.get());
+        }
+        return passed ? 0 : 1;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <ivf-hnsw/SegmentedIndex.h>
+#include "SyntheticSetup.h"
+
+using namespace ivfhnsw;
+
+/// Ids of the vectors added, removed and replaced by the writers
+struct Workload
+{
+    size_t nb;
+    size_t removed_begin;      ///< Removed ids [removed_begin, removed_end)
+    size_t removed_end;
+    size_t nupserted;          ///< Ids [0, nupserted) are added twice
+
+    bool is_removed(long id) const { return id >= (long) removed_begin && id < (long) removed_end; }
+};
+
+/** Check the results of a query: ids are known and unique, and no removed id is found if all removes are done
+  *
+  * @return number of the errors
+*/
+static size_t check_result(const Workload &w, size_t k, const long *labels, bool removes_done)
+{
+    std::vector<long> sorted(labels, labels + k);
+    std::sort(sorted.begin(), sorted.end());
+    size_t nerrors = 0;
+    for (size_t j = 0; j < k; j++) {
+        if (sorted[j] == -1)
+            continue;
+        if (sorted[j] < 0 || sorted[j] >= (long) w.nb || (j > 0 && sorted[j] == sorted[j - 1]))
+            nerrors++;
+        else if (removes_done && w.is_removed(sorted[j]))
+            nerrors++;
+    }
+    return nerrors;
+}
+
+/// Search all queries, report Recall@k and check the results
+static bool check(const SegmentedIndex &index, const Workload &w, const SyntheticSetup &s, float min_recall,
+                  const char *name)
+{
+    std::vector<float> distances(s.k);
+    std::vector<long> labels(s.k);
+    size_t correct = 0;
+    size_t nerrors = 0;
+    for (size_t q = 0; q < s.nq; q++) {
+        index.search(s.k, s.queries.data() + q * s.d, distances.data(), labels.data());
+        if (std::find(labels.begin(), labels.end(), s.gt[q]) != labels.end())
+            correct++;
+        nerrors += check_result(w, s.k, labels.data(), true);
+    }
+    const float recall = 1.0f * correct / s.nq;
+    const bool passed = recall >= min_recall && nerrors == 0;
+    std::cout << name << ": " << index.nsegments() << " segments, Recall@" << s.k << " " << recall
+              << " (min " << min_recall << ")";
+    if (nerrors)
+        std::cout << ", " << nerrors << " unknown, duplicate or removed ids";
+    std::cout << " " << (passed ? "passed" : "FAILED") << std::endl;
+    return passed;
+}
+
+//===================================================
+// SegmentedIndex under concurrent updates
+//===================================================
+// Test registered in ctest: a writer adds synthetic
+// vectors in batches, sealing small segments that the
+// background thread merges, while other threads
+// upsert and remove vectors and search concurrently.
+// Results of the concurrent searches must hold known
+// unique ids, and the ids being upserted must stay
+// visible to the searches by their own vectors. Once the
+// updates are done, the number of live vectors, removed
+// ids and Recall@10 are checked before and after merging
+// all segments. The quantizer files are written to
+// work_dir.
+//===================================================
+int main(int argc, char **argv) {
+    SyntheticSetup s = {64, 200000, 50000, 1000, 1024, 16, 10};
+    size_t batch_size = 1000;
+    size_t nsearchers = 2;
+    float spill_ratio = 1.2;
+    float min_recall = 0.75;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-nb"))
+            s.nb = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc"))
+            s.nc = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nsearchers"))
+            nsearchers = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-spill_ratio"))
+            spill_ratio = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-min_recall"))
+            min_recall = atof(argv[++arg]);
+        else
+            break;
+    }
+    if (argc - arg != 1 || s.nb < 20 * batch_size || s.nt < s.nc) {
+        std::cout << "Usage: " << argv[0] << " [options] work_dir\n"
+                  << "    -nb #           Number of base vectors, at least 20000, default: 200000\n"
+                  << "    -nc #           Number of coarse centroids, default: 1024\n"
+                  << "    -nsearchers #   Number of threads searching during the updates, default: 2\n"
+                  << "    -spill_ratio #  Spill ratio of the added vectors (0 - off), default: 1.2\n"
+                  << "    -min_recall #   Min Recall@10 once the updates are done\n";
+        return 1;
+    }
+    const std::string work_dir = argv[arg];
+
+    // A tenth of the vectors is removed after it is added, a tenth is added twice
+    Workload w = {s.nb, s.nb / 2, s.nb / 2 + s.nb / 10, s.nb / 10};
+
+    try {
+        s.prepare(work_dir, "segmented", w.removed_begin, w.removed_end);
+
+        IndexIVF_HNSW index(s.d, s.nc, s.code_size, 8);
+        index.build_quantizer(s.path_centroids.c_str(), s.path_info.c_str(), s.path_edges.c_str());
+        index.do_opq = false;
+        index.train_pq(s.nt, s.learn.data());
+        index.quantizer->efSearch = 80;
+        index.nprobe = 32;
+        index.max_codes = 10000;
+        index.spill_ratio = spill_ratio;
+
+        //==============================
+        // Concurrent updates and search
+        //==============================
+        // Small segments, so that the background thread merges many times
+        SegmentedIndex segmented(&index, s.nb / 40, 4);
+        std::atomic<size_t> nadded(0);
+        std::atomic<size_t> nwriters(3);
+        std::atomic<size_t> nremoved(0);
+        std::atomic<size_t> nsearch_errors(0);
+        std::atomic<size_t> nsearches(0);
+        // Upserted ids missing from the results of the search by their own vector, with the k-th distance found
+        std::vector<std::vector<std::pair<long, float> > > missed(nsearchers);
+
+        auto add_range = [&](size_t begin, size_t end) {
+            std::vector<label_t> ids(batch_size);
+            for (size_t b = begin; b < end; b += batch_size) {
+                const size_t n = std::min(batch_size, end - b);
+                for (size_t i = 0; i < n; i++)
+                    ids[i] = b + i;
+                segmented.add(n, s.base.data() + b * s.d, ids.data());
+                if (begin == 0 && end == s.nb)
+                    nadded = b + n;
+            }
+        };
+        // Wait for the writer to add the ids before the range
+        auto wait_added = [&](size_t end) {
+            while (nadded < end)
+                std::this_thread::yield();
+        };
+
+        std::vector<std::thread> threads;
+        threads.emplace_back([&]() {
+            add_range(0, s.nb);
+            nwriters--;
+        });
+        threads.emplace_back([&]() {
+            wait_added(w.nupserted);
+            add_range(0, w.nupserted);
+            nwriters--;
+        });
+        threads.emplace_back([&]() {
+            std::vector<label_t> ids(batch_size);
+            for (size_t b = w.removed_begin; b < w.removed_end; b += batch_size) {
+                const size_t n = std::min(batch_size, w.removed_end - b);
+                wait_added(b + n);
+                for (size_t i = 0; i < n; i++)
+                    ids[i] = b + i;
+                nremoved += segmented.remove(n, ids.data());
+            }
+            nwriters--;
+        });
+        for (size_t t = 0; t < nsearchers; t++)
+            threads.emplace_back([&, t]() {
+                std::vector<float> distances(s.k);
+                std::vector<long> labels(s.k);
+                for (size_t q = t; nwriters > 0; q = (q + nsearchers) % s.nq) {
+                    segmented.search(s.k, s.queries.data() + q * s.d, distances.data(), labels.data());
+                    nsearch_errors += check_result(w, s.k, labels.data(), false);
+                    nsearches++;
+
+                    // An upserted id is live all along, the old or the new copy is found unless k closer codes are
+                    if (nadded < w.nupserted)
+                        continue;
+                    const long id = q * 7919 % w.nupserted;
+                    segmented.search(s.k, s.base.data() + id * s.d, distances.data(), labels.data());
+                    if (std::find(labels.begin(), labels.end(), id) == labels.end())
+                        missed[t].push_back(std::make_pair(id, *std::max_element(distances.begin(), distances.end())));
+                    nsearches++;
+                }
+            });
+        for (std::thread &thread : threads)
+            thread.join();
+
+        bool passed = true;
+        std::cout << nsearches << " searches during the updates";
+        if (nsearch_errors) {
+            std::cout << ", " << nsearch_errors << " unknown or duplicate ids FAILED" << std::endl;
+            passed = false;
+        } else
+            std::cout << " passed" << std::endl;
+
+        // Both copies of an upserted id have the same code, so its distance is known from a search now
+        size_t nhidden = 0;
+        for (size_t t = 0; t < nsearchers; t++)
+            for (const std::pair<long, float> &miss : missed[t]) {
+                std::vector<float> distances(s.k);
+                std::vector<long> labels(s.k);
+                segmented.search(s.k, s.base.data() + miss.first * s.d, distances.data(), labels.data());
+                const size_t pos = std::find(labels.begin(), labels.end(), miss.first) - labels.begin();
+                if (pos < s.k && distances[pos] < miss.second)
+                    nhidden++;
+            }
+        if (nhidden) {
+            std::cout << nhidden << " searches missed upserted ids closer than their results FAILED" << std::endl;
+            passed = false;
+        }
+
+        const size_t nremoved_expected = w.removed_end - w.removed_begin;
+        const size_t ntotal = segmented.ntotal();
+        if (nremoved != nremoved_expected || ntotal != s.nb - nremoved_expected) {
+            std::cout << "Removed " << nremoved << " of " << nremoved_expected << " vectors, " << ntotal
+                      << " live vectors of " << s.nb - nremoved_expected << " FAILED" << std::endl;
+            passed = false;
+        }
+
+        //========================
+        // Search once updates end
+        //========================
+        segmented.flush();
+        passed &= check(segmented, w, s, min_recall, "Tiered segments");
+        segmented.merge();
+        passed &= check(segmented, w, s, min_recall, "Merged segments");
+        if (segmented.nsegments() != 1 || segmented.ntotal() != s.nb - nremoved_expected) {
+            std::cout << "Merge left " << segmented.nsegments() << " segments and " << segmented.ntotal()
+                      << " live vectors FAILED" << std::endl;
+            passed = false;
+        }
+        return passed ? 0 : 1;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
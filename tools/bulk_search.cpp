@@ -0,0 +1,432 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <unistd.h>
+#include <omp.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexLoader.h>
+#include <ivf-hnsw/Dataset.h>
+#include <ivf-hnsw/SearchTuner.h>
+
+using namespace ivfhnsw;
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// FIFO of bounded capacity between two stages of the pipeline
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity): capacity(capacity), closed(false) {}
+
+    /// Wait for room and append the item, false if the queue is closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /// Wait for an item, false once the queue is closed and empty
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /// Wake up the waiting stages, items in the queue can still be popped
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+/// Queries of a batch and their results, recycled through the pipeline
+struct Batch
+{
+    size_t i0;                      ///< Position of the first query in the query file
+    size_t n;                       ///< Number of queries
+    std::vector<float> queries;     ///< Queries, size n * d
+    std::vector<float> distances;   ///< Distances to the neighbours, size n * k
+    std::vector<long> labels;       ///< Ids of the neighbours, size n * k
+};
+
+/// Queries done and the number of neighbours, written after the results of the queries are flushed
+struct Checkpoint
+{
+    size_t ndone;
+    size_t k;
+    size_t id_size;    ///< Size of the ids in the labels, sizeof(result_id_t) of the build that wrote them
+
+    bool read(const std::string &path)
+    {
+        std::ifstream input(path);
+        if (!input)
+            return false;
+        std::string name_done, name_k, name_id_size;
+        if (!(input >> name_done >> ndone >> name_k >> k >> name_id_size >> id_size) ||
+            name_done != "done" || name_k != "k" || name_id_size != "id_size")
+            throw std::runtime_error("Malformed checkpoint " + path);
+        return true;
+    }
+
+    /// Replace the checkpoint by renaming a complete file over it
+    void write(const std::string &path) const
+    {
+        const std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream output(tmp_path);
+            output << "done " << ndone << "\nk " << k << "\nid_size " << id_size << "\n";
+            if (!output)
+                throw std::runtime_error("Unable to write " + tmp_path);
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("Unable to rename " + tmp_path + " to " + path);
+    }
+};
+
+/// Open a result file to append the records after the first <nrecords>, dropping the records written after them
+static void open_results(std::ofstream &output, const char *path, size_t nrecords, size_t record_size)
+{
+    if (nrecords == 0) {
+        output.open(path, std::ios::binary | std::ios::trunc);
+    } else {
+        std::ifstream input(path, std::ios::binary | std::ios::ate);
+        if (!input || size_t(input.tellg()) < nrecords * record_size)
+            throw std::runtime_error(std::string(path) + " is shorter than its checkpoint");
+        if (truncate(path, nrecords * record_size) != 0)
+            throw std::runtime_error(std::string("Unable to truncate ") + path);
+        output.open(path, std::ios::binary | std::ios::app);
+    }
+    if (!output)
+        throw std::runtime_error(std::string("Unable to open ") + path);
+}
+
+//===================================================================
+// Offline search of a large query file
+//===================================================================
+// Loads an index built by the tests and searches the queries of a
+// memory-mapped fvecs/bvecs file in batches. A reader thread
+// converts the batches ahead of the compute workers, each worker
+// runs search_batch() with its own search buffers and the results
+// are written in query order as ivecs labels (i64vecs built with
+// IVFHNSW_64BIT_IDS, see result_id_t) and, optionally, fvecs
+// distances. The stages pass a fixed set of batches through bounded
+// queues, so the batches in flight and the memory are bounded.
+//
+// After each written batch the outputs are flushed and the number of
+// queries done is saved to the checkpoint. A rerun with the same
+// outputs resumes from the checkpoint, results written after it are
+// dropped. Index and search options are the options of the tests,
+// queries are read from -path_q.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    bool bvecs = false;
+    size_t nworkers = omp_get_max_threads();
+    size_t batch_size = 4096;
+    size_t nbatches = 0;
+    size_t count = 0;
+    const char *path_labels = nullptr;
+    const char *path_distances = nullptr;
+    const char *path_checkpoint = nullptr;
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (!strcmp(argv[arg], "-grouping"))
+            grouping = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-nworkers"))
+            nworkers = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-batch_size"))
+            batch_size = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nbatches"))
+            nbatches = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-count"))
+            count = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-path_labels"))
+            path_labels = argv[++arg];
+        else if (!strcmp(argv[arg], "-path_distances"))
+            path_distances = argv[++arg];
+        else if (!strcmp(argv[arg], "-path_checkpoint"))
+            path_checkpoint = argv[++arg];
+    }
+    if (!path_labels || nworkers == 0 || batch_size == 0) {
+        std::cout << "Usage: " << argv[0] << " [test options] -path_labels filename [bulk options]\n"
+                  << "    -path_labels filename      Path to write the ids of the k neighbours to in ivecs,\n"
+                  << "                               i64vecs if built with IVFHNSW_64BIT_IDS\n"
+                  << "    -path_distances filename   Path to write their distances to in fvecs, optional\n"
+                  << "    -path_checkpoint filename  Path to the checkpoint, default: path_labels.checkpoint\n"
+                  << "    -grouping on/off           Index is IVF-HNSW + Grouping, built with -nsubc\n"
+                  << "    -bvecs on/off              Queries are stored in bvecs format, fvecs otherwise\n"
+                  << "    -nworkers #                Number of search threads, default: all\n"
+                  << "    -batch_size #              Number of queries per batch, default: 4096\n"
+                  << "    -nbatches #                Number of batches in flight, default: 2 * nworkers + 2\n"
+                  << "    -count #                   Number of queries to search, default: 0 (the whole file)\n"
+                  << "Test options describe the index and the search parameters as for tests/, see Parser.h\n";
+        return 1;
+    }
+    Parser opt = Parser(argc, argv);
+    const std::string checkpoint_path = path_checkpoint ? path_checkpoint
+                                                        : std::string(path_labels) + ".checkpoint";
+    if (nbatches == 0)
+        nbatches = 2 * nworkers + 2;
+    const size_t k = opt.k;
+    const size_t d = opt.d;
+
+    try {
+        // The query file is mapped, the reader converts the batches
+        std::unique_ptr<XvecDataset<uint8_t> > byte_queries;
+        std::unique_ptr<XvecDataset<float> > float_queries;
+        size_t nq;
+        if (bvecs) {
+            byte_queries.reset(new XvecDataset<uint8_t>(opt.path_q, d));
+            nq = byte_queries->size();
+        } else {
+            float_queries.reset(new XvecDataset<float>(opt.path_q, d));
+            nq = float_queries->size();
+        }
+        if (count)
+            nq = std::min(nq, count);
+
+        Checkpoint checkpoint = {0, k, sizeof(result_id_t)};
+        if (checkpoint.read(checkpoint_path)) {
+            if (checkpoint.k != k)
+                throw std::runtime_error("Checkpoint " + checkpoint_path + " is for k = " +
+                                         std::to_string(checkpoint.k));
+            if (checkpoint.id_size != sizeof(result_id_t))
+                throw std::runtime_error("Checkpoint " + checkpoint_path + " is for " +
+                                         std::to_string(8 * checkpoint.id_size) + "-bit ids, see IVFHNSW_64BIT_IDS");
+            std::cout << "Resuming after " << checkpoint.ndone << " queries from " << checkpoint_path << std::endl;
+        }
+        const size_t start = std::min(checkpoint.ndone, nq);
+
+        std::ofstream labels_output, distances_output;
+        open_results(labels_output, path_labels, start, sizeof(uint32_t) + k * sizeof(result_id_t));
+        if (path_distances)
+            open_results(distances_output, path_distances, start, sizeof(uint32_t) + k * sizeof(float));
+
+        IndexIVF_HNSW *index = load_index(opt, grouping);
+        index->nprobe = opt.nprobe;
+        index->max_codes = opt.max_codes;
+        index->probe_ratio = opt.probe_ratio;
+        index->stop_codes = opt.stop_codes;
+        index->quantizer->efSearch = opt.efSearch;
+        if (grouping)
+            dynamic_cast<IndexIVF_HNSW_Grouping *>(index)->do_pruning = opt.do_pruning;
+        if (opt.path_search_params) {
+            SearchParams params;
+            params.read(opt.path_search_params);
+            params.apply(index);
+        }
+        // Workers search different batches, each batch is scanned by its worker
+        index->nthreads_per_query = 1;
+
+        // Batches cycle free -> reader -> input -> worker -> output -> writer -> free
+        BoundedQueue<std::unique_ptr<Batch> > free_batches(nbatches);
+        BoundedQueue<std::unique_ptr<Batch> > input(nbatches);
+        BoundedQueue<std::unique_ptr<Batch> > output(nbatches);
+        for (size_t b = 0; b < nbatches; b++) {
+            std::unique_ptr<Batch> batch(new Batch());
+            batch->queries.resize(batch_size * d);
+            batch->distances.resize(batch_size * k);
+            batch->labels.resize(batch_size * k);
+            free_batches.push(std::move(batch));
+        }
+
+        // The first error stops all stages
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        auto fail = [&](std::exception_ptr e) {
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = e;
+            }
+            free_batches.close();
+            input.close();
+            output.close();
+        };
+
+        std::cout << "Searching " << nq - start << " queries with " << nworkers << " workers, R@" << k
+                  << ", batches of " << batch_size << std::endl;
+        const Clock::time_point start_time = Clock::now();
+
+        // Seconds the stages waited for the previous stage
+        double reader_wait = 0;
+        std::vector<double> worker_wait(nworkers, 0);
+        std::vector<double> worker_busy(nworkers, 0);
+        double writer_wait = 0;
+
+        std::thread reader([&] {
+            try {
+                std::unique_ptr<Batch> batch;
+                for (size_t i0 = start; i0 < nq; i0 += batch_size) {
+                    Clock::time_point wait_start = Clock::now();
+                    if (!free_batches.pop(batch))
+                        return;
+                    reader_wait += seconds_since(wait_start);
+
+                    batch->i0 = i0;
+                    batch->n = std::min(batch_size, nq - i0);
+                    if (bvecs) {
+                        byte_queries->read(i0, batch->n, batch->queries.data());
+                        byte_queries->prefetch(i0 + batch->n, batch_size);
+                    } else {
+                        float_queries->read(i0, batch->n, batch->queries.data());
+                        float_queries->prefetch(i0 + batch->n, batch_size);
+                    }
+                    if (!input.push(std::move(batch)))
+                        return;
+                }
+                input.close();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+
+        std::atomic<size_t> nworkers_running(nworkers);
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < nworkers; w++)
+            workers.emplace_back([&, w] {
+                try {
+                    IndexIVF_HNSW::SearchBuffers buffers;
+                    std::unique_ptr<Batch> batch;
+                    while (true) {
+                        Clock::time_point wait_start = Clock::now();
+                        if (!input.pop(batch))
+                            break;
+                        worker_wait[w] += seconds_since(wait_start);
+
+                        Clock::time_point search_start = Clock::now();
+                        index->search_batch(batch->n, k, batch->queries.data(), batch->distances.data(),
+                                            batch->labels.data(), buffers);
+                        worker_busy[w] += seconds_since(search_start);
+                        if (!output.push(std::move(batch)))
+                            break;
+                    }
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+                // The last worker ends the output
+                if (--nworkers_running == 0)
+                    output.close();
+            });
+
+        // Write the batches in query order, checkpointing after each one
+        try {
+            std::vector<std::unique_ptr<Batch> > pending(nbatches);
+            std::vector<result_id_t> labels(batch_size * k);
+            size_t next = start;
+            size_t last_report = start;
+            std::unique_ptr<Batch> batch;
+            while (next < nq) {
+                Clock::time_point wait_start = Clock::now();
+                if (!output.pop(batch))
+                    break;
+                writer_wait += seconds_since(wait_start);
+
+                // At most nbatches are in flight, so a batch is at most nbatches - 1 batches ahead
+                const size_t slot = (batch->i0 - start) / batch_size % nbatches;
+                pending[slot] = std::move(batch);
+                size_t next_slot = (next - start) / batch_size % nbatches;
+                while (next < nq && pending[next_slot] && pending[next_slot]->i0 == next) {
+                    std::unique_ptr<Batch> done = std::move(pending[next_slot]);
+                    for (size_t i = 0; i < done->n * k; i++)
+                        labels[i] = done->labels[i];
+                    writeXvec<result_id_t>(labels_output, labels.data(), k, done->n);
+                    labels_output.flush();
+                    if (path_distances) {
+                        writeXvec<float>(distances_output, done->distances.data(), k, done->n);
+                        distances_output.flush();
+                    }
+                    if (!labels_output || (path_distances && !distances_output))
+                        throw std::runtime_error("Unable to write the results");
+
+                    next += done->n;
+                    checkpoint.ndone = next;
+                    checkpoint.write(checkpoint_path);
+                    free_batches.push(std::move(done));
+                    next_slot = (next - start) / batch_size % nbatches;
+                }
+
+                if (next - last_report >= 100 * batch_size || next == nq) {
+                    const double elapsed = seconds_since(start_time);
+                    std::cout << next << " / " << nq << " queries, " << (next - start) / elapsed << " QPS"
+                              << std::endl;
+                    last_report = next;
+                }
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+
+        reader.join();
+        for (std::thread &worker : workers)
+            worker.join();
+        if (error)
+            std::rethrow_exception(error);
+        if (checkpoint.ndone < nq)
+            throw std::runtime_error("Search stopped after " + std::to_string(checkpoint.ndone) + " queries");
+
+        // Workers waiting for queries mean the search is bound by reading, the reader waiting for free
+        // batches means it is bound by the search or the writer
+        const double elapsed = seconds_since(start_time);
+        double total_wait = 0, total_busy = 0;
+        for (size_t w = 0; w < nworkers; w++) {
+            total_wait += worker_wait[w];
+            total_busy += worker_busy[w];
+        }
+        std::cout << "Searched " << nq - start << " queries in " << elapsed << " s, "
+                  << (nq - start) / elapsed << " QPS\n"
+                  << "Workers searching " << 100 * total_busy / (nworkers * elapsed) << "% of the time, waiting for "
+                  << "queries " << 100 * total_wait / (nworkers * elapsed) << "%\n"
+                  << "Reader waiting for free batches " << 100 * reader_wait / elapsed << "%, writer waiting for "
+                  << "results " << 100 * writer_wait / elapsed << "%" << std::endl;
+
+        delete index;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
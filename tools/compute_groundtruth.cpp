@@ -0,0 +1,135 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+
+#include <ivf-hnsw/GroundTruth.h>
+#include <ivf-hnsw/Dataset.h>
+#include <ivf-hnsw/utils.h>
+
+using namespace ivfhnsw;
+
+/// Stream the base vectors after the checkpointed ones in blocks, checkpointing after each block
+template<typename T>
+static void compute(GroundTruth &gt, const char *path_base, size_t nb,
+                    size_t block_size, const char *path_checkpoint)
+{
+    XvecDataset<T> base(path_base, gt.d);
+    if (nb == 0 || nb > base.size())
+        nb = base.size();
+
+    XvecBatchReader<T> reader(base, block_size, gt.ntotal, nb);
+    std::vector<float> block(block_size * gt.d);
+    StopW stopw = StopW();
+    size_t n;
+    while ((n = reader.next(block.data()))) {
+        gt.add(n, block.data(), reader.position() - n);
+        if (path_checkpoint)
+            gt.write_checkpoint(path_checkpoint);
+        std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
+                  << gt.ntotal << " / " << nb << " base vectors" << std::endl;
+    }
+}
+
+template<typename T>
+static std::vector<float> read_queries(const char *path_queries, size_t d)
+{
+    XvecDataset<T> dataset(path_queries, d);
+    std::vector<float> queries(dataset.size() * d);
+    dataset.read(0, dataset.size(), queries.data());
+    return queries;
+}
+
+//===================================================================
+// Compute exact L2 ground truth of a query set over a base set
+//===================================================================
+// The output ivecs file holds k ids per query, as the downloaded
+// ground truth, and is passed to the tests as -path_gt.
+// Memory: the queries, 2 * nq * k heaps and one block of base vectors.
+// With -checkpoint the heaps are saved after each block and
+// an interrupted run resumes from the checkpoint.
+// The number of threads is controlled with OMP_NUM_THREADS.
+//===================================================================
+int main(int argc, char **argv) {
+    bool bvecs = false;
+    size_t k = 100;
+    size_t nb = 0;
+    size_t block_size = 1000000;
+    const char *path_dists = nullptr;
+    const char *path_checkpoint = nullptr;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = true;
+        else if (!strcmp(argv[arg], "-k"))
+            k = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nb"))
+            nb = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-block"))
+            block_size = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-path_dists"))
+            path_dists = argv[++arg];
+        else if (!strcmp(argv[arg], "-checkpoint"))
+            path_checkpoint = argv[++arg];
+        else
+            break;
+    }
+    if (argc - arg != 4 || k == 0 || block_size == 0) {
+        std::cout << "Usage: " << argv[0] << " [options] path_base path_queries path_gt d\n"
+                  << "    -bvecs          Base and query vectors are stored in bvecs format, fvecs otherwise\n"
+                  << "    -k #            Number of nearest neighbours per query\n"
+                  << "    -nb #           Number of base vectors to search, all by default\n"
+                  << "    -block #        Number of base vectors per block\n"
+                  << "    -path_dists     Path to write the distances to in fvecs format\n"
+                  << "    -checkpoint     Path to the checkpoint to resume from and update after each block\n";
+        return 1;
+    }
+    const char *path_base = argv[arg];
+    const char *path_queries = argv[arg + 1];
+    const char *path_gt = argv[arg + 2];
+    const size_t d = atol(argv[arg + 3]);
+
+    try {
+        std::cout << "Loading queries from " << path_queries << std::endl;
+        const std::vector<float> queries = bvecs ? read_queries<uint8_t>(path_queries, d)
+                                                 : read_queries<float>(path_queries, d);
+        const size_t nq = queries.size() / d;
+        GroundTruth gt(d, nq, k, queries.data());
+
+        if (path_checkpoint && exists(path_checkpoint)) {
+            gt.read_checkpoint(path_checkpoint);
+            std::cout << "Resuming from " << path_checkpoint << " after " << gt.ntotal << " base vectors" << std::endl;
+        }
+
+        std::cout << "Searching " << k << " nearest neighbours of " << nq << " queries" << std::endl;
+        if (bvecs)
+            compute<uint8_t>(gt, path_base, nb, block_size, path_checkpoint);
+        else
+            compute<float>(gt, path_base, nb, block_size, path_checkpoint);
+
+        std::vector<float> distances(nq * k);
+        std::vector<long> labels(nq * k);
+        gt.get(distances.data(), labels.data());
+
+        std::cout << "Saving ground truth to " << path_gt << std::endl;
+        std::vector<int> ids(labels.begin(), labels.end());
+        std::ofstream gt_output(path_gt, std::ios::binary);
+        writeXvec<int>(gt_output, ids.data(), k, nq);
+        if (!gt_output)
+            throw std::runtime_error(std::string("Unable to write ") + path_gt);
+
+        if (path_dists) {
+            std::cout << "Saving distances to " << path_dists << std::endl;
+            std::ofstream dists_output(path_dists, std::ios::binary);
+            writeXvec<float>(dists_output, distances.data(), k, nq);
+            if (!dists_output)
+                throw std::runtime_error(std::string("Unable to write ") + path_dists);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
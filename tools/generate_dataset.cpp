@@ -0,0 +1,171 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <ivf-hnsw/SyntheticData.h>
+#include <ivf-hnsw/GroundTruth.h>
+#include <ivf-hnsw/HierarchicalKMeans.h>
+#include <ivf-hnsw/utils.h>
+
+using namespace ivfhnsw;
+
+/// Write n float vectors as fvecs or, rounded by the generator, as bvecs
+static void write_vectors(std::ofstream &output, const float *x, size_t d, size_t n, bool bvecs)
+{
+    if (bvecs) {
+        std::vector<uint8_t> bytes(x, x + n * d);
+        writeXvec<uint8_t>(output, bytes.data(), d, n);
+    } else
+        writeXvec<float>(output, (float *) x, d, n);
+}
+
+static void open_output(std::ofstream &output, const std::string &path)
+{
+    output.open(path, std::ios::binary);
+    if (!output)
+        throw std::runtime_error("Unable to open " + path);
+}
+
+static void check_output(const std::ofstream &output, const std::string &path)
+{
+    if (!output)
+        throw std::runtime_error("Unable to write " + path);
+}
+
+//===================================================================
+// Generate a synthetic clustered dataset
+//===================================================================
+// Writes <prefix>_base, _learn and _query in fvecs (bvecs with
+// -bvecs), the exact ground truth <prefix>_groundtruth.ivecs and
+// coarse centroids <prefix>_centroids.fvecs trained on the learn set.
+// The files are passed to the tests as -path_base, -path_learn,
+// -path_q, -path_gt and -path_centroids.
+// Memory: the learn set, the queries and one batch of base vectors.
+//===================================================================
+int main(int argc, char **argv) {
+    bool bvecs = false;
+    size_t nb = 1000000;
+    size_t nt = 100000;
+    size_t nq = 1000;
+    size_t k = 100;
+    size_t nc = 4096;
+    size_t nclusters = 1000;
+    float cluster_std = 20;
+    float skew = 0;
+    long seed = 1;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = true;
+        else if (!strcmp(argv[arg], "-nb"))
+            nb = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nt"))
+            nt = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nq"))
+            nq = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-k"))
+            k = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc"))
+            nc = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nclusters"))
+            nclusters = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-cluster_std"))
+            cluster_std = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-skew"))
+            skew = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-seed"))
+            seed = atol(argv[++arg]);
+        else
+            break;
+    }
+    if (argc - arg != 2 || nb == 0 || nq == 0 || k == 0 || nc == 0 || nt < nc) {
+        std::cout << "Usage: " << argv[0] << " [options] path_prefix d\n"
+                  << "    -bvecs           Write base, learn and query vectors in bvecs format, fvecs otherwise\n"
+                  << "    -nb #            Number of base vectors\n"
+                  << "    -nt #            Number of learn vectors, at least nc\n"
+                  << "    -nq #            Number of queries\n"
+                  << "    -k #             Number of ground truth neighbours per query\n"
+                  << "    -nc #            Number of coarse centroids to train\n"
+                  << "    -nclusters #     Number of clusters of the data\n"
+                  << "    -cluster_std #   Standard deviation of vectors around their cluster center, values are in [0, 255]\n"
+                  << "    -skew #          Zipf exponent of cluster sizes, 0 - equal clusters\n"
+                  << "    -seed #          Seed of the data\n";
+        return 1;
+    }
+    const std::string prefix = argv[arg];
+    const size_t d = atol(argv[arg + 1]);
+    const char *ext = bvecs ? ".bvecs" : ".fvecs";
+
+    try {
+        SyntheticData data(d, nclusters, cluster_std, skew, bvecs, seed);
+
+        std::cout << "Generating " << nt << " learn vectors and " << nq << " queries" << std::endl;
+        std::vector<float> learn(nt * d);
+        data.generate(SyntheticData::learn, 0, nt, learn.data());
+        std::vector<float> queries(nq * d);
+        data.generate(SyntheticData::queries, 0, nq, queries.data());
+
+        const std::string path_learn = prefix + "_learn" + ext;
+        std::ofstream learn_output;
+        open_output(learn_output, path_learn);
+        write_vectors(learn_output, learn.data(), d, nt, bvecs);
+        check_output(learn_output, path_learn);
+
+        const std::string path_queries = prefix + "_query" + ext;
+        std::ofstream queries_output;
+        open_output(queries_output, path_queries);
+        write_vectors(queries_output, queries.data(), d, nq, bvecs);
+        check_output(queries_output, path_queries);
+
+        // Base vectors are generated, written and searched for the ground truth batch by batch
+        std::cout << "Generating " << nb << " base vectors" << std::endl;
+        const std::string path_base = prefix + "_base" + ext;
+        std::ofstream base_output;
+        open_output(base_output, path_base);
+
+        GroundTruth gt(d, nq, k, queries.data());
+        const size_t batch_size = 1000000;
+        std::vector<float> batch(std::min(batch_size, nb) * d);
+        StopW stopw = StopW();
+        for (size_t i0 = 0; i0 < nb; i0 += batch_size) {
+            const size_t n = std::min(batch_size, nb - i0);
+            data.generate(SyntheticData::base, i0, n, batch.data());
+            write_vectors(base_output, batch.data(), d, n, bvecs);
+            gt.add(n, batch.data(), i0);
+            std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
+                      << i0 + n << " / " << nb << " base vectors" << std::endl;
+        }
+        check_output(base_output, path_base);
+
+        const std::string path_gt = prefix + "_groundtruth.ivecs";
+        std::cout << "Saving ground truth to " << path_gt << std::endl;
+        std::vector<float> distances(nq * k);
+        std::vector<long> labels(nq * k);
+        gt.get(distances.data(), labels.data());
+        std::vector<int> ids(labels.begin(), labels.end());
+        std::ofstream gt_output;
+        open_output(gt_output, path_gt);
+        writeXvec<int>(gt_output, ids.data(), k, nq);
+        check_output(gt_output, path_gt);
+
+        const std::string path_centroids = prefix + "_centroids.fvecs";
+        std::cout << "Training " << nc << " centroids" << std::endl;
+        HierarchicalKMeans kmeans(d, nc);
+        std::vector<float> centroids(nc * d);
+        kmeans.train(nt, learn.data(), centroids.data());
+        std::cout << "Saving centroids to " << path_centroids << std::endl;
+        std::ofstream centroids_output;
+        open_output(centroids_output, path_centroids);
+        writeXvec<float>(centroids_output, centroids.data(), d, nc);
+        check_output(centroids_output, path_centroids);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <stdexcept>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexLoader.h>
+
+using namespace ivfhnsw;
+
+/// Nearest-rank percentile of sorted values
+template<typename T>
+static T percentile(const std::vector<T> &sorted, double p)
+{
+    const size_t rank = std::max<size_t>(1, std::ceil(p / 100 * sorted.size()));
+    return sorted[rank - 1];
+}
+
+/// Min, mean, percentiles and max of the values
+template<typename T>
+static void print_distribution(std::vector<T> values, const char *name)
+{
+    if (values.empty()) {
+        std::cout << name << ": none\n";
+        return;
+    }
+    std::sort(values.begin(), values.end());
+    const double mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    std::cout << name << ": min " << values.front() << ", mean " << mean
+              << ", p50 " << percentile(values, 50) << ", p90 " << percentile(values, 90)
+              << ", p99 " << percentile(values, 99) << ", max " << values.back() << "\n";
+}
+
+/// Counts of the values in power of two buckets: 0, 1, 2-3, 4-7, ...
+static void print_log2_histogram(const std::vector<size_t> &values, const char *name)
+{
+    std::vector<size_t> counts;
+    for (size_t value : values) {
+        size_t bucket = 0;
+        while (value >> bucket)
+            bucket++;
+        if (bucket >= counts.size())
+            counts.resize(bucket + 1, 0);
+        counts[bucket]++;
+    }
+    std::cout << name << " histogram:\n";
+    for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+        if (counts[bucket] == 0)
+            continue;
+        const size_t lo = bucket ? size_t(1) << (bucket - 1) : 0;
+        const size_t hi = bucket ? (size_t(1) << bucket) - 1 : 0;
+        const std::string range = lo == hi ? std::to_string(lo) : std::to_string(lo) + "-" + std::to_string(hi);
+        std::cout << "    " << std::setw(21) << range << ": "
+                  << counts[bucket] << " (" << 100.0 * counts[bucket] / values.size() << "%)\n";
+    }
+}
+
+/// Counts of the values in <nbins> equal bins between their min and max
+static void print_linear_histogram(const std::vector<float> &values, size_t nbins, const char *name)
+{
+    if (values.empty())
+        return;
+    const float lo = *std::min_element(values.begin(), values.end());
+    const float hi = *std::max_element(values.begin(), values.end());
+    const float width = (hi - lo) / nbins;
+    std::vector<size_t> counts(nbins, 0);
+    for (float value : values) {
+        const size_t bin = width > 0 ? std::min<size_t>((value - lo) / width, nbins - 1) : 0;
+        counts[bin]++;
+    }
+    std::cout << name << " histogram:\n";
+    for (size_t bin = 0; bin < nbins; bin++)
+        std::cout << "    [" << lo + bin * width << ", " << lo + (bin + 1) * width << "): " << counts[bin]
+                  << " (" << 100.0 * counts[bin] / values.size() << "%)\n";
+}
+
+static void print_memory(const IndexIVF_HNSW::MemoryUsage &usage)
+{
+    const double total = std::max<size_t>(usage.total(), 1);
+    const std::pair<const char *, size_t> parts[] = {
+            {"quantizer", usage.quantizer},
+            {"codebooks", usage.codebooks},
+            {"NUMA replicas", usage.replicas},
+            {"centroid norms", usage.centroid_norms},
+            {"ids", usage.ids},
+            {"codes", usage.codes},
+            {"norm codes", usage.norm_codes},
+            {"list overhead", usage.list_overhead},
+            {"grouping", usage.grouping},
+            {"on-disk list cache", usage.ondisk_cache},
+            {"search buffers", usage.search_buffers}};
+
+    std::cout << "Memory usage, MB:\n";
+    for (const auto &part : parts)
+        std::cout << "    " << std::setw(18) << part.first << ": " << std::setw(10) << part.second / 1048576.0
+                  << " (" << 100.0 * part.second / total << "%)\n";
+    std::cout << "    " << std::setw(18) << "total" << ": " << std::setw(10) << usage.total() / 1048576.0 << "\n";
+}
+
+/// Sizes of the inverted lists: distribution, empty lists, imbalance and the largest lists
+static void print_lists(const IndexIVF_HNSW &index, size_t ntop)
+{
+    std::vector<size_t> sizes(index.nc);
+    for (size_t i = 0; i < index.nc; i++)
+        sizes[i] = index.list_size(i);
+
+    const size_t total = std::accumulate(sizes.begin(), sizes.end(), size_t(0));
+    const size_t nempty = std::count(sizes.begin(), sizes.end(), 0);
+    double sum_squares = 0;
+    for (size_t size : sizes)
+        sum_squares += 1.0 * size * size;
+
+    std::cout << "Inverted lists: " << index.nc << " lists, " << total << " codes, "
+              << nempty << " empty (" << 100.0 * nempty / index.nc << "%)\n";
+    // 1 for lists of equal sizes, the expected number of codes scanned per probe relative to that
+    std::cout << "Imbalance factor: " << (total ? index.nc * sum_squares / (1.0 * total * total) : 0) << "\n";
+    print_distribution(sizes, "List size");
+    print_log2_histogram(sizes, "List size");
+
+    std::vector<size_t> order(index.nc);
+    std::iota(order.begin(), order.end(), 0);
+    ntop = std::min(ntop, index.nc);
+    std::partial_sort(order.begin(), order.begin() + ntop, order.end(),
+                      [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+    std::cout << "Largest lists:\n";
+    for (size_t i = 0; i < ntop; i++)
+        std::cout << "    centroid " << order[i] << ": " << sizes[order[i]] << " codes ("
+                  << (total ? 100.0 * sizes[order[i]] / total : 0) << "%)\n";
+}
+
+/// Sub-group sizes and alphas of the non-empty groups
+static void print_grouping(const IndexIVF_HNSW_Grouping &index)
+{
+    std::vector<size_t> subgroup_sizes;
+    std::vector<float> alphas;
+    for (size_t i = 0; i < index.nc; i++) {
+        if (index.list_size(i) == 0)
+            continue;
+        subgroup_sizes.insert(subgroup_sizes.end(), index.subgroup_sizes[i].begin(), index.subgroup_sizes[i].end());
+        alphas.push_back(index.alphas[i]);
+    }
+    const size_t nempty = std::count(subgroup_sizes.begin(), subgroup_sizes.end(), 0);
+    std::cout << "Sub-groups: " << subgroup_sizes.size() << " in non-empty groups, " << nempty << " empty ("
+              << (subgroup_sizes.empty() ? 0 : 100.0 * nempty / subgroup_sizes.size()) << "%)\n";
+    print_distribution(subgroup_sizes, "Sub-group size");
+    print_log2_histogram(subgroup_sizes, "Sub-group size");
+    print_distribution(alphas, "Alpha");
+    print_linear_histogram(alphas, 10, "Alpha");
+}
+
+/// Out- and in-degrees of the base layer of the quantizer
+static void print_graph(const hnswlib::HierarchicalNSW &graph)
+{
+    const size_t n = graph.cur_element_count;
+    std::vector<size_t> out_degrees(n);
+    std::vector<size_t> in_degrees(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *links = graph.get_linklist0(i);
+        out_degrees[i] = *links;
+        const hnswlib::idx_t *neighbors = (const hnswlib::idx_t *) (links + 1);
+        for (size_t j = 0; j < out_degrees[i]; j++)
+            in_degrees[neighbors[j]]++;
+    }
+    std::cout << "HNSW base layer: " << n << " vertices, max degree " << graph.maxM_ << ", "
+              << std::count(out_degrees.begin(), out_degrees.end(), graph.maxM_) << " vertices at max degree, "
+              << std::count(in_degrees.begin(), in_degrees.end(), 0) << " without incoming links\n";
+    print_distribution(out_degrees, "Out-degree");
+    print_distribution(in_degrees, "In-degree");
+}
+
+//===================================================================
+// Memory and skew diagnostics of an index
+//===================================================================
+// Loads an index built by the tests and reports the memory of its
+// components (see IndexIVF_HNSW::memory_usage), the distribution
+// of the inverted list sizes with the largest lists, sub-group
+// sizes and alphas of the grouping index and the degrees of the
+// HNSW base layer. Index options are the options of the tests,
+// -compress_ids, -numa and the options serving the inverted lists
+// from SSD change the memory reported.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    size_t ntop = 10;
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (!strcmp(argv[arg], "-grouping"))
+            grouping = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-top"))
+            ntop = atol(argv[++arg]);
+    }
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " [test options] [-grouping on/off] [-top #]\n"
+                  << "    -grouping on/off   Index is IVF-HNSW + Grouping, built with -nsubc\n"
+                  << "    -top #             Number of the largest lists to report, default: 10\n"
+                  << "Test options describe the index as for tests/, see Parser.h\n";
+        return 1;
+    }
+    Parser opt = Parser(argc, argv);
+
+    try {
+        IndexIVF_HNSW *index = load_index(opt, grouping);
+        std::cout << std::fixed << std::setprecision(3);
+
+        print_memory(index->memory_usage());
+        std::cout << "\n";
+        print_lists(*index, ntop);
+        if (grouping) {
+            std::cout << "\n";
+            print_grouping(*dynamic_cast<IndexIVF_HNSW_Grouping *>(index));
+        }
+        std::cout << "\n";
+        print_graph(*index->quantizer);
+
+        delete index;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
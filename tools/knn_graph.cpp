@@ -0,0 +1,107 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexLoader.h>
+
+using namespace ivfhnsw;
+
+//===================================================================
+// Approximate k-NN graph of the indexed vectors
+//===================================================================
+// Loads an index built by the tests and joins each inverted list
+// with itself and its -nadjacent nearest adjacent lists on the
+// vectors reconstructed from their codes (see knn_graph). Graph
+// records are written in list order as ivecs (i64vecs built with
+// IVFHNSW_64BIT_IDS, see result_id_t) of dimension k + 1:
+// the id of the vector followed by the ids of its k neighbours,
+// -1 if fewer are found. Distances are written as fvecs if
+// -path_distances is set. Index options are the options of the
+// tests, -k is the number of neighbours.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    size_t nadjacent = 8;
+    size_t chunk_size = 1024;
+    const char *path_graph = nullptr;
+    const char *path_distances = nullptr;
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (!strcmp(argv[arg], "-grouping"))
+            grouping = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-nadjacent"))
+            nadjacent = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-chunk_size"))
+            chunk_size = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-path_graph"))
+            path_graph = argv[++arg];
+        else if (!strcmp(argv[arg], "-path_distances"))
+            path_distances = argv[++arg];
+    }
+    if (!path_graph || chunk_size == 0) {
+        std::cout << "Usage: " << argv[0] << " [test options] -path_graph filename [graph options]\n"
+                  << "    -path_graph filename       Path to write the id and the ids of the k neighbours to in ivecs,\n"
+                  << "                               i64vecs if built with IVFHNSW_64BIT_IDS\n"
+                  << "    -path_distances filename   Path to write the distances to the neighbours to in fvecs, optional\n"
+                  << "    -grouping on/off           Index is IVF-HNSW + Grouping, built with -nsubc\n"
+                  << "    -nadjacent #               Number of adjacent lists joined with each list, default: 8\n"
+                  << "    -chunk_size #              Number of lists joined at a time, default: 1024\n"
+                  << "Test options describe the index as for tests/, see Parser.h\n";
+        return 1;
+    }
+    Parser opt = Parser(argc, argv);
+    const size_t k = opt.k;
+
+    try {
+        std::ofstream graph_output(path_graph, std::ios::binary);
+        if (!graph_output)
+            throw std::runtime_error(std::string("Unable to open ") + path_graph);
+        std::ofstream distances_output;
+        if (path_distances) {
+            distances_output.open(path_distances, std::ios::binary);
+            if (!distances_output)
+                throw std::runtime_error(std::string("Unable to open ") + path_distances);
+        }
+
+        IndexIVF_HNSW *index = load_index(opt, grouping);
+
+        std::cout << "Building the " << k << "-NN graph joining each list with " << nadjacent
+                  << " adjacent lists" << std::endl;
+        StopW stopw = StopW();
+        size_t nvectors = 0;
+        size_t next_report = 1000000;
+        std::vector<result_id_t> record(k + 1);
+        index->knn_graph(k, nadjacent, chunk_size,
+                         [&](size_t n, const label_t *ids, const long *labels, const float *distances) {
+            for (size_t i = 0; i < n; i++) {
+                record[0] = ids[i];
+                for (size_t j = 0; j < k; j++)
+                    record[j + 1] = labels[i * k + j];
+                writeXvec<result_id_t>(graph_output, record.data(), k + 1);
+            }
+            if (path_distances)
+                writeXvec<const float>(distances_output, distances, k, n);
+            if (!graph_output || (path_distances && !distances_output))
+                throw std::runtime_error("Unable to write the graph");
+
+            nvectors += n;
+            if (nvectors >= next_report) {
+                std::cout << nvectors << " vectors, " << nvectors / (stopw.getElapsedTimeMicro() / 1000000)
+                          << " vectors per second" << std::endl;
+                next_report = nvectors + 1000000;
+            }
+        });
+        std::cout << "Graph of " << nvectors << " vectors in " << stopw.getElapsedTimeMicro() / 1000000 << " s"
+                  << std::endl;
+
+        delete index;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
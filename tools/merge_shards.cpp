@@ -0,0 +1,43 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <stdexcept>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+
+using namespace ivfhnsw;
+
+//===================================================================
+// Merge indexes of shards built with the same quantizer and codebooks
+//===================================================================
+// IVF-HNSW shards are built over disjoint id ranges,
+// IVF-HNSW + Grouping shards over disjoint group ranges,
+// see -nshards and -shard options of the tests.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    int arg = 1;
+    if (arg < argc && !strcmp(argv[arg], "-grouping")) {
+        grouping = true;
+        arg++;
+    }
+    if (argc - arg < 2) {
+        std::cout << "Usage: " << argv[0] << " [-grouping] path_index path_shard1 [path_shard2 ...]\n"
+                  << "    -grouping    Merge IVF-HNSW + Grouping indexes\n";
+        return 1;
+    }
+    const char *path_index = argv[arg++];
+    std::vector<const char *> shard_paths(argv + arg, argv + argc);
+
+    try {
+        std::cout << "Merging " << shard_paths.size() << " shards into " << path_index << std::endl;
+        if (grouping)
+            IndexIVF_HNSW_Grouping::merge_shards(shard_paths, path_index);
+        else
+            IndexIVF_HNSW::merge_shards(shard_paths, path_index);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <random>
+#include <stdexcept>
+
+#include <ivf-hnsw/HierarchicalKMeans.h>
+#include <ivf-hnsw/Dataset.h>
+#include <ivf-hnsw/utils.h>
+
+using namespace ivfhnsw;
+
+/** Read a uniform sample of nt vectors from the fvecs/bvecs file in one pass
+  * (selection sampling, Knuth's Algorithm S), skipped vectors are never read from disk
+*/
+template<typename T>
+static void read_sample(const char *path, size_t d, size_t nt, long seed, std::vector<float> &sample)
+{
+    XvecDataset<T> dataset(path, d);
+    const size_t n = dataset.size();
+    if (nt == 0 || nt > n)
+        nt = n;
+
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    sample.resize(nt * d);
+    size_t nselected = 0;
+    for (size_t i = 0; i < n && nselected < nt; i++) {
+        if ((n - i) * uniform(rng) >= nt - nselected)
+            continue;
+        dataset.read(i, 1, sample.data() + nselected * d);
+        nselected++;
+    }
+}
+
+//===================================================================
+// Train coarse centroids with the two-level k-means
+//===================================================================
+// The output fvecs file is passed to the tests as -path_centroids.
+// Memory: nt learn vectors as floats plus the centroids.
+// The number of threads is controlled with OMP_NUM_THREADS.
+//===================================================================
+int main(int argc, char **argv) {
+    bool bvecs = false;
+    size_t nt = 0;
+    size_t nc1 = 0;
+    size_t niter = 10;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = true;
+        else if (!strcmp(argv[arg], "-nt"))
+            nt = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nc1"))
+            nc1 = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-niter"))
+            niter = atol(argv[++arg]);
+        else
+            break;
+    }
+    if (argc - arg != 4) {
+        std::cout << "Usage: " << argv[0] << " [options] path_learn path_centroids d nc\n"
+                  << "    -bvecs       Learn vectors are stored in bvecs format, fvecs otherwise\n"
+                  << "    -nt #        Number of learn vectors to sample, all by default\n"
+                  << "    -nc1 #       Number of top-level clusters, sqrt(nc) by default\n"
+                  << "    -niter #     Number of k-means iterations on each level\n";
+        return 1;
+    }
+    const char *path_learn = argv[arg];
+    const char *path_centroids = argv[arg + 1];
+    const size_t d = atol(argv[arg + 2]);
+    const size_t nc = atol(argv[arg + 3]);
+
+    try {
+        HierarchicalKMeans kmeans(d, nc);
+        kmeans.nc1 = nc1;
+        kmeans.niter = niter;
+
+        std::vector<float> learn;
+        std::cout << "Sampling learn vectors from " << path_learn << std::endl;
+        if (bvecs)
+            read_sample<uint8_t>(path_learn, d, nt, kmeans.seed, learn);
+        else
+            read_sample<float>(path_learn, d, nt, kmeans.seed, learn);
+
+        std::cout << "Training " << nc << " centroids on " << learn.size() / d << " vectors" << std::endl;
+        std::vector<float> centroids(nc * d);
+        kmeans.train(learn.size() / d, learn.data(), centroids.data());
+
+        std::cout << "Saving centroids to " << path_centroids << std::endl;
+        std::ofstream output(path_centroids, std::ios::binary);
+        writeXvec<float>(output, centroids.data(), d, nc);
+        if (!output)
+            throw std::runtime_error(std::string("Unable to write ") + path_centroids);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
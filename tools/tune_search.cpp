@@ -0,0 +1,108 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <omp.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/IndexLoader.h>
+#include <ivf-hnsw/Dataset.h>
+#include <ivf-hnsw/SearchTuner.h>
+
+using namespace ivfhnsw;
+
+//===================================================================
+// Search parameters of the highest QPS at a target recall
+//===================================================================
+// Loads an index built by the tests and finds nprobe, efSearch,
+// max_codes and pruning (grouping) of the highest QPS with
+// recall@k of at least -target_recall on held-out queries with
+// ground truth, searched by -nthreads threads (see SearchTuner).
+// The parameters are saved next to the index and are used by the
+// tests with -path_search_params. Index options are the options
+// of the tests, -nq queries of -path_q are the held-out queries.
+//===================================================================
+int main(int argc, char **argv) {
+    bool grouping = false;
+    bool bvecs = false;
+    bool verbose = false;
+    double target_recall = 0;
+    size_t nthreads = omp_get_max_threads();
+    size_t max_nprobe = 0;
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (!strcmp(argv[arg], "-grouping"))
+            grouping = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-bvecs"))
+            bvecs = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-verbose"))
+            verbose = !strcmp(argv[++arg], "on");
+        else if (!strcmp(argv[arg], "-target_recall"))
+            target_recall = atof(argv[++arg]);
+        else if (!strcmp(argv[arg], "-nthreads"))
+            nthreads = atol(argv[++arg]);
+        else if (!strcmp(argv[arg], "-max_nprobe"))
+            max_nprobe = atol(argv[++arg]);
+    }
+    if (target_recall <= 0 || target_recall > 1 || nthreads == 0) {
+        std::cout << "Usage: " << argv[0] << " [test options] -target_recall # [tuner options]\n"
+                  << "    -target_recall #        Recall@k to reach, in (0, 1]\n"
+                  << "    -grouping on/off        Index is IVF-HNSW + Grouping, built with -nsubc\n"
+                  << "    -bvecs on/off           Queries are stored in bvecs format, fvecs otherwise\n"
+                  << "    -verbose on/off         Print each measured setting\n"
+                  << "    -nthreads #             Number of threads searching the queries, default: all\n"
+                  << "    -max_nprobe #           Largest nprobe tried, default: min(nc, 1024)\n"
+                  << "Test options describe the index as for tests/, see Parser.h, the parameters are written\n"
+                  << "to -path_search_params, default: path_index.params\n";
+        return 1;
+    }
+    Parser opt = Parser(argc, argv);
+    const std::string params_path = opt.path_search_params ? opt.path_search_params
+                                                           : std::string(opt.path_index) + ".params";
+
+    try {
+        if (opt.ngt == 0 || opt.nq == 0 || opt.k == 0)
+            throw std::runtime_error("-nq, -ngt and -k have to be positive");
+
+        std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
+        std::vector<IndexIVF_HNSW::idx_t> gt(opt.nq * opt.ngt);
+        XvecDataset<IndexIVF_HNSW::idx_t>(opt.path_gt, opt.ngt).read(0, opt.nq, gt.data());
+
+        std::cout << "Loading queries from " << opt.path_q << std::endl;
+        std::vector<float> queries(opt.nq * opt.d);
+        if (bvecs)
+            XvecDataset<uint8_t>(opt.path_q, opt.d).read(0, opt.nq, queries.data());
+        else
+            XvecDataset<float>(opt.path_q, opt.d).read(0, opt.nq, queries.data());
+
+        IndexIVF_HNSW *index = load_index(opt, grouping);
+        // Threads search different queries, each query is scanned by its thread
+        index->nthreads_per_query = 1;
+
+        SearchTuner tuner(index, opt.nq, queries.data(), gt.data(), opt.ngt, opt.k, nthreads);
+        tuner.verbose = verbose;
+        if (max_nprobe)
+            tuner.max_nprobe = std::min(max_nprobe, opt.nc);
+
+        std::cout << "Tuning for R@" << opt.k << " " << target_recall << " with " << nthreads << " threads"
+                  << std::endl;
+        const SearchParams params = tuner.tune(target_recall);
+        const SearchTuner::Trial &best = tuner.best();
+        if (best.recall < target_recall)
+            std::cout << "The target recall is not reached, the parameters of the highest recall are kept" << std::endl;
+        std::cout << tuner.trials.size() << " settings measured, best: nprobe " << params.nprobe
+                  << " efSearch " << params.efSearch << " max_codes " << params.max_codes
+                  << " pruning " << (params.do_pruning ? "on" : "off")
+                  << ": R@" << opt.k << " " << best.recall << " QPS " << best.qps << std::endl;
+
+        std::cout << "Saving search parameters to " << params_path << std::endl;
+        params.write(params_path.c_str());
+
+        delete index;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
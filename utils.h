@@ -7,6 +7,8 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <stdexcept>
 #include <sys/time.h>
 
 #include <faiss/utils.h>
@@ -30,6 +32,20 @@
 #define EPS 0.00001
 
 namespace ivfhnsw {
+    /// Vector ids stored in inverted lists. Build with IVFHNSW_64BIT_IDS for indexes beyond 2^32 vectors
+#ifdef IVFHNSW_64BIT_IDS
+    typedef uint64_t label_t;
+#else
+    typedef uint32_t label_t;
+#endif
+
+    /// Vector ids in result files written by the tools, ivecs or i64vecs with IVFHNSW_64BIT_IDS. -1 pads missing ids
+#ifdef IVFHNSW_64BIT_IDS
+    typedef int64_t result_id_t;
+#else
+    typedef int32_t result_id_t;
+#endif
+
     /// Clock class
     class StopW {
         std::chrono::steady_clock::time_point time_begin;
@@ -64,6 +80,15 @@ namespace ivfhnsw {
         in.read((char *) vec.data(), size * sizeof(T));
     }
 
+    /// Skip std::vector of the arbitrary type written by write_vector
+    template<typename T>
+    void skip_vector(std::istream &in)
+    {
+        uint32_t size;
+        in.read((char *) &size, sizeof(uint32_t));
+        in.seekg(size * sizeof(T), std::ios::cur);
+    }
+
     /// Write variable of the arbitrary type
     template<typename T>
     void write_variable(std::ostream &out, const T &val) {
@@ -72,7 +97,7 @@ namespace ivfhnsw {
 
     /// Write std::vector in the fvec/ivec/bvec format
     template<typename T>
-    void write_vector(std::ostream &out, std::vector<T> &vec)
+    void write_vector(std::ostream &out, const std::vector<T> &vec)
     {
         const uint32_t size = vec.size();
         out.write((char *) &size, sizeof(uint32_t));
@@ -80,17 +105,15 @@ namespace ivfhnsw {
     }
 
 
-    /// Read fvec/ivec/bvec format vectors
+    /// Read fvec/ivec/bvec format vectors from a stream, see XvecDataset for reading files
     template<typename T>
     void readXvec(std::ifstream &in, T *data, const size_t d, const size_t n = 1)
     {
         uint32_t dim = d;
         for (size_t i = 0; i < n; i++) {
             in.read((char *) &dim, sizeof(uint32_t));
-            if (dim != d) {
-                std::cout << "file error\n";
-                exit(1);
-            }
+            if (!in || dim != d)
+                throw std::runtime_error("Vector dimension in the file is not " + std::to_string(d));
             in.read((char *) (data + i * dim), dim * sizeof(T));
         }
     }
@@ -115,16 +138,22 @@ namespace ivfhnsw {
 
         for (size_t i = 0; i < n; i++) {
             in.read((char *) &dim, sizeof(uint32_t));
-            if (dim != d) {
-                std::cout << "file error\n";
-                exit(1);
-            }
+            if (!in || dim != d)
+                throw std::runtime_error("Vector dimension in the file is not " + std::to_string(d));
             in.read((char *) mass, dim * sizeof(T));
             for (size_t j = 0; j < d; j++)
                 data[i * dim + j] = 1. * mass[j];
         }
     }
 
+    /// Add the bytes of the elements of the vector to <used>, its unused capacity and the vector object to <overhead>
+    template<typename T>
+    void count_memory(const std::vector<T> &vec, size_t &used, size_t &overhead)
+    {
+        used += vec.size() * sizeof(T);
+        overhead += (vec.capacity() - vec.size()) * sizeof(T) + sizeof(vec);
+    }
+
     /// Check if file exists
     inline bool exists(const char *path) {
         std::ifstream f(path);